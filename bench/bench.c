@@ -0,0 +1,389 @@
+/**
+ * Microbenchmarks for the hot paths of the library, on
+ * synthetic workloads with Zipf distributed names, so a few
+ * names get most of the samples as with real traffic.
+ *
+ * Each result is printed as a line of JSON, for example:
+ *
+ *   {"bench":"add_sample","type":"counter","names":100000,
+ *    "ops":2000000,"ns":81234567,"ns_per_op":40.6,
+ *    "ops_per_sec":24620000}
+ *
+ * The keys other than bench, ops, ns, ns_per_op and ops_per_sec
+ * are the parameters of the benchmark. The last line has the
+ * peak RSS of the process, in kilobytes.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <statsite.h>
+
+// Defaults, overridden by the command line
+#define DEFAULT_OPS 1000000
+#define DEFAULT_NAMES 100000
+#define DEFAULT_ZIPF 1.1
+
+// Quantiles queried by the timer benchmarks
+static double quantiles[] = { 0.5, 0.95, 0.99 };
+#define NUM_QUANTILES (sizeof(quantiles) / sizeof(quantiles[0]))
+
+struct bench_config {
+	uint64_t ops;				// Samples per benchmark
+	uint32_t names;				// Distinct names
+	double zipf;				// Exponent of the name distribution
+	const char *only;			// Only run the benchmarks with this prefix
+};
+
+// A workload, with the samples drawn up front
+struct workload {
+	uint32_t num_names;
+	char **names;				// Names, by rank
+	uint32_t *picks;			// Name of each sample
+	double *values;				// Value of each sample
+	uint64_t ops;
+};
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+// xorshift64*, fast and good enough for workloads
+static uint64_t rng_next(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+// Returns a uniform double on [0, 1)
+static double rng_double(void)
+{
+	return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Draws a workload. Name i is picked with a probability
+ * proportional to 1 / (i + 1)^s, by a binary search of
+ * the cumulative distribution.
+ * @return 0 on success, -1 on allocation failure.
+ */
+static int workload_init(uint32_t num_names, double s, uint64_t ops, struct workload *w)
+{
+	w->num_names = num_names;
+	w->ops = ops;
+	w->names = malloc(num_names * sizeof(char *));
+	w->picks = malloc(ops * sizeof(uint32_t));
+	w->values = malloc(ops * sizeof(double));
+	double *cdf = malloc(num_names * sizeof(double));
+	if (!w->names || !w->picks || !w->values || !cdf) {
+		free(cdf);
+		return -1;
+	}
+
+	char buf[64];
+	double total = 0;
+	for (uint32_t i = 0; i < num_names; i++) {
+		snprintf(buf, sizeof(buf), "bench.service%u.metric%u", i % 97, i);
+		w->names[i] = strdup(buf);
+		total += 1.0 / pow(i + 1, s);
+		cdf[i] = total;
+	}
+
+	for (uint64_t i = 0; i < ops; i++) {
+		double u = rng_double() * total;
+		uint32_t lo = 0, hi = num_names - 1;
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+			if (cdf[mid] < u)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		w->picks[i] = lo;
+		w->values[i] = rng_double() * 1000;
+	}
+	free(cdf);
+	return 0;
+}
+
+static void workload_destroy(struct workload *w)
+{
+	for (uint32_t i = 0; i < w->num_names; i++)
+		free(w->names[i]);
+	free(w->names);
+	free(w->picks);
+	free(w->values);
+}
+
+// Checks if a benchmark, or group of them, matches the -b prefix
+static int selected(const struct bench_config *conf, const char *bench)
+{
+	if (!conf->only)
+		return 1;
+	size_t len = strlen(conf->only);
+	if (strlen(bench) < len)
+		len = strlen(bench);
+	return !strncmp(bench, conf->only, len);
+}
+
+/**
+ * Prints a result as a line of JSON
+ * @arg params The parameters, as JSON members with a leading comma
+ */
+static void report(const char *bench, const char *params, uint64_t ops, uint64_t ns)
+{
+	double per_op = ops ? (double)ns / ops : 0;
+	double rate = ns ? ops * 1e9 / ns : 0;
+	printf("{\"bench\":\"%s\"%s,\"ops\":%llu,\"ns\":%llu,\"ns_per_op\":%.1f,\"ops_per_sec\":%.0f}\n",
+			bench, params, (unsigned long long)ops, (unsigned long long)ns, per_op, rate);
+	fflush(stdout);
+}
+
+// Measures the hash functions on the names
+static void bench_hash(const struct bench_config *conf, struct workload *w)
+{
+	static const struct {
+		const char *name;
+		uint64_t (*fn) (const void *, size_t);
+	} funcs[] = {
+		{ "murmur3", hash_murmur3 },
+		{ "wyhash", hash_wyhash },
+	};
+	char params[128];
+	size_t *lens = malloc(w->num_names * sizeof(size_t));
+	if (!lens)
+		return;
+	for (uint32_t i = 0; i < w->num_names; i++)
+		lens[i] = strlen(w->names[i]);
+	for (size_t f = 0; f < sizeof(funcs) / sizeof(funcs[0]); f++) {
+		volatile uint64_t sink = 0;
+		uint64_t start = now_ns();
+		for (uint64_t i = 0; i < w->ops; i++) {
+			uint32_t pick = w->picks[i];
+			sink ^= funcs[f].fn(w->names[pick], lens[pick]);
+		}
+		uint64_t ns = now_ns() - start;
+		snprintf(params, sizeof(params), ",\"function\":\"%s\"", funcs[f].name);
+		report("hash", params, w->ops, ns);
+	}
+	free(lens);
+}
+
+// Measures metrics_add_sample and metrics_set_update for each type
+static void bench_add_sample(const struct bench_config *conf, struct workload *w)
+{
+	static const struct {
+		const char *name;
+		enum metric_type type;
+	} types[] = {
+		{ "counter", metric_type_COUNTER },
+		{ "timer", metric_type_TIMER },
+		{ "gauge", metric_type_GAUGE },
+		{ "kv", metric_type_KEY_VAL },
+		{ "set", metric_type_SET },
+	};
+	char params[128];
+	char value[32];
+	for (size_t t = 0; t < sizeof(types) / sizeof(types[0]); t++) {
+		struct metrics m;
+		if (init_metrics(0.01, quantiles, NUM_QUANTILES, NULL, 12, SET_MAX_EXACT, &m))
+			return;
+		uint64_t start = now_ns();
+		for (uint64_t i = 0; i < w->ops; i++) {
+			char *name = w->names[w->picks[i]];
+			if (types[t].type == metric_type_SET) {
+				snprintf(value, sizeof(value), "%u", (uint32_t)w->values[i]);
+				metrics_set_update(&m, name, value);
+			} else {
+				metrics_add_sample(&m, types[t].type, name, w->values[i], 1.0);
+			}
+		}
+		uint64_t ns = now_ns() - start;
+		snprintf(params, sizeof(params), ",\"type\":\"%s\",\"names\":%u,\"zipf\":%.2f", types[t].name,
+				w->num_names, conf->zipf);
+		report("add_sample", params, w->ops, ns);
+		destroy_metrics(&m);
+	}
+}
+
+// Measures set_add on one set, and hll_add at a few precisions
+static void bench_sets(const struct bench_config *conf, struct workload *w)
+{
+	char params[128];
+	uint64_t start, ns;
+	set_t s;
+	if (set_init(12, &s, SET_MAX_EXACT))
+		return;
+	start = now_ns();
+	for (uint64_t i = 0; i < w->ops; i++)
+		set_add(&s, w->names[w->picks[i]]);
+	ns = now_ns() - start;
+	snprintf(params, sizeof(params), ",\"precision\":12,\"distinct\":%u", w->num_names);
+	report("set_add", params, w->ops, ns);
+	set_destroy(&s);
+
+	static const unsigned char precisions[] = { 10, 12, 14 };
+	for (size_t p = 0; p < sizeof(precisions); p++) {
+		hll_t h;
+		if (hll_init(precisions[p], &h))
+			return;
+		start = now_ns();
+		for (uint64_t i = 0; i < w->ops; i++)
+			hll_add(&h, w->names[w->picks[i]]);
+		ns = now_ns() - start;
+		snprintf(params, sizeof(params), ",\"precision\":%u,\"distinct\":%u", precisions[p], w->num_names);
+		report("hll_add", params, w->ops, ns);
+		hll_destroy(&h);
+	}
+}
+
+// Measures cm_quantile inserts, and queries once flushed
+static void bench_quantiles(const struct bench_config *conf, struct workload *w)
+{
+	static const double eps[] = { 0.01, 0.001, 0.0001 };
+	static const struct {
+		const char *name;
+		cm_buffer_mode mode;
+	} modes[] = {
+		{ "heap", CM_BUFFER_HEAP },
+		{ "array", CM_BUFFER_ARRAY },
+		{ "flat", CM_BUFFER_FLAT },
+	};
+	char params[128];
+	uint64_t queries = 10000;
+	for (size_t e = 0; e < sizeof(eps) / sizeof(eps[0]); e++) {
+		for (size_t md = 0; md < sizeof(modes) / sizeof(modes[0]); md++) {
+			cm_quantile cm;
+			if (init_cm_quantile_mode(eps[e], quantiles, NUM_QUANTILES, modes[md].mode, &cm))
+				return;
+			uint64_t start = now_ns();
+			for (uint64_t i = 0; i < w->ops; i++)
+				cm_add_sample(&cm, w->values[i]);
+			cm_flush(&cm);
+			uint64_t ns = now_ns() - start;
+			snprintf(params, sizeof(params), ",\"eps\":%g,\"mode\":\"%s\",\"samples\":%llu", eps[e],
+					modes[md].name, (unsigned long long)cm.num_samples);
+			report("cm_insert", params, w->ops, ns);
+
+			volatile double sink = 0;
+			start = now_ns();
+			for (uint64_t i = 0; i < queries; i++)
+				sink += cm_query(&cm, quantiles[i % NUM_QUANTILES]);
+			ns = now_ns() - start;
+			report("cm_query", params, queries, ns);
+			destroy_cm_quantile(&cm);
+		}
+	}
+}
+
+// Reads the timer quantiles, as a sink formatting them would
+static int flush_cb(void *data, enum metric_type type, char *name, void *val)
+{
+	double *sink = data;
+	if (type == metric_type_TIMER) {
+		timer *t = &((struct timer_hist *)val)->tm;
+		for (size_t i = 0; i < NUM_QUANTILES; i++)
+			*sink += timer_query(t, quantiles[i]);
+	} else if (type == metric_type_COUNTER) {
+		*sink += counter_sum(val);
+	}
+	return 0;
+}
+
+// Measures metrics_iter at growing cardinalities, up to the names
+static void bench_flush(const struct bench_config *conf, struct workload *w)
+{
+	char params[128];
+	for (uint32_t card = 1000; card <= w->num_names; card *= 10) {
+		struct metrics m;
+		if (init_metrics(0.01, quantiles, NUM_QUANTILES, NULL, 12, SET_MAX_EXACT, &m))
+			return;
+
+		// A counter and a few timer samples for each name
+		for (uint32_t i = 0; i < card; i++) {
+			metrics_add_sample(&m, metric_type_COUNTER, w->names[i], 1, 1.0);
+			for (int j = 0; j < 8; j++)
+				metrics_add_sample(&m, metric_type_TIMER, w->names[i], w->values[(i * 8 + j) % w->ops], 1.0);
+		}
+
+		double sink = 0;
+		uint64_t start = now_ns();
+		metrics_iter(&m, &sink, flush_cb);
+		uint64_t ns = now_ns() - start;
+		snprintf(params, sizeof(params), ",\"names\":%u", card);
+		report("metrics_iter", params, 2 * (uint64_t)card, ns);
+		destroy_metrics(&m);
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n ops] [-c names] [-s zipf] [-b bench prefix] [-w]\n", prog);
+	fprintf(stderr, "  -w  hash with wyhash instead of murmur3\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_config conf = { DEFAULT_OPS, DEFAULT_NAMES, DEFAULT_ZIPF, NULL };
+	int c;
+	while ((c = getopt(argc, argv, "n:c:s:b:wh")) != -1) {
+		switch (c) {
+		case 'n':
+			conf.ops = strtoull(optarg, NULL, 10);
+			break;
+		case 'c':
+			conf.names = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			conf.zipf = strtod(optarg, NULL);
+			break;
+		case 'b':
+			conf.only = optarg;
+			break;
+		case 'w':
+			hash_select(HASH_WYHASH);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (!conf.ops || !conf.names) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	struct workload w;
+	if (workload_init(conf.names, conf.zipf, conf.ops, &w)) {
+		fprintf(stderr, "failed to allocate the workload\n");
+		return 1;
+	}
+
+	if (selected(&conf, "hash"))
+		bench_hash(&conf, &w);
+	if (selected(&conf, "add_sample"))
+		bench_add_sample(&conf, &w);
+	if (selected(&conf, "set_add") || selected(&conf, "hll_add"))
+		bench_sets(&conf, &w);
+	if (selected(&conf, "cm_"))
+		bench_quantiles(&conf, &w);
+	if (selected(&conf, "metrics_iter"))
+		bench_flush(&conf, &w);
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	printf("{\"bench\":\"peak_rss\",\"kb\":%ld}\n", usage.ru_maxrss);
+	workload_destroy(&w);
+	return 0;
+}
@@ -4,8 +4,14 @@ AC_PROG_CC
 
 AC_PROG_LIBTOOL
 AC_PROG_CC_STDC
+AC_SEARCH_LIBS([pthread_create], [pthread])
 CFLAGS="$CFLAGS -Wall -Werror -std=c99"
 
+AC_ARG_ENABLE([perf-counters],
+	[AS_HELP_STRING([--enable-perf-counters], [count the work done on the hot paths])],
+	[], [enable_perf_counters=no])
+AS_IF([test "x$enable_perf_counters" = xyes], [CFLAGS="$CFLAGS -DSTATSITE_PERF_COUNTERS"])
+
 AC_CANONICAL_HOST
 case $host_os in
 	*linux*) CFLAGS="$CFLAGS -Dlinux -D_BSD_SOURCE -D_POSIX_SOURCE -D_GNU_SOURCE" ;;
@@ -15,4 +21,4 @@ esac
 
 LT_INIT
 
-AC_OUTPUT(Makefile include/Makefile include/statsite/Makefile src/Makefile)
+AC_OUTPUT(Makefile include/Makefile include/statsite/Makefile src/Makefile bench/Makefile)
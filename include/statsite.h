@@ -3,15 +3,25 @@
  * https://github.com/armon/statsite
  */
 #include <statsite/MurmurHash3.h>
+#include <statsite/buffered_metrics.h>
 #include <statsite/cm_quantile.h>
 #include <statsite/config.h>
 #include <statsite/counter.h>
+#include <statsite/ddsketch.h>
+#include <statsite/export.h>
+#include <statsite/hash.h>
 #include <statsite/hashmap.h>
 #include <statsite/heap.h>
+#include <statsite/histogram.h>
 #include <statsite/hll.h>
 #include <statsite/hll_constants.h>
 #include <statsite/ini.h>
 #include <statsite/metrics.h>
+#include <statsite/name_pool.h>
+#include <statsite/perf_counters.h>
 #include <statsite/radix.h>
 #include <statsite/set.h>
+#include <statsite/sharded_metrics.h>
+#include <statsite/snapshot.h>
 #include <statsite/timer.h>
+#include <statsite/windowed_metrics.h>
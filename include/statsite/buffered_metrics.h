@@ -0,0 +1,89 @@
+/**
+ * This module double buffers metrics, so a flush does not
+ * stall ingestion. Writers update the active generation,
+ * while a flush switches the writers over to the other
+ * generation, waits for the writers still inside the old
+ * one to leave, and then reports and recycles it with
+ * metrics_reset. The switch only uses atomic operations.
+ *
+ * A generation is a plain struct metrics, so writers must
+ * still be serialized between themselves, for example with
+ * one buffered_metrics per ingest thread. Only a single
+ * thread may flush at a time.
+ *
+ * Gauges carry over between generations: the flush keeps
+ * the last value of every gauge, and applies the updates
+ * made in the flushed generation on top of it.
+ */
+#ifndef BUFFERED_METRICS_H
+#define BUFFERED_METRICS_H
+#include <stddef.h>
+#include <stdint.h>
+#include "metrics.h"
+
+struct buffered_metrics {
+	struct metrics generations[2]; // The two generations
+	uint32_t active;               // Index of the generation being written
+	uint32_t writers[2];           // Number of writers in each generation
+	struct hashmap *gauges;        // Map of name -> last gauge value
+	uint32_t max_idle;             // Idle flushes before a metric is removed
+};
+
+/**
+ * Initializes the buffered metrics. Both generations are
+ * initialized with init_metrics using the same arguments.
+ * @arg eps The maximum error for the quantiles
+ * @arg quantiles A sorted array of double quantile values, must be on (0, 1)
+ * @arg num_quants The number of entries in the quantiles array
+ * @arg histograms A radix tree with histogram settings. It is not owned,
+ * and must exist for the life of the metrics.
+ * @arg set_precision The precision to use for sets
+ * @arg max_idle The number of idle flushes of a generation before
+ * a metric is removed from it, as for metrics_reset
+ * @return 0 on success.
+ */
+int init_buffered_metrics(double timer_eps, double *quantiles, uint32_t num_quants,
+		struct radix_tree * histograms, unsigned char set_precision,
+		uint64_t set_max_exact, uint32_t max_idle, struct buffered_metrics * bm);
+
+/**
+ * Destroys the buffered metrics, and both generations.
+ * @return 0 on success.
+ */
+int destroy_buffered_metrics(struct buffered_metrics * bm);
+
+/**
+ * Enters the active generation for writing. Must be
+ * paired with buffered_metrics_release.
+ * @return The generation to update.
+ */
+struct metrics *buffered_metrics_acquire(struct buffered_metrics * bm);
+
+/**
+ * Leaves a generation entered with buffered_metrics_acquire.
+ * @arg m The generation returned by buffered_metrics_acquire
+ */
+void buffered_metrics_release(struct buffered_metrics * bm, struct metrics * m);
+
+/**
+ * Adds a new sampled value to the active generation.
+ * @arg type The type of the metrics
+ * @arg name The name of the metric
+ * @arg val The sample to add
+ * @return 0 on success.
+ */
+int buffered_metrics_add_sample(struct buffered_metrics * bm, enum metric_type type, char *name,
+		double val, double sample_rate);
+
+/**
+ * Switches writers to the other generation, and iterates
+ * through the metrics of the old one as metrics_iter does.
+ * The old generation is then recycled for a later flush.
+ * @arg bm The metrics to flush
+ * @arg data Opaque handle passed to the callback
+ * @arg cb A callback function to invoke, as for metrics_iter
+ * @return 0 on success, or the return of the callback
+ */
+int buffered_metrics_flush(struct buffered_metrics * bm, void *data, metric_callback cb);
+
+#endif
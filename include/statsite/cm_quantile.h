@@ -9,6 +9,14 @@
 #include <stdint.h>
 #include "heap.h"
 
+// How incoming samples are buffered before insertion
+typedef enum {
+	CM_BUFFER_HEAP,				// Two heaps around the insertion cursor
+	CM_BUFFER_ARRAY,			// Flat array, sorted and merged in bulk
+	CM_BUFFER_FLAT				// As CM_BUFFER_ARRAY, and the summary is
+								// kept in contiguous arrays, not a list
+} cm_buffer_mode;
+
 typedef struct cm_sample {
 	double value;				// The sampled value
 	uint64_t width;				// The number of ranks represented
@@ -17,6 +25,21 @@ typedef struct cm_sample {
 	struct cm_sample *prev;
 } cm_sample;
 
+// A block of samples, carved up by the sample pool
+typedef struct cm_sample_block {
+	struct cm_sample_block *next;
+	uint32_t size;				// Number of samples in the block
+	cm_sample samples[];
+} cm_sample_block;
+
+// Slab pool of samples, released in bulk
+typedef struct {
+	cm_sample_block *blocks;	// Linked list of allocated blocks
+	cm_sample *free_list;		// Free samples, linked by next
+	uint64_t allocated;			// Number of samples in all blocks
+	uint64_t in_use;			// Number of samples handed out
+} cm_sample_pool;
+
 struct cm_insert_cursor {
 	cm_sample *curs;
 };
@@ -37,10 +60,25 @@ typedef struct {
 
 	cm_sample *samples;			// Sorted linked list of samples
 	cm_sample *end;				// Pointer to the end of the sampels
-	heap *bufLess, *bufMore;	// Sample buffer
+	dheap *bufLess, *bufMore;	// Sample buffer, in heap mode
+
+	cm_buffer_mode buffer_mode;	// How samples are buffered
+	uint64_t *array;			// Sortable sample keys, in array mode
+	uint32_t array_count;		// Number of buffered keys
+	uint32_t array_size;		// Allocated size of the array
+
+	// Summary in flat mode, as parallel arrays of num_samples
+	double *flat_values;		// Sorted sample values
+	uint64_t *flat_widths;		// Ranks represented by each sample
+	uint64_t *flat_deltas;		// Delta between min/max rank
+	uint64_t *flat_max_ranks;	// Running max of the max ranks, for queries
+	uint32_t flat_size;			// Allocated size of the arrays
+	int flat_ranks_valid;		// Are the max ranks up to date
 
 	struct cm_insert_cursor insert;	// Insertion cursor
 	struct cm_compress_cursor compress;	// Compression cursor
+
+	cm_sample_pool pool;		// Allocator for all the samples
 } cm_quantile;
 
 /**
@@ -53,6 +91,21 @@ typedef struct {
  */
 int init_cm_quantile(double eps, double *quantiles, uint32_t num_quants, cm_quantile * cm);
 
+/**
+ * Initializes the CM quantile struct with a given buffering mode.
+ * In array mode samples are appended to a flat array, which
+ * is sorted and merged into the summary in a single pass once
+ * it is as large as the summary, or on flush.
+ * @arg eps The maximum error for the quantiles
+ * @arg quantiles A sorted array of double quantile values, must be on (0, 1)
+ * @arg num_quants The number of entries in the quantiles array
+ * @arg mode The buffering mode to use
+ * @arg cm_quantile The cm_quantile struct to initialize
+ * @return 0 on success.
+ */
+int init_cm_quantile_mode(double eps, double *quantiles, uint32_t num_quants, cm_buffer_mode mode,
+		cm_quantile * cm);
+
 /**
  * Destroy the CM quantile struct.
  * @arg cm_quantile The cm_quantile to destroy
@@ -76,6 +129,29 @@ int cm_add_sample(cm_quantile * cm, double sample);
  */
 double cm_query(cm_quantile * cm, double quantile);
 
+/**
+ * Returns the minimum value in the summary. Only
+ * accurate after a flush.
+ * @arg cm_quantile The cm_quantile to query
+ * @return The minimum value, or 0 if empty.
+ */
+double cm_min(cm_quantile * cm);
+
+/**
+ * Returns the maximum value in the summary. Only
+ * accurate after a flush.
+ * @arg cm_quantile The cm_quantile to query
+ * @return The maximum value, or 0 if empty.
+ */
+double cm_max(cm_quantile * cm);
+
+/**
+ * Clears all the values, keeping the buffers and the
+ * sample pool allocated for reuse.
+ * @arg cm_quantile The cm_quantile to reset
+ */
+void cm_reset(cm_quantile * cm);
+
 /**
  * Forces the internal buffers to be flushed,
  * this allows query to have maximum accuracy.
@@ -84,4 +160,58 @@ double cm_query(cm_quantile * cm, double quantile);
  */
 int cm_flush(cm_quantile * cm);
 
+/**
+ * Returns the sample pool usage, for sizing.
+ * @arg cm_quantile The cm_quantile to query
+ * @arg in_use Output. The number of live samples
+ * @arg allocated Output. The number of samples allocated
+ * by the pool, including free ones.
+ */
+void cm_pool_usage(cm_quantile * cm, uint64_t *in_use, uint64_t *allocated);
+
+/**
+ * Returns the memory allocated by a CM quantile, including
+ * the free samples of its pool and its sample buffers.
+ * @arg cm_quantile The cm_quantile to query
+ * @return The size in bytes, without the struct itself.
+ */
+size_t cm_memory(cm_quantile * cm);
+
+/**
+ * Merges the samples of one CM quantile into another.
+ * Both are flushed first, and the merged summary is compressed
+ * using the epsilon and quantiles of the destination.
+ * @arg dst The cm_quantile to merge into
+ * @arg src The cm_quantile to merge from. Flushed, but otherwise
+ * not modified.
+ * @return 0 on success.
+ */
+int cm_merge(cm_quantile * dst, cm_quantile * src);
+
+/**
+ * Copies out the samples of the summary, in value order.
+ * The buffers must be flushed with cm_flush first, after
+ * which there are num_samples samples.
+ * @arg cm_quantile The cm_quantile to read
+ * @arg values Output. The sample values
+ * @arg widths Output. The ranks represented by each sample
+ * @arg deltas Output. The delta between min/max rank of each sample
+ */
+void cm_get_samples(cm_quantile * cm, double *values, uint64_t *widths, uint64_t *deltas);
+
+/**
+ * Merges summary samples, as copied out by cm_get_samples,
+ * into a CM quantile. This is cm_merge, for a source that
+ * is not a cm_quantile, such as a decoded snapshot.
+ * @arg dst The cm_quantile to merge into
+ * @arg values The sample values, sorted
+ * @arg widths The ranks represented by each sample
+ * @arg deltas The delta between min/max rank of each sample
+ * @arg count The number of samples
+ * @arg num_values The number of values the samples represent
+ * @return 0 on success.
+ */
+int cm_merge_samples(cm_quantile * dst, double *values, uint64_t *widths, uint64_t *deltas,
+		uint32_t count, uint64_t num_values);
+
 #endif
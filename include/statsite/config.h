@@ -3,7 +3,29 @@
 
 #include <stdbool.h>
 
-// Represents the configuration of a histogram
+// Quantile engine used by timers
+typedef enum {
+	QUANTILE_DEFAULT = 0,		// Use the engine set on the metrics
+	QUANTILE_CM,				// Cormode-Muthukrishnan summary
+	QUANTILE_DDSKETCH			// DDSketch, fixed size and mergeable
+} quantile_engine;
+
+// How the bins of a histogram are spaced
+typedef enum {
+	HISTOGRAM_LINEAR = 0,		// Bins of bin_width between min and max
+	HISTOGRAM_LOG				// Bin bounds grow by a factor of bin_width
+} histogram_scale;
+
+// How the counts of a histogram are stored
+typedef enum {
+	HISTOGRAM_DENSE32 = 0,		// A 32 bit count for every bin
+	HISTOGRAM_DENSE64,			// A 64 bit count for every bin
+	HISTOGRAM_SPARSE			// 64 bit counts for the nonzero bins only
+} histogram_storage;
+
+// Represents the configuration of a histogram. Config
+// files only set the prefix and the bin range and width,
+// callers set the engine, scale and storage.
 typedef struct histogram_config {
 	char *prefix;
 	double min_val;
@@ -12,6 +34,13 @@ typedef struct histogram_config {
 	int num_bins;
 	struct histogram_config *next;
 	char parts;
+	quantile_engine engine;		// Quantile engine for matching timers
+	histogram_scale scale;		// Spacing of the bins
+	double bin_scale;			// Reciprocal of the bin width, or of
+								// its log for log scale histograms
+	double bin_offset;			// The min value, or its log for log
+								// scale histograms
+	histogram_storage storage;	// Storage of the counts of each timer
 } histogram_config;
 
 #endif
@@ -9,6 +9,7 @@ struct counter {
 	double squared_sum;			// Sum of the squared values
 	double min;					// Minimum value
 	double max;					// Maximum value
+	uint32_t idle_intervals;	// Intervals without samples, for metrics_reset
 };
 
 /**
@@ -75,4 +76,12 @@ double counter_min(struct counter *counter);
  */
 double counter_max(struct counter *counter);
 
+/**
+ * Merges the samples of one counter into another
+ * @arg dst The counter to merge into
+ * @arg src The counter to merge from. Not modified.
+ * @return 0 on success.
+ */
+int counter_merge(struct counter *dst, const struct counter *src);
+
 #endif
@@ -0,0 +1,113 @@
+#ifndef DDSKETCH_H
+#define DDSKETCH_H
+#include <stddef.h>
+#include <stdint.h>
+
+// Default cap on the bins in each store
+#define DDSKETCH_DEFAULT_BINS 1024
+
+/*
+ * Bins for values of a single sign. Bin i counts the
+ * values with a magnitude in (gamma^(i-1), gamma^i].
+ * The bins cover a window of indexes starting at offset,
+ * and grow up to max_bins. Once the index range is wider
+ * than that, the lowest indexes are collapsed together.
+ */
+typedef struct {
+	uint64_t *bins;				// Counts, bins[i] is index offset + i
+	uint32_t size;				// Allocated number of bins
+	int32_t offset;				// Index of the first bin
+	int32_t min_index;			// Lowest used index
+	int32_t max_index;			// Highest used index
+	uint64_t count;				// Number of values in the store
+} ddsketch_store;
+
+/*
+ * DDSketch provides quantiles with a relative error on
+ * the value, rather than on the rank. Memory is bounded
+ * by the max number of bins, and sketches with the same
+ * parameters are merged by adding up their bins.
+ */
+typedef struct {
+	double alpha;				// Relative accuracy
+	double gamma;				// Ratio between bin boundaries
+	double inv_log_gamma;		// 1 / ln(gamma)
+	uint32_t max_bins;			// Max bins per store
+	uint64_t zero_count;		// Number of zero values
+	uint64_t count;				// Total number of values
+	double min;					// Minimum value seen
+	double max;					// Maximum value seen
+	ddsketch_store positive;	// Positive values
+	ddsketch_store negative;	// Negative values, by magnitude
+} ddsketch;
+
+/**
+ * Initializes the sketch.
+ * @arg alpha The relative accuracy of the quantiles, on (0, 1)
+ * @arg max_bins The max number of bins for each sign, or 0
+ * to use DDSKETCH_DEFAULT_BINS
+ * @arg dd The sketch to initialize
+ * @return 0 on success.
+ */
+int init_ddsketch(double alpha, uint32_t max_bins, ddsketch *dd);
+
+/**
+ * Destroys the sketch.
+ * @arg dd The sketch to destroy
+ * @return 0 on success.
+ */
+int destroy_ddsketch(ddsketch *dd);
+
+/**
+ * Clears all the values, keeping the bins allocated.
+ * @arg dd The sketch to reset
+ */
+void ddsketch_reset(ddsketch *dd);
+
+/**
+ * Adds a new sample to the sketch.
+ * @arg dd The sketch to add to
+ * @arg sample The new sample value
+ * @return 0 on success, -1 on failure or
+ * if the sample is not finite.
+ */
+int ddsketch_add_sample(ddsketch *dd, double sample);
+
+/**
+ * Queries for a quantile value.
+ * @arg dd The sketch to query
+ * @arg quantile The quantile to query, on [0, 1]
+ * @return The value on success or 0.
+ */
+double ddsketch_query(ddsketch *dd, double quantile);
+
+/**
+ * Merges one sketch into another. Both sketches
+ * must have the same relative accuracy.
+ * @arg dst The sketch to merge into
+ * @arg src The sketch to merge from, not modified
+ * @return 0 on success, -1 on a mismatch or failure,
+ * leaving the counts of dst unchanged.
+ */
+int ddsketch_merge(ddsketch *dst, const ddsketch *src);
+
+/**
+ * Adds a count to a bin of the sketch, as read from the
+ * store of another sketch with the same relative accuracy.
+ * The min and max are not updated.
+ * @arg dd The sketch to add to
+ * @arg negative Non-zero for the bins of negative values
+ * @arg index The bin index
+ * @arg count The count to add
+ * @return 0 on success, -1 on failure.
+ */
+int ddsketch_add_bin(ddsketch *dd, int negative, int32_t index, uint64_t count);
+
+/**
+ * Returns the memory allocated for the bins of the sketch.
+ * @arg dd The sketch to query
+ * @return The size in bytes, without the struct itself.
+ */
+size_t ddsketch_memory(const ddsketch *dd);
+
+#endif
@@ -0,0 +1,128 @@
+/**
+ * This module streams the metrics out in a wire format,
+ * as an alternative to formatting each metric from a
+ * metrics_iter callback. The output is written straight
+ * into buffers owned by the caller, and once they are all
+ * full the filled parts are handed to a sink as an iovec
+ * array, so they can be passed to writev without a copy.
+ * The buffers are then reused for the rest of the metrics.
+ *
+ * The text formats have one line per value, as
+ * "name|value|timestamp\n" for EXPORT_TEXT, which is the
+ * statsite stream format, or "name value timestamp\n" for
+ * EXPORT_GRAPHITE. Timers have a line per statistic, with a
+ * suffix such as ".mean" or ".p99", and a line per histogram
+ * bin when the timer has a histogram config.
+ *
+ * EXPORT_BINARY has a record per metric, with the values as
+ * fixed columns by type, in little endian:
+ *
+ *   u8 metric_type | u8 num_values | u16 name_len | name
+ *   | num_values x f64
+ *
+ *   KEY_VAL, GAUGE: value
+ *   SET:            size
+ *   COUNTER:        count, sum, squared sum, mean, min, max, stddev
+ *   TIMER:          count, sum, squared sum, mean, min, max, stddev,
+ *                   then one value per configured quantile
+ */
+#ifndef EXPORT_H
+#define EXPORT_H
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include "metrics.h"
+
+typedef enum {
+	EXPORT_TEXT,				// name|value|timestamp lines
+	EXPORT_GRAPHITE,			// name value timestamp lines
+	EXPORT_BINARY				// Fixed column records
+} export_format;
+
+// Enough room for any double printed with up to 9 decimals
+#define EXPORT_MAX_NUMBER 330
+
+/**
+ * Consumes the filled buffers. Called once all the buffers
+ * are full, and at the end of the export.
+ * @arg data Opaque handle from init_metrics_export
+ * @arg iov The filled part of each buffer
+ * @arg iovcnt The number of entries in iov
+ * @return 0 on success, non-zero to stop the export.
+ */
+typedef int (*export_sink) (void *data, const struct iovec * iov, int iovcnt);
+
+struct metrics_export {
+	export_format format;
+	const char *prefix;			// Prepended to each text name, may be NULL
+	int use_type_prefix;		// Prepend "counts.", "timers." etc. to the text names
+	int extended_counters;		// Write all the counter stats, not just the sum
+	int precision;				// Decimals of the text values, on [0, 9]
+	uint64_t timestamp;			// Timestamp of the text lines
+	const struct iovec *bufs;	// Caller buffers, iov_len is the capacity
+	int num_bufs;
+	struct iovec *filled;		// The filled part of each buffer
+	int cur;					// Index of the buffer being filled
+	export_sink sink;
+	void *sink_data;
+	uint64_t bytes;				// Bytes handed to the sink
+	int failed;					// Set if a record did not fit, or the sink failed
+};
+
+/**
+ * Initializes an export. The format options can be set on the
+ * struct after this, and default to no prefixes, only counter
+ * sums, 6 decimals and a zero timestamp.
+ * @arg format The output format
+ * @arg bufs The buffers to write into, which must exist for the
+ * life of the export. A line or record must fit in one buffer.
+ * @arg num_bufs The number of buffers, must be positive
+ * @arg sink Called with the filled buffers
+ * @arg sink_data Opaque handle passed to the sink
+ * @arg e The export to initialize
+ * @return 0 on success.
+ */
+int init_metrics_export(export_format format, const struct iovec * bufs, int num_bufs, export_sink sink,
+		void *sink_data, struct metrics_export * e);
+
+/**
+ * Destroys an export
+ * @arg e The export to destroy
+ * @return 0 on success.
+ */
+int destroy_metrics_export(struct metrics_export * e);
+
+/**
+ * Writes all the metrics in the export format, handing
+ * the output to the sink. The export can be reused for
+ * other metrics, or another interval.
+ * @arg m The metrics to export
+ * @arg e The export to write with
+ * @return 0 on success, -1 if a record did not fit in a
+ * buffer or the sink failed.
+ */
+int metrics_export(struct metrics * m, struct metrics_export * e);
+
+/**
+ * A sink that writes the buffers to a file descriptor
+ * with writev, retrying partial writes.
+ * @arg data Pointer to an int file descriptor
+ * @arg iov The buffers to write
+ * @arg iovcnt The number of entries in iov
+ * @return 0 on success, -1 on a write error.
+ */
+int export_writev_sink(void *data, const struct iovec * iov, int iovcnt);
+
+/**
+ * Formats a double with a fixed number of decimals, as
+ * printf "%.*f" does, without going through printf for
+ * values under 2^53, unless they are too close to a
+ * rounding tie to round from the scaled fraction.
+ * @arg out The output, at least EXPORT_MAX_NUMBER bytes
+ * @arg val The value to format
+ * @arg precision The number of decimals, on [0, 9]
+ * @return The length written, without a null terminator.
+ */
+int export_format_double(char *out, double val, int precision);
+
+#endif
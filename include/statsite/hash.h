@@ -0,0 +1,71 @@
+/**
+ * This module hashes metric names, and the values added to
+ * sets, with a hash function picked once for the process.
+ * The same 64 bit hash of a name is used for the hashmaps,
+ * the shards and the HyperLogLogs, so a name is hashed once.
+ *
+ * HASH_MURMUR3 is the default, and keeps the sets and HLLs
+ * compatible with the ones built by statsite. HASH_WYHASH is
+ * several times faster on short names, but its sets can only
+ * be merged with other sets hashed with it.
+ */
+#ifndef HASH_H
+#define HASH_H
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+	HASH_MURMUR3 = 0,			// Half of MurmurHash3_x64_128
+	HASH_WYHASH					// wyhash, 64 bit
+} hash_function;
+
+/**
+ * Picks the hash function for the process. This must be
+ * called before any hashmap, set or HLL is created, since
+ * their contents depend on it. Once one exists, changing
+ * the function fails.
+ * @arg f The hash function
+ * @return 0 on success, -1 for an unknown function, or
+ * for a change after the hash is in use.
+ */
+int hash_select(hash_function f);
+
+/**
+ * Marks the hash function as in use, so hash_select
+ * refuses to change it. Called by the hashmaps, sets
+ * and HLLs when they are created.
+ */
+void hash_lock(void);
+
+/**
+ * Returns the hash function in use
+ * @return The function picked with hash_select
+ */
+hash_function hash_selected(void);
+
+/**
+ * Hashes a key with the selected hash function
+ * @arg key The key to hash
+ * @arg len The length of the key
+ * @return The 64 bit hash of the key
+ */
+uint64_t hash_bytes(const void *key, size_t len);
+
+/**
+ * Hashes a key with MurmurHash3_x64_128, keeping the
+ * second half of the output, as statsite does.
+ * @arg key The key to hash
+ * @arg len The length of the key
+ * @return The 64 bit hash of the key
+ */
+uint64_t hash_murmur3(const void *key, size_t len);
+
+/**
+ * Hashes a key with wyhash, with the default secret
+ * @arg key The key to hash
+ * @arg len The length of the key
+ * @return The 64 bit hash of the key
+ */
+uint64_t hash_wyhash(const void *key, size_t len);
+
+#endif
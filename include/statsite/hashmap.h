@@ -1,5 +1,8 @@
 #ifndef HASHMAP_H
 #define HASHMAP_H
+#include <stddef.h>
+#include <stdint.h>
+#include "name_pool.h"
 
 struct hashmap;
 /**
@@ -15,6 +18,16 @@ typedef int (*hashmap_callback) (void *data, const char *key, void *value);
  */
 int hashmap_init(int initial_size, struct hashmap ** map);
 
+/**
+ * Creates a new hashmap with its keys interned in a pool.
+ * @arg initial_size The minimim initial size. 0 for default (64).
+ * @arg pool The pool of the keys, which must exist for the
+ * life of the map. It may be shared between maps.
+ * @arg map Output. Set to the address of the map
+ * @return 0 on success.
+ */
+int hashmap_init_pool(int initial_size, struct name_pool * pool, struct hashmap ** map);
+
 /**
  * Destroys a map and cleans up all associated memory
  * @arg map The hashmap to destroy. Frees memory.
@@ -36,6 +49,58 @@ int hashmap_get(struct hashmap * map, char *key, void **value);
 
 void *hashmap_get_value(struct hashmap * map, char *key);
 
+/**
+ * Length-aware version of hashmap_get, for keys that are
+ * not null terminated and have already been hashed.
+ * @arg key The key to look for
+ * @arg key_len The key length
+ * @arg hash The hash of the key, from hashmap_hash_key
+ * @arg value Output. Set to the value of the key.
+ * @return 0 on success. -1 if not found.
+ */
+int hashmap_get_n(struct hashmap * map, const char *key, size_t key_len, uint64_t hash, void **value);
+
+/**
+ * Gets the value slot for a key, inserting the key
+ * with a NULL value if it does not exist. The key is
+ * only hashed once for both the lookup and the insert.
+ * @notes This method is not thread safe.
+ * @arg key The key to look for. Copied if inserted.
+ * @arg value Output. Set to the address of the value slot.
+ * The slot is only valid until the next modification of the map.
+ * @return 0 if found, 1 if added, -1 on allocation failure.
+ */
+int hashmap_get_or_insert(struct hashmap * map, char *key, void ***value);
+
+/**
+ * Length-aware version of hashmap_get_or_insert, for keys that
+ * are not null terminated and have already been hashed.
+ * @arg key The key to look for. Copied and null terminated if inserted.
+ * @arg key_len The key length
+ * @arg hash The hash of the key, from hashmap_hash_key
+ * @arg value Output. Set to the address of the value slot.
+ * @return 0 if found, 1 if added, -1 on allocation failure.
+ */
+int hashmap_get_or_insert_n(struct hashmap * map, const char *key, size_t key_len, uint64_t hash,
+		void ***value);
+
+/**
+ * Computes the hash of a key, as used by all hashmaps,
+ * with the function picked by hash_select. This can be
+ * computed once and reused across maps.
+ * @arg key The key to hash
+ * @arg key_len The key length
+ * @return The 64bit hash of the key
+ */
+uint64_t hashmap_hash_key(const char *key, size_t key_len);
+
+/**
+ * Hints that the slot for a hash will be probed soon,
+ * so the cache miss can overlap with other work.
+ * @arg hash The hash of the key, from hashmap_hash_key
+ */
+void hashmap_prefetch(struct hashmap * map, uint64_t hash);
+
 /**
  * Puts a key/value pair.
  * @arg key The key to set. This is copied, and a seperate
@@ -43,7 +108,7 @@ void *hashmap_get_value(struct hashmap * map, char *key);
  * @notes This method is not thread safe.
  * @arg key_len The key length
  * @arg value The value to set.
- * 0 if updated, 1 if added.
+ * 0 if updated, 1 if added, -1 on allocation failure.
  */
 int hashmap_put(struct hashmap * map, char *key, void *value);
 
@@ -56,6 +121,18 @@ int hashmap_put(struct hashmap * map, char *key, void *value);
  */
 int hashmap_delete(struct hashmap * map, char *key);
 
+/**
+ * Length-aware version of hashmap_delete, for keys that are
+ * not null terminated and have already been hashed. Does not
+ * allocate, so it can undo a hashmap_get_or_insert_n.
+ * @notes This method is not thread safe.
+ * @arg key The key to delete
+ * @arg key_len The key length
+ * @arg hash The hash of the key, from hashmap_hash_key
+ * 0 on success. -1 if not found.
+ */
+int hashmap_delete_n(struct hashmap * map, const char *key, size_t key_len, uint64_t hash);
+
 /**
  * Clears all the key/value pairs.
  * @notes This method is not thread safe.
@@ -63,6 +140,39 @@ int hashmap_delete(struct hashmap * map, char *key);
  */
 int hashmap_clear(struct hashmap * map);
 
+/**
+ * Returns the number of slots that hashmap_iter_range
+ * covers. Ranges of slots can be iterated concurrently,
+ * as long as the map is not modified.
+ * @arg map The hashmap
+ * @return The number of slots
+ */
+int hashmap_slots(struct hashmap * map);
+
+/**
+ * Iterates through the key/value pairs in a range of slots,
+ * invoking a callback for each, as with hashmap_iter.
+ * @arg map The hashmap to iterate over
+ * @arg start The first slot, on [0, hashmap_slots)
+ * @arg end One past the last slot
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, or the return of the callback.
+ */
+int hashmap_iter_range(struct hashmap * map, int start, int end, hashmap_callback cb, void *data);
+
+/**
+ * Iterates through the key/value pairs in the map, removing
+ * every pair for which the callback returns non-zero. The
+ * callback is responsible for releasing a removed value.
+ * @notes This method is not thread safe.
+ * @arg map The hashmap to filter
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return The number of pairs removed.
+ */
+int hashmap_filter(struct hashmap * map, hashmap_callback cb, void *data);
+
 /**
  * Iterates through the key/value pairs in the map,
  * invoking a callback for each. The call back gets a
@@ -75,4 +185,25 @@ int hashmap_clear(struct hashmap * map);
  */
 int hashmap_iter(struct hashmap * map, hashmap_callback cb, void *data);
 
+/**
+ * Interns the keys of a pooled map into another pool, and
+ * switches the map to it. The names of all the maps sharing
+ * the old pool must be moved before it is destroyed.
+ * @notes This method is not thread safe.
+ * @arg map The hashmap, which must have a pool
+ * @arg pool The new pool
+ * @return 0 on success, -1 on allocation failure, in
+ * which case the map keeps its old pool.
+ */
+int hashmap_move_keys(struct hashmap * map, struct name_pool * pool);
+
+/**
+ * Returns the memory allocated by a map, for its tables
+ * and owned keys. Interned keys are accounted for by
+ * their pool, and the values by their owner.
+ * @arg map The hashmap
+ * @return The size in bytes.
+ */
+size_t hashmap_memory(struct hashmap * map);
+
 #endif
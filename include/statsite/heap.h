@@ -6,6 +6,7 @@
 
 #ifndef HEAP_H
 #define HEAP_H
+#include <stddef.h>
 
 // Structure for a single heap entry
 typedef struct heap_entry {
@@ -79,10 +80,95 @@ void *heap_delmin_value(heap * h);
  */
 void heap_foreach(heap * h, void (*func) (void *, void *));
 
+/**
+ * Returns the memory allocated for the entries of the heap.
+ * @param h Pointer to the heap structure
+ * @return The size of the table in bytes.
+ */
+size_t heap_memory(heap * h);
+
 /**
  * Destroys and cleans up a heap.
  * @param h The heap to destroy.
  */
 void heap_destroy(heap * h);
 
+// Entry of a heap specialized for double keys, stored inline
+typedef struct dheap_entry {
+	double key;					// Key for this entry
+	void *value;				// Value for this entry
+} dheap_entry;
+
+/**
+ * A min heap specialized for double keys. The keys are kept
+ * in the entries and compared inline, and the table is laid
+ * out as a 4-ary tree, so the children of an entry share a
+ * cache line and the tree is half as deep as a binary one.
+ */
+typedef struct dheap {
+	int active_entries;			// The number of entries in the heap
+	int minimum_pages;			// The minimum number of pages to maintain, based on the initial cap.
+	int allocated_pages;		// The number of pages in memory that are allocated
+	dheap_entry *table;			// The entries, in 4-ary heap order
+} dheap;
+
+/**
+ * Creates a new double keyed heap
+ * @param h Pointer to a dheap structure that is initialized
+ * @param initial_size What should the initial size of the heap be. If <= 0, then it will be set to
+ * the entries of 1 page.
+ * @return 0 on success, -1 on allocation failure.
+ */
+int dheap_create(dheap * h, int initial_size);
+
+/**
+ * Returns the size of the heap
+ * @param h Pointer to a dheap structure
+ * @return The number of entries in the heap.
+ */
+int dheap_size(dheap * h);
+
+/**
+ * Inserts a new element into a heap. The table grows in place
+ * when it can, without clearing the new pages.
+ * @param h The heap to insert into
+ * @param key The key of the new entry
+ * @param value The value of the new entry
+ * @return 0 on success, -1 if the table could not grow.
+ */
+int dheap_insert(dheap * h, double key, void *value);
+
+/**
+ * Returns the element with the smallest key in the heap.
+ * @param h Pointer to the heap structure
+ * @param key Set to the minimum key, may be NULL
+ * @param value Set to the value corresponding with the key, may be NULL
+ * @return 1 if the minimum element exists and is set, 0 if there are no elements.
+ */
+int dheap_min(dheap * h, double *key, void **value);
+
+/**
+ * Deletes the element with the smallest key from the heap.
+ * @param h Pointer to the heap structure
+ * @param key Set to the minimum key, may be NULL
+ * @param value Set to the value corresponding with the key, may be NULL
+ * @return 1 if the minimum element exists and is deleted, 0 if there are no elements.
+ */
+int dheap_delmin(dheap * h, double *key, void **value);
+
+void *dheap_delmin_value(dheap * h);
+
+/**
+ * Returns the memory allocated for the entries of the heap.
+ * @param h Pointer to the heap structure
+ * @return The size of the table in bytes.
+ */
+size_t dheap_memory(dheap * h);
+
+/**
+ * Destroys and cleans up a double keyed heap.
+ * @param h The heap to destroy.
+ */
+void dheap_destroy(dheap * h);
+
 #endif
@@ -0,0 +1,135 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+
+/*
+ * Binning of timer samples into the counts of a histogram
+ * config. The first bin counts the values below the min, and
+ * the last one the values at or above the last bound that
+ * fits under the max. Log scale histograms have bin bounds
+ * of min * bin_width^i, so a few dozen bins can cover values
+ * across several orders of magnitude.
+ */
+
+// A nonzero bin of a sparse histogram
+typedef struct {
+	uint64_t count;
+	uint32_t bin;
+} histogram_sparse_bin;
+
+/*
+ * The counts of a histogram, in the storage picked by its
+ * config. Sparse counts are kept in a sorted array of the
+ * nonzero bins, which grows as bins are hit.
+ */
+typedef struct {
+	histogram_storage storage;
+	uint32_t num_bins;			// Number of bins in the histogram
+	uint32_t used;				// Nonzero bins, for sparse storage
+	uint32_t size;				// Allocated sparse bins
+	union {
+		uint32_t *counts32;
+		uint64_t *counts64;
+		histogram_sparse_bin *sparse;
+	} store;
+} histogram_counts;
+
+/**
+ * Prepares a histogram config for binning, computing the
+ * number of bins and the bin scale from the other settings.
+ * Must be called before the config is used by the metrics.
+ * @arg conf The config, with the min, max, width and scale set
+ * @return 0 on success, -1 if the settings are invalid. The
+ * min must be less than the max. For linear histograms the
+ * bin width must be positive. For log scale histograms the min
+ * must be positive, and the bin width greater than 1.
+ */
+int histogram_init(histogram_config * conf);
+
+/**
+ * Returns the bin of a sample
+ * @arg conf The histogram config
+ * @arg val The sample
+ * @return The index of the bin, on [0, num_bins)
+ */
+int histogram_bin(const histogram_config * conf, double val);
+
+/**
+ * Returns the lower bound of a bin. The first bin has
+ * no lower bound, and returns the min of the config.
+ * @arg conf The histogram config
+ * @arg bin The bin, on [0, num_bins)
+ * @return The smallest value in the bin
+ */
+double histogram_bin_lower(const histogram_config * conf, int bin);
+
+/**
+ * Initializes the counts for a histogram, with
+ * the storage of the config.
+ * @arg conf The histogram config
+ * @arg counts The counts to initialize
+ * @return 0 on success, -1 if the counts could not be allocated.
+ */
+int histogram_counts_init(const histogram_config * conf, histogram_counts * counts);
+
+/**
+ * Destroys the counts of a histogram
+ * @arg counts The counts to destroy
+ */
+void histogram_counts_destroy(histogram_counts * counts);
+
+/**
+ * Zeroes the counts of a histogram, keeping the allocations
+ * @arg counts The counts to reset
+ */
+void histogram_counts_reset(histogram_counts * counts);
+
+/**
+ * Returns the count of a bin
+ * @arg counts The counts of the histogram
+ * @arg bin The bin, on [0, num_bins)
+ * @return The count of the bin
+ */
+uint64_t histogram_count(const histogram_counts * counts, int bin);
+
+/**
+ * Adds to the count of a bin
+ * @arg counts The counts of the histogram
+ * @arg bin The bin, on [0, num_bins)
+ * @arg count The count to add
+ * @return 0 on success, -1 if sparse counts could not grow.
+ */
+int histogram_counts_add(histogram_counts * counts, int bin, uint64_t count);
+
+/**
+ * Adds a sample to the counts of a histogram
+ * @arg conf The histogram config
+ * @arg counts The counts, initialized for the config
+ * @arg val The sample to add
+ * @return 0 on success, -1 if sparse counts could not grow.
+ */
+int histogram_add_sample(const histogram_config * conf, histogram_counts * counts, double val);
+
+/**
+ * Adds an array of samples to the counts of a histogram. The bins
+ * are computed a block at a time, in a loop the compiler can
+ * vectorize, before the counts are incremented.
+ * @arg conf The histogram config
+ * @arg counts The counts, initialized for the config
+ * @arg vals The samples to add
+ * @arg num_vals The number of samples
+ * @return 0 on success, -1 if sparse counts could not grow.
+ */
+int histogram_add_samples(const histogram_config * conf, histogram_counts * counts, const double *vals,
+		size_t num_vals);
+
+/**
+ * Returns the memory allocated for the counts of a histogram
+ * @arg counts The counts of the histogram
+ * @return The size in bytes, without the struct itself.
+ */
+size_t histogram_counts_memory(const histogram_counts * counts);
+
+#endif
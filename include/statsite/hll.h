@@ -1,3 +1,4 @@
+#include <stddef.h>
 #include <stdint.h>
 
 #ifndef HLL_H
@@ -7,9 +8,27 @@
 #define HLL_MIN_PRECISION 4		// 16 registers
 #define HLL_MAX_PRECISION 18	// 262,144 registers
 
+// Layout of the dense registers
+typedef enum {
+	HLL_LAYOUT_PACKED = 0,		// 6 bit registers, 5 per 32bit word
+	HLL_LAYOUT_BYTE				// One byte per register, faster to update
+} hll_layout;
+
+/*
+ * An HLL starts with the sparse representation, a list of
+ * encoded (index, register) pairs at a higher precision.
+ * Once that list would be close to the size of the dense
+ * registers, it is converted to the dense representation.
+ */
 typedef struct {
 	unsigned char precision;
-	uint32_t *registers;
+	uint32_t *registers;		// Packed dense registers, NULL while sparse
+	uint32_t *sparse;			// Sparse entries, NULL when dense
+	uint32_t sparse_len;		// Sorted, unique entries
+	uint32_t sparse_pending;	// Unsorted entries after the sorted ones
+	uint32_t sparse_size;		// Allocated number of entries
+	hll_layout layout;			// Layout of the dense registers
+	uint8_t *bytes;				// Byte dense registers, NULL while sparse
 } hll_t;
 
 /**
@@ -20,6 +39,15 @@ typedef struct {
  */
 int hll_init(unsigned char precision, hll_t * h);
 
+/**
+ * Initializes a new HLL, with a given register layout
+ * @arg precision The digits of precision to use
+ * @arg layout The layout of the dense registers
+ * @arg h The HLL to initialize
+ * @return 0 on success
+ */
+int hll_init_layout(unsigned char precision, hll_layout layout, hll_t * h);
+
 /**
  * Destroys an hll
  * @return 0 on success
@@ -47,6 +75,59 @@ void hll_add_hash(hll_t * h, uint64_t hash);
  */
 double hll_size(hll_t * h);
 
+/**
+ * Merges one HLL into another, by taking the
+ * maximum of each register. A sparse destination
+ * stays sparse only if the source is also sparse.
+ * @arg dst The hll to merge into
+ * @arg src The hll to merge from. Not modified.
+ * @return 0 on success, -1 if the precisions differ.
+ */
+int hll_merge(hll_t * dst, const hll_t * src);
+
+/**
+ * Checks if the HLL still uses the sparse representation
+ * @arg h The hll to check
+ * @return 1 if sparse, 0 if dense
+ */
+int hll_is_sparse(const hll_t * h);
+
+/**
+ * Returns the entries of a sparse HLL, sorted and unique.
+ * @arg h The hll to read
+ * @arg entries Output. The sparse entries, owned by the HLL
+ * @return The number of entries, or 0 if the HLL is dense.
+ */
+uint32_t hll_sparse_entries(hll_t * h, const uint32_t **entries);
+
+/**
+ * Copies out the registers of a dense HLL, a byte
+ * per register, whatever the layout.
+ * @arg h The hll to read, must be dense
+ * @arg regs Output. 2^precision register values
+ */
+void hll_get_registers(const hll_t * h, uint8_t *regs);
+
+/**
+ * Merges sparse entries, as returned by hll_sparse_entries,
+ * into an HLL with the same precision.
+ * @arg dst The hll to merge into
+ * @arg entries The sparse entries
+ * @arg count The number of entries
+ * @return 0 on success, -1 if an entry is not valid.
+ */
+int hll_merge_sparse(hll_t * dst, const uint32_t *entries, uint32_t count);
+
+/**
+ * Merges registers, as copied out by hll_get_registers,
+ * into an HLL with the same precision. It is made dense.
+ * @arg dst The hll to merge into
+ * @arg regs 2^precision register values
+ * @return 0 on success, -1 if a register is out of range or
+ * the registers could not be allocated.
+ */
+int hll_merge_registers(hll_t * dst, const uint8_t *regs);
+
 /**
  * Computes the minimum digits of precision
  * needed to hit a target error.
@@ -56,4 +137,12 @@ double hll_size(hll_t * h);
  */
 int hll_precision_for_error(double err);
 
+/**
+ * Returns the memory allocated for the registers, or
+ * the sparse entries while the HLL is sparse.
+ * @arg h The hll to query
+ * @return The size in bytes, without the struct itself.
+ */
+size_t hll_memory(const hll_t * h);
+
 #endif
@@ -1,5 +1,6 @@
 #ifndef METRICS_H
 #define METRICS_H
+#include <stddef.h>
 #include <stdint.h>
 #include "config.h"
 #include "radix.h"
@@ -7,6 +8,8 @@
 #include "timer.h"
 #include "hashmap.h"
 #include "set.h"
+#include "histogram.h"
+#include "name_pool.h"
 
 enum metric_type {
 	metric_type_UNKNOWN       = 0,
@@ -18,40 +21,122 @@ enum metric_type {
 	metric_type_GAUGE_DELTA   = 6,
 };
 
+// A K/V pair, stored with its name inline
 struct key_val {
-	char *name;
 	double val;
-	struct key_val *next;
+	uint32_t name_len;
+	char name[];                   // Null terminated
+};
+
+// A chunk of K/V pairs, packed back to back in insertion order
+struct key_val_chunk {
+	struct key_val_chunk *next;
+	uint32_t len;                  // Bytes of data used
+	uint32_t size;                 // Bytes of data allocated
+	char data[];
+};
+
+// A single sample for batched ingestion
+struct metric_sample {
+	enum metric_type type;
+	const char *name;              // Name of the metric, need not be null terminated
+	size_t name_len;               // Length of the name
+	double value;
+	double sample_rate;
 };
 
 struct timer_hist {
 	timer tm;
 
-	// Support for histograms
+	// Support for histograms. The config is resolved once
+	// when the timer is created, and kept by metrics_reset.
 	histogram_config *conf;
-	unsigned int *counts;
+	histogram_counts counts;       // Read with histogram_count
+
+	uint32_t idle_intervals;       // Intervals without samples, for metrics_reset
 };
 
+// How a gauge was updated, since it was last carried
+// over to the next generation by buffered_metrics
+#define GAUGE_UNCHANGED 0
+#define GAUGE_DELTA 1
+#define GAUGE_SET 2
+
 struct gauge {
 	double value;
 	double prev_value;
 	uint64_t user;
 	uint64_t user_flags;
 	uint64_t timestamp_ms;
+	unsigned char updated;         // One of the GAUGE_ update kinds
 };
 
+// What happens to new names once a type has reached its name limit
+typedef enum {
+	METRICS_LIMIT_DROP = 0,        // The samples of new names are dropped
+	METRICS_LIMIT_FOLD             // New names are folded into METRICS_OVERFLOW_NAME
+} metrics_limit_action;
+
+// The metric that new names are folded into, for METRICS_LIMIT_FOLD
+#define METRICS_OVERFLOW_NAME "statsite.overflow"
+
+// The metrics of each type with a given name, for the ordered index
+#define METRIC_NAMES_COUNTER 0
+#define METRIC_NAMES_TIMER 1
+#define METRIC_NAMES_GAUGE 2
+#define METRIC_NAMES_SET 3
+#define METRIC_NAMES_TYPES 4
+
 struct metrics {
+	struct name_pool *name_pool;   // Interned names of the hashmaps
 	struct hashmap *counters;      // Hashmap of name -> counter structs
 	struct hashmap *timers;        // Map of name -> timer_hist structs
 	struct hashmap *sets;          // Map of name -> set_t structs
 	struct hashmap *gauges;        // Map of name -> guage struct
-	struct key_val *kv_vals;       // Linked list of key_val structs
+	struct key_val_chunk *kv_head; // Chunks of K/V pairs, the first is kept
+	struct key_val_chunk *kv_tail; // across resets and the rest are freed
 	double timer_eps;              // The error for timers
 	double *quantiles;             // Array of quantiles
 	uint32_t num_quants;           // Size of quantiles array
 	struct radix_tree *histograms; // Radix tree with histogram configs
 	unsigned char set_precision;   // The precision for sets
 	uint64_t set_max_exact;        // The max exact size for sets
+	hll_layout set_layout;         // HLL register layout for new sets
+	cm_buffer_mode timer_buffer_mode; // Quantile buffering for new timers
+	quantile_engine timer_engine;  // Quantile engine for new timers, unless
+	                               // overridden by a histogram config
+	struct radix_tree *names;      // Ordered index of name -> metric_names_entry,
+	                               // NULL unless metrics_enable_index is called
+	uint64_t names_size;           // Number of names in the index
+	uint64_t names_unused;         // Number of names without any metrics left
+
+	// Limits on the distinct names of each METRIC_NAMES_ type
+	uint64_t name_limits[METRIC_NAMES_TYPES];  // 0 for no limit
+	metrics_limit_action limit_actions[METRIC_NAMES_TYPES];
+	uint64_t names_limited[METRIC_NAMES_TYPES]; // New names dropped or folded
+	uint64_t overflow_hash;        // Hash of METRICS_OVERFLOW_NAME
+};
+
+// Memory and cardinality of the metrics, from metrics_get_stats.
+// The per type arrays are indexed by the METRIC_NAMES_ types.
+struct metrics_stats {
+	uint64_t names[METRIC_NAMES_TYPES];         // Number of metrics
+	uint64_t map_bytes[METRIC_NAMES_TYPES];     // Hashmap tables
+	uint64_t value_bytes[METRIC_NAMES_TYPES];   // Metric structs and their allocations
+	uint64_t names_limited[METRIC_NAMES_TYPES]; // New names dropped or folded
+	uint64_t timer_samples;        // cm_sample structs allocated by the timers
+	uint64_t timer_bytes;          // Quantile engines of the timers
+	uint64_t histogram_bytes;      // Histogram counts of the timers
+	uint64_t set_bytes;            // Exact set tables and HLL registers
+	uint64_t kv_pairs;             // Number of K/V pairs
+	uint64_t kv_bytes;             // K/V chunks
+	uint64_t name_bytes;           // Name pool, shared by the hashmaps
+	uint64_t total_bytes;          // All of the above bytes
+};
+
+struct metric_names_entry {
+	void *values[METRIC_NAMES_TYPES];  // Indexed by the METRIC_NAMES_ types
+	char name[];                       // The key of the entry in the index
 };
 
 typedef int (*metric_callback) (void *data, enum metric_type type, char *name, void *val);
@@ -63,8 +148,9 @@ typedef int (*metric_callback) (void *data, enum metric_type type, char *name, v
  * @arg num_quants The number of entries in the quantiles array
  * @arg histograms A radix tree with histogram settings. This is not owned
  * by the metrics object. It is assumed to exist for the life of the metrics.
+ * Configs that were not prepared with histogram_init are prepared here.
  * @arg set_precision The precision to use for sets
- * @return 0 on success.
+ * @return 0 on success, -1 if a histogram config is invalid.
  */
 int init_metrics(double timer_eps, double *quantiles, uint32_t num_quants,
 		struct radix_tree * histograms, unsigned char set_precision,
@@ -91,14 +177,70 @@ int destroy_metrics(struct metrics * m);
 int metrics_clear_hash(struct metrics * m, enum metric_type metric_type);
 
 /**
- * Adds a new sampled value
+ * Resets the metrics for the next interval, keeping the keys
+ * and allocations of recently active metrics. Counters are
+ * zeroed, timers are reset and sets are reset to report their
+ * last count. Gauges keep their values. Counters, timers and
+ * sets without samples for more than max_idle intervals in a
+ * row are removed, and the K/V pairs are always removed.
+ * Counters and timers without samples are skipped by metrics_iter.
+ * @arg max_idle The number of idle intervals to keep a metric
+ * @return 0 on success.
+ */
+int metrics_reset(struct metrics * m, uint32_t max_idle);
+
+/**
+ * Adds a new sampled value. Sets are updated with
+ * metrics_set_update instead.
  * @arg type The type of the metrics
  * @arg name The name of the metric
  * @arg val The sample to add
- * @return 0 on success.
+ * @return 0 on success, -1 on failure or for a set.
  */
 int metrics_add_sample(struct metrics * m, enum metric_type type, char *name, double val, double sample_rate);
 
+/**
+ * Adds a new sampled value, for names that are not
+ * null terminated and have already been hashed.
+ * @arg type The type of the metrics
+ * @arg name The name of the metric, need not be null terminated
+ * @arg name_len The length of the name
+ * @arg hash The hash of the name, from hashmap_hash_key
+ * @arg val The sample to add
+ * @return 0 on success.
+ */
+int metrics_add_sample_n(struct metrics * m, enum metric_type type, const char *name, size_t name_len,
+		uint64_t hash, double val, double sample_rate);
+
+/**
+ * Adds a batch of sampled values. All the names are hashed
+ * and their hashmap slots prefetched before any update is
+ * applied, so the cache misses overlap.
+ * @arg batch An array of samples, of the types accepted
+ * by metrics_add_sample. Sets are not, since they take a
+ * value rather than a number, and go through
+ * metrics_set_update_n instead.
+ * @arg n The number of samples in the batch
+ * @return 0 on success, -1 if any sample failed. All the
+ * samples are attempted either way.
+ */
+int metrics_add_samples(struct metrics * m, const struct metric_sample *batch, size_t n);
+
+/**
+ * Adds an array of samples to a timer. The histogram
+ * bins of the samples are computed at once, skipping
+ * any the timer rejects.
+ * @arg name The name of the timer, need not be null terminated
+ * @arg name_len The length of the name
+ * @arg hash The hash of the name, from hashmap_hash_key
+ * @arg vals The samples to add
+ * @arg num_vals The number of samples
+ * @arg sample_rate The sample rate of all the samples
+ * @return 0 on success, -1 if any sample failed.
+ */
+int metrics_add_timer_samples(struct metrics * m, const char *name, size_t name_len, uint64_t hash,
+		const double *vals, size_t num_vals, double sample_rate);
+
 /**
  * Adds a new gauge value
  * @arg name The name of the metric
@@ -128,6 +270,86 @@ int metrics_set_gauge_ts(struct metrics * m, char *name, double val, bool delta,
  */
 int metrics_set_update(struct metrics * m, char *name, char *value);
 
+/**
+ * Adds a value to a named set, for names and values
+ * that are not null terminated.
+ * @arg name The name of the set
+ * @arg name_len The length of the name
+ * @arg hash The hash of the name, from hashmap_hash_key
+ * @arg value The value to add
+ * @arg value_len The length of the value
+ * @return 0 on success
+ */
+int metrics_set_update_n(struct metrics * m, const char *name, size_t name_len, uint64_t hash,
+		const char *value, size_t value_len);
+
+/**
+ * Returns the counter with a given name, creating
+ * it if needed.
+ * @arg name The name of the counter, need not be null terminated
+ * @arg name_len The length of the name
+ * @arg hash The hash of the name, from hashmap_hash_key
+ * @return The counter, or NULL on failure or if the
+ * name is over the name limit.
+ */
+struct counter *metrics_get_counter(struct metrics * m, const char *name, size_t name_len, uint64_t hash);
+
+/**
+ * Returns the timer with a given name, creating it if
+ * needed, with the histogram config matching the name.
+ * @arg name The name of the timer, need not be null terminated
+ * @arg name_len The length of the name
+ * @arg hash The hash of the name, from hashmap_hash_key
+ * @return The timer, or NULL on failure or if the
+ * name is over the name limit.
+ */
+struct timer_hist *metrics_get_timer(struct metrics * m, const char *name, size_t name_len, uint64_t hash);
+
+/**
+ * Returns the gauge with a given name, creating
+ * it with a zero value if needed.
+ * @arg name The name of the gauge, need not be null terminated
+ * @arg name_len The length of the name
+ * @arg hash The hash of the name, from hashmap_hash_key
+ * @return The gauge, or NULL on failure or if the
+ * name is over the name limit.
+ */
+struct gauge *metrics_get_gauge(struct metrics * m, const char *name, size_t name_len, uint64_t hash);
+
+/**
+ * Returns the set with a given name, creating
+ * it if needed.
+ * @arg name The name of the set, need not be null terminated
+ * @arg name_len The length of the name
+ * @arg hash The hash of the name, from hashmap_hash_key
+ * @return The set, or NULL on failure or if the
+ * name is over the name limit.
+ */
+set_t *metrics_get_set(struct metrics * m, const char *name, size_t name_len, uint64_t hash);
+
+/**
+ * Limits the number of distinct names of a metric type. Once
+ * a type has that many names, samples for other names are
+ * dropped, or folded into METRICS_OVERFLOW_NAME, and counted
+ * in names_limited. Names already present are not affected.
+ * Names removed by metrics_reset make room for new ones.
+ * @arg type The metric type, GAUGE_DELTA is the same as GAUGE
+ * @arg limit The max number of names, 0 for no limit
+ * @arg action What to do with the samples of new names
+ * @return 0 on success, -1 for a type without names.
+ */
+int metrics_set_name_limit(struct metrics * m, enum metric_type type, uint64_t limit,
+		metrics_limit_action action);
+
+/**
+ * Computes the memory used by the metrics, and their number
+ * of each type. This visits every metric, so it should be
+ * called at most once an interval, not on the insert path.
+ * @arg stats Output. The stats of the metrics
+ * @return 0 on success.
+ */
+int metrics_get_stats(struct metrics * m, struct metrics_stats * stats);
+
 /**
  * Iterates through all the metrics
  * @arg m The metrics to iterate through
@@ -140,4 +362,84 @@ int metrics_set_update(struct metrics * m, char *name, char *value);
  */
 int metrics_iter(struct metrics * m, void *data, metric_callback cb);
 
+/**
+ * Iterates through the K/V pairs only, in the order
+ * they were added.
+ * @arg m The metrics to iterate through
+ * @arg data Opaque handle passed to the callback
+ * @arg cb A callback function to invoke, as for metrics_iter
+ * @return 0 on success, or the return of the callback
+ */
+int metrics_iter_kv(struct metrics * m, void *data, metric_callback cb);
+
+/**
+ * Iterates through the metrics of one type, in the same way
+ * as metrics_iter, skipping the same metrics. For iterators
+ * that interleave the types of several metrics.
+ * @arg m The metrics to iterate through
+ * @arg type The type to iterate, one stored in a hashmap.
+ * GAUGE_DELTA is the same as GAUGE.
+ * @arg data Opaque handle passed to the callback
+ * @arg cb A callback function to invoke, as for metrics_iter
+ * @return 0 on success, the return of the callback, or -1
+ * for a type without a hashmap.
+ */
+int metrics_iter_type(struct metrics * m, enum metric_type type, void *data, metric_callback cb);
+
+/**
+ * Checks if metrics_iter skips a metric. The counters and
+ * timers kept by metrics_reset are skipped until they have
+ * samples again. For iterators built on the hashmaps.
+ * @arg type The type of the metric
+ * @arg value The metric, as stored in its hashmap
+ * @return 1 if the metric is skipped, 0 if not.
+ */
+int metrics_iter_skips(enum metric_type type, void *value);
+
+/**
+ * Iterates through all the metrics using a number of threads.
+ * The slots of each hashmap are partitioned between the workers,
+ * and timers are finalized by the worker that visits them. The
+ * callback is invoked concurrently, but each worker only gets its
+ * own data handle, so it can be used as a per-worker output buffer.
+ * Each worker visits its share in the metrics_iter type order, and
+ * the K/V pairs are visited by the first worker. If a thread can
+ * not be started, its share is visited by the calling thread, still
+ * with its own data handle, so the output is always complete.
+ * @arg m The metrics to iterate through. Must not be modified
+ * while iterating.
+ * @arg num_workers The number of workers, including the calling thread
+ * @arg data An array of num_workers opaque handles, one per worker
+ * @arg cb A callback function to invoke, as for metrics_iter.
+ * Return non-zero to stop the iteration of that worker.
+ * @return 0 on success, the return of a callback, or -1 if the
+ * workers could not be allocated.
+ */
+int metrics_iter_parallel(struct metrics * m, uint32_t num_workers, void **data, metric_callback cb);
+
+/**
+ * Enables the ordered index of metric names, used by
+ * metrics_iter_sorted. The index is built from the current
+ * metrics, and then kept up to date as metrics are added
+ * and removed, so it costs a radix tree insert per new name.
+ * Calling this again has no effect.
+ * @return 0 on success.
+ */
+int metrics_enable_index(struct metrics * m);
+
+/**
+ * Iterates through all the metrics, in the lexicographic
+ * byte order of their names. The K/V pairs are sent first,
+ * in the order of metrics_iter. Each name then has its metrics
+ * sent in the metrics_iter type order. The index must have
+ * been enabled with metrics_enable_index.
+ * @arg m The metrics to iterate through
+ * @arg data Opaque handle passed to the callback
+ * @arg cb A callback function to invoke, as for metrics_iter.
+ * Return non-zero to stop iteration.
+ * @return 0 on success, the return of the callback, or -1
+ * if the index is not enabled.
+ */
+int metrics_iter_sorted(struct metrics * m, void *data, metric_callback cb);
+
 #endif
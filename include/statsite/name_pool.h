@@ -0,0 +1,78 @@
+/**
+ * This module interns metric names. Each distinct name is
+ * stored once, null terminated, in an append only buffer,
+ * and is referred to by a 32 bit handle, its offset in the
+ * buffer. The handles stay valid as the buffer grows, but
+ * pointers from name_pool_get only last until the next
+ * name is interned.
+ *
+ * Names are never removed. Instead, the owner of a pool moves
+ * the names still in use into a new pool once enough of them
+ * are unused, and frees the old one in bulk.
+ */
+#ifndef NAME_POOL_H
+#define NAME_POOL_H
+#include <stddef.h>
+#include <stdint.h>
+
+// Not the handle of any name
+#define NAME_POOL_NONE 0
+
+// A slot of the index of names, by hash
+typedef struct {
+	uint64_t hash;
+	uint32_t handle;			// NAME_POOL_NONE for an empty slot
+	uint32_t len;				// Length of the name, without the null
+} name_pool_slot;
+
+struct name_pool {
+	char *data;					// The names, back to back
+	uint32_t len;				// Bytes of data used
+	uint32_t size;				// Bytes of data allocated
+	name_pool_slot *slots;		// Open addressing index, a power of two in size
+	uint32_t num_slots;
+	uint32_t count;				// Number of names
+};
+
+/**
+ * Initializes an empty pool
+ * @arg pool The pool to initialize
+ * @return 0 on success, -1 on allocation failure.
+ */
+int name_pool_init(struct name_pool * pool);
+
+/**
+ * Destroys a pool, and all of its names
+ * @arg pool The pool to destroy
+ */
+void name_pool_destroy(struct name_pool * pool);
+
+/**
+ * Returns the handle of a name, adding it if needed.
+ * @arg pool The pool
+ * @arg name The name, need not be null terminated. It may
+ * point into the pool itself.
+ * @arg name_len The length of the name
+ * @arg hash The hash of the name, from hashmap_hash_key
+ * @return The handle, or NAME_POOL_NONE on allocation failure.
+ */
+uint32_t name_pool_intern(struct name_pool * pool, const char *name, size_t name_len, uint64_t hash);
+
+/**
+ * Returns an interned name
+ * @arg pool The pool
+ * @arg handle The handle of the name
+ * @return The null terminated name, valid until
+ * the next name is interned.
+ */
+const char *name_pool_get(const struct name_pool * pool, uint32_t handle);
+
+/**
+ * Returns the memory allocated by a pool, for its
+ * names and the index.
+ * @arg pool The pool
+ * @return The size in bytes, without the struct itself.
+ */
+size_t name_pool_memory(const struct name_pool * pool);
+
+#endif
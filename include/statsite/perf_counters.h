@@ -0,0 +1,99 @@
+/**
+ * This module counts the work done on the internal hot paths,
+ * to see why an interval got slow without attaching a profiler.
+ * The counters are only collected when the library is built
+ * with STATSITE_PERF_COUNTERS defined, which configure does for
+ * --enable-perf-counters. Otherwise the hooks compile to nothing,
+ * and perf_counters_read returns zeros.
+ *
+ * Each thread adds to its own counters, so the hooks cost a
+ * thread local load and a plain add, without atomic
+ * instructions or shared cache lines. The counters of all the
+ * threads are summed when they are read.
+ */
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+#include <stdint.h>
+
+// All the fields must be uint64_t, they are summed as an array
+struct perf_counters {
+	uint64_t hashmap_lookups;		// Hashmap lookups, including those before inserts
+	uint64_t hashmap_probes;		// Slots compared by the lookups
+	uint64_t hashmap_resizes;		// Hashmap tables doubled
+	uint64_t cm_inserts;			// Incremental inserts, or merges of the array buffer
+	uint64_t cm_insert_ns;			// Time spent in flushes and array merges,
+									// including the compression of the merges.
+									// Per sample inserts are not timed.
+	uint64_t cm_compresses;			// Incremental or full compressions
+	uint64_t cm_compress_ns;		// Time spent compressing in flushes and
+									// merges. Per sample ones are not timed.
+	uint64_t heap_grows;			// Heap tables doubled
+	uint64_t heap_pages;			// Pages added by the heap growth
+	uint64_t set_promotions;		// Exact sets converted to HLLs
+};
+
+/**
+ * Checks if the library was built with the counters
+ * @return 1 if the counters are collected, 0 if not.
+ */
+int perf_counters_enabled(void);
+
+/**
+ * Reads the counters, summed over all the threads that have
+ * used the library, including the threads that have exited.
+ * The counters only grow, so the counters of an interval are
+ * the difference with the read of the previous flush.
+ * @arg out Output. The counters
+ */
+void perf_counters_read(struct perf_counters * out);
+
+#ifdef STATSITE_PERF_COUNTERS
+
+// The counters of the calling thread, NULL until its first hook
+extern __thread struct perf_counters *perf_counters_thread;
+
+/**
+ * Allocates the counters of the calling thread. They are
+ * folded into the totals when the thread exits.
+ * @return The counters, or NULL on allocation failure.
+ */
+struct perf_counters *perf_counters_register(void);
+
+/**
+ * Returns a monotonic time, for the timed hooks
+ * @return The time in nanoseconds
+ */
+uint64_t perf_counters_now(void);
+
+static inline struct perf_counters *perf_counters_local(void)
+{
+	struct perf_counters *p = perf_counters_thread;
+	return p ? p : perf_counters_register();
+}
+
+// Adds n to a counter of the calling thread. Only this thread
+// writes its counters, the relaxed store just keeps the reads
+// from other threads well defined.
+#define PERF_ADD(field, n) do { \
+		struct perf_counters *_pc = perf_counters_local(); \
+		if (_pc) \
+			__atomic_store_n(&_pc->field, _pc->field + (n), __ATOMIC_RELAXED); \
+	} while (0)
+
+// Runs a statement, adding one to a count field and the
+// elapsed time to a time field
+#define PERF_TIMED(count, ns, stmt) do { \
+		uint64_t _start = perf_counters_now(); \
+		stmt; \
+		PERF_ADD(ns, perf_counters_now() - _start); \
+		PERF_ADD(count, 1); \
+	} while (0)
+
+#else
+
+#define PERF_ADD(field, n) do { } while (0)
+#define PERF_TIMED(count, ns, stmt) do { stmt; } while (0)
+
+#endif
+
+#endif
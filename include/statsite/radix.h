@@ -2,35 +2,77 @@
  * This modules implements a radix tree.
  * We use this for fast longest-prefix matching.
  *
- * It is not particularly space efficient as each of
- * the nodes are quite large, but it is suitable for the
- * small number of patterns that are needed for
- * histograms.
+ * The nodes are adaptive, as in an ART. A node starts
+ * with room for 4 children, and grows to 16, 48 and then
+ * 256 children as edges are added. This keeps the tree
+ * small enough to stay in cache with thousands of keys,
+ * while iteration is still in the byte order of the keys.
  *
  */
 
 #ifndef RADIX_H
 #define RADIX_H
+#include <stddef.h>
+#include <stdint.h>
 
 struct radix_leaf {
 	char *key;
 	void *value;
+	int owns_key;               // The key is a copy, freed with the leaf
 };
 
+// The node layouts, by the most children they can hold
+#define RADIX_NODE4 0
+#define RADIX_NODE16 1
+#define RADIX_NODE48 2
+#define RADIX_NODE256 3
+
+// The header shared by all the node layouts
 struct radix_node {
-	char *key;
+	uint8_t type;               // One of the RADIX_NODE layouts
+	uint16_t num_children;
 	int key_len;
-	void *edges[256];
+	char *key;                  // The edge into this node, points into a leaf key
+	struct radix_leaf *leaf;    // The leaf of a key ending at this node
+};
+
+// Up to 4 children, with the edge bytes sorted
+struct radix_node4 {
+	struct radix_node n;
+	unsigned char keys[4];
+	struct radix_node *children[4];
+};
+
+// Up to 16 children, with the edge bytes sorted
+struct radix_node16 {
+	struct radix_node n;
+	unsigned char keys[16];
+	struct radix_node *children[16];
+};
+
+// Up to 48 children, indexed by edge byte. A
+// zero index is empty, otherwise it is one past
+// the child position.
+struct radix_node48 {
+	struct radix_node n;
+	unsigned char index[256];
+	struct radix_node *children[48];
+};
+
+// Up to 256 children, directly indexed by edge byte
+struct radix_node256 {
+	struct radix_node n;
+	struct radix_node *children[256];
 };
 
 struct radix_tree {
-	struct radix_node root;
+	struct radix_node *root;
 };
 
 /**
  * Initializes the radix tree
  * @arg tree The tree to initialize
- * @return 0 on success
+ * @return 0 on success, 1 if the root could not be allocated
  */
 int radix_init(struct radix_tree * tree);
 
@@ -47,10 +89,39 @@ int radix_destroy(struct radix_tree * tree);
  * @arg key The key of the value
  * @arg value Initially points to the value to insert, replaced
  * by the value that was updated if any
- * @return 0 if the value was inserted, 1 if the value was updated.
+ * @return 0 if the value was inserted, 1 if the value was updated,
+ * -1 on allocation failure.
  */
 int radix_insert(struct radix_tree * t, char *key, void **value);
 
+/**
+ * Inserts a value into the tree, for keys that
+ * are not null terminated.
+ * @arg t The tree to insert into
+ * @arg key The key of the value, must not contain null bytes
+ * @arg key_len The length of the key
+ * @arg value Initially points to the value to insert, replaced
+ * by the value that was updated if any
+ * @return 0 if the value was inserted, 1 if the value was updated,
+ * -1 on allocation failure.
+ */
+int radix_insert_n(struct radix_tree * t, const char *key, size_t key_len, void **value);
+
+/**
+ * Inserts a value into the tree without copying the key.
+ * The tree points to the key, which must stay valid and
+ * unchanged until the tree is destroyed. Updating a value
+ * keeps the key it was inserted with.
+ * @arg t The tree to insert into
+ * @arg key The key of the value, must not contain null bytes
+ * @arg key_len The length of the key
+ * @arg value Initially points to the value to insert, replaced
+ * by the value that was updated if any
+ * @return 0 if the value was inserted, 1 if the value was updated,
+ * -1 on allocation failure.
+ */
+int radix_insert_ref_n(struct radix_tree * t, const char *key, size_t key_len, void **value);
+
 /**
  * Finds a value in the tree
  * @arg t The tree to search
@@ -60,6 +131,17 @@ int radix_insert(struct radix_tree * t, char *key, void **value);
  */
 int radix_search(struct radix_tree * t, char *key, void **value);
 
+/**
+ * Finds a value in the tree, for keys that
+ * are not null terminated.
+ * @arg t The tree to search
+ * @arg key The key to search
+ * @arg key_len The length of the key
+ * @arg value The value of the key
+ * @return 0 if found
+ */
+int radix_search_n(struct radix_tree * t, const char *key, size_t key_len, void **value);
+
 /**
  * Finds the longest matching prefix
  * @arg t The tree to search
@@ -69,10 +151,22 @@ int radix_search(struct radix_tree * t, char *key, void **value);
  */
 int radix_longest_prefix(struct radix_tree * t, char *key, void **value);
 
+/**
+ * Finds the longest matching prefix of a key
+ * that is not null terminated.
+ * @arg t The tree to search
+ * @arg key The key to search
+ * @arg key_len The length of the key
+ * @arg value The value of the key with the longest prefix
+ * @return 0 if found
+ */
+int radix_longest_prefix_n(struct radix_tree * t, const char *key, size_t key_len, void **value);
+
 void *radix_longest_prefix_value(struct radix_tree * t, char *key);
 
 /**
- * Iterates through all the nodes in the radix tree
+ * Iterates through all the nodes in the radix tree,
+ * in the byte order of the keys
  * @arg t The tree to iter through
  * @arg data Opaque handle passed through to callback
  * @arg iter_func A callback function to iterate through. Returns
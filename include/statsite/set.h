@@ -1,3 +1,4 @@
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include "hll.h"
@@ -17,10 +18,20 @@ typedef enum {
 	APPROX						// Approximate representation, used for large cardinalities
 } set_type;
 
+// Initial table size for exact sets
+#define EXACT_MIN_SIZE 16
+
+/*
+ * Exact sets keep the hashes in an open addressing
+ * table, growing to keep it at most half full. A zero
+ * hash marks an empty slot, so it is tracked separately.
+ */
 typedef struct {
 	unsigned char precision;
+	bool has_zero;				// Is the zero hash in the set
 	uint32_t count;
-	uint64_t *hashes;
+	uint64_t *hashes;			// Hash table, a power of two in size
+	uint32_t size;				// Size of the hash table
 } exact_set;
 
 typedef struct {
@@ -31,6 +42,8 @@ typedef struct {
 	} store;
 	bool reset;
 	uint64_t exact_size;
+	hll_layout layout;			// Register layout once converted to an HLL
+	uint32_t idle_intervals;	// Intervals without samples, for metrics_reset
 } set_t;
 
 /**
@@ -41,6 +54,15 @@ typedef struct {
  */
 int set_init(unsigned char precision, set_t * s, uint64_t set_max_exact);
 
+/**
+ * Initializes a new set, with a given HLL register layout
+ * @arg precision The precision to use when converting to an HLL
+ * @arg layout The register layout to use when converting to an HLL
+ * @arg s The set to initialize
+ * @return 0 on success.
+ */
+int set_init_layout(unsigned char precision, hll_layout layout, set_t * s, uint64_t set_max_exact);
+
 /**
  * Destroys the set
  * @return 0 on sucess
@@ -54,6 +76,33 @@ int set_destroy(set_t * s);
  */
 void set_add(set_t * s, char *key);
 
+/**
+ * Adds a new key to the set, for keys that
+ * are not null terminated.
+ * @arg s The set to add to
+ * @arg key The key to add
+ * @arg key_len The length of the key
+ */
+void set_add_n(set_t * s, const char *key, size_t key_len);
+
+/**
+ * Adds a pre-computed key hash to the set.
+ * @arg s The set to add to
+ * @arg hash The 64bit hash of the key
+ */
+void set_add_hash(set_t * s, uint64_t hash);
+
+/**
+ * Merges one set into another. An exact destination is
+ * converted to an HLL if the merged set is too large, or
+ * when merging in an approximate set. A source that has
+ * been reset holds no values, and is ignored.
+ * @arg dst The set to merge into
+ * @arg src The set to merge from. Not modified.
+ * @return 0 on success, -1 if the HLL precisions differ.
+ */
+int set_merge(set_t * dst, const set_t * src);
+
 /**
  * Returns the size of the set. May be approximate.
  * @arg s The set to query
@@ -73,4 +122,13 @@ void set_reset(set_t *s);
  */
 void set_reset_to_zero(set_t *s);
 
+/**
+ * Returns the memory allocated by a set, for the hash
+ * table of an exact set or the registers of an HLL.
+ * A reset set has released both, and returns 0.
+ * @arg s The set
+ * @return The size in bytes, without the struct itself.
+ */
+size_t set_memory(const set_t *s);
+
 #endif
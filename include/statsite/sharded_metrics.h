@@ -0,0 +1,105 @@
+/**
+ * This module partitions metrics across a number of
+ * independent metrics shards, selected by the hash of
+ * the metric name. Each shard is a plain struct metrics,
+ * so it is not thread safe, but distinct shards can be
+ * updated concurrently. The intended use is to have one
+ * worker thread own each shard, and route samples to the
+ * owner of sharded_metrics_shard_index.
+ *
+ * Since a name always maps to the same shard, the shards
+ * hold disjoint sets of names and can be reported as a
+ * single view without combining any values.
+ */
+#ifndef SHARDED_METRICS_H
+#define SHARDED_METRICS_H
+#include <stddef.h>
+#include <stdint.h>
+#include "metrics.h"
+
+struct sharded_metrics {
+	struct metrics *shards;        // Array of metrics shards
+	uint32_t num_shards;           // Size of the shards array
+};
+
+/**
+ * Initializes the sharded metrics. Each shard is initialized
+ * with init_metrics using the same arguments. Settings made
+ * afterwards on the shards apply to each shard on its own. A
+ * name limit set with metrics_set_name_limit on every shard
+ * allows up to num_shards times that many names in total.
+ * @arg num_shards The number of shards, must be positive
+ * @arg eps The maximum error for the quantiles
+ * @arg quantiles A sorted array of double quantile values, must be on (0, 1)
+ * @arg num_quants The number of entries in the quantiles array
+ * @arg histograms A radix tree with histogram settings, shared by all
+ * the shards. It is not owned, and must exist for the life of the metrics.
+ * @arg set_precision The precision to use for sets
+ * @return 0 on success.
+ */
+int init_sharded_metrics(uint32_t num_shards, double timer_eps, double *quantiles, uint32_t num_quants,
+		struct radix_tree * histograms, unsigned char set_precision,
+		uint64_t set_max_exact, struct sharded_metrics * sm);
+
+/**
+ * Destroys the sharded metrics, and all the shards.
+ * @return 0 on success.
+ */
+int destroy_sharded_metrics(struct sharded_metrics * sm);
+
+/**
+ * Returns the index of the shard owning a name.
+ * @arg hash The hash of the name, from hashmap_hash_key
+ * @return The shard index, on [0, num_shards)
+ */
+uint32_t sharded_metrics_shard_index(struct sharded_metrics * sm, uint64_t hash);
+
+/**
+ * Returns the shard owning a name.
+ * @arg hash The hash of the name, from hashmap_hash_key
+ * @return The owning shard
+ */
+struct metrics *sharded_metrics_shard(struct sharded_metrics * sm, uint64_t hash);
+
+/**
+ * Adds a new sampled value to the owning shard.
+ * @notes This is only safe if no other thread is
+ * updating the same shard.
+ * @arg type The type of the metrics
+ * @arg name The name of the metric, need not be null terminated
+ * @arg name_len The length of the name
+ * @arg hash The hash of the name, from hashmap_hash_key
+ * @arg val The sample to add
+ * @return 0 on success.
+ */
+int sharded_metrics_add_sample_n(struct sharded_metrics * sm, enum metric_type type, const char *name,
+		size_t name_len, uint64_t hash, double val, double sample_rate);
+
+/**
+ * Adds a value to a named set of the owning shard, which
+ * is picked by the hash of the name, as for samples.
+ * @notes This is only safe if no other thread is
+ * updating the same shard.
+ * @arg name The name of the set, need not be null terminated
+ * @arg name_len The length of the name
+ * @arg hash The hash of the name, from hashmap_hash_key
+ * @arg value The value to add
+ * @arg value_len The length of the value
+ * @return 0 on success.
+ */
+int sharded_metrics_set_update_n(struct sharded_metrics * sm, const char *name, size_t name_len,
+		uint64_t hash, const char *value, size_t value_len);
+
+/**
+ * Iterates through all the metrics of all the shards, in the
+ * same type order as metrics_iter. No shard may be updated
+ * while iterating.
+ * @arg sm The metrics to iterate through
+ * @arg data Opaque handle passed to the callback
+ * @arg cb A callback function to invoke, as for metrics_iter.
+ * Return non-zero to stop iteration.
+ * @return 0 on success, or the return of the callback
+ */
+int sharded_metrics_iter(struct sharded_metrics * sm, void *data, metric_callback cb);
+
+#endif
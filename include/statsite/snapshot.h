@@ -0,0 +1,71 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+#include <stddef.h>
+#include <stdint.h>
+#include "metrics.h"
+
+/*
+ * A snapshot is a versioned binary encoding of all the metrics
+ * in a struct metrics, used to survive a restart mid-interval,
+ * and to ship partial aggregates between tiers. Timers keep their
+ * quantile summaries and histogram counts, and sets keep their
+ * hashes or HLL registers, so no raw samples are needed.
+ *
+ * All the integers are little endian, and doubles are stored
+ * as their IEEE 754 bits. The layout is:
+ *
+ *   header:  "STSN" | u32 version | u8 hash_function
+ *   records: u8 metric_type | u32 name_len | name
+ *            | u64 payload_len | payload
+ *
+ * With the payload length, a reader skips record types it does
+ * not know. Restoring merges the records into the metrics, using
+ * the merge rules of each type, and gauges take the stored value.
+ * The hashes of sets depend on the hash function, so sets are
+ * only merged from snapshots taken with the same one. Version 1
+ * snapshots have no hash_function, and always used HASH_MURMUR3.
+ */
+
+#define SNAPSHOT_VERSION 2
+
+/**
+ * Encodes the metrics into a snapshot. Timers are finalized.
+ * @arg m The metrics to encode
+ * @arg buf Output. The snapshot, to be freed by the caller
+ * @arg len Output. The length of the snapshot
+ * @return 0 on success, -1 on failure.
+ */
+int metrics_snapshot(struct metrics * m, char **buf, size_t *len);
+
+/**
+ * Merges a snapshot into the metrics. New metrics are created
+ * with the settings of the metrics, not of the snapshot.
+ * @arg m The metrics to restore into
+ * @arg buf The snapshot
+ * @arg len The length of the snapshot
+ * @return 0 on success, -1 if the snapshot is not valid. A
+ * record that can not be merged, such as a set with another
+ * precision or hash function, is skipped and also returns -1,
+ * after the rest of the snapshot is restored.
+ */
+int metrics_restore(struct metrics * m, const char *buf, size_t len);
+
+/**
+ * Writes a snapshot of the metrics to a file. The snapshot is
+ * written to a temporary file first, and renamed into place.
+ * @arg m The metrics to encode
+ * @arg path The path of the file
+ * @return 0 on success, -1 on failure.
+ */
+int metrics_snapshot_file(struct metrics * m, const char *path);
+
+/**
+ * Merges a snapshot file into the metrics. The file
+ * is mapped into memory, rather than read.
+ * @arg m The metrics to restore into
+ * @arg path The path of the file
+ * @return 0 on success, -1 on failure, as for metrics_restore.
+ */
+int metrics_restore_file(struct metrics * m, const char *path);
+
+#endif
@@ -1,7 +1,9 @@
 #ifndef TIMER_H
 #define TIMER_H
 #include <stdint.h>
+#include "config.h"
 #include "cm_quantile.h"
+#include "ddsketch.h"
 
 typedef struct {
 	uint64_t actual_count;		// Actual items received
@@ -9,7 +11,12 @@ typedef struct {
 	double sum;					// Sum of the values
 	double squared_sum;			// Sum of the squared values
 	int finalized;				// Is the cm_quantile finalized
-	cm_quantile cm;				// Quantile we use
+	quantile_engine engine;		// Which quantile engine is in use
+	cm_buffer_mode buffer_mode;	// Buffering of the cm_quantile, kept for resets
+	union {
+		cm_quantile cm;			// Quantile we use, for QUANTILE_CM
+		ddsketch dd;			// Quantile we use, for QUANTILE_DDSKETCH
+	} quant;					// Selected by the engine
 } timer;
 
 /**
@@ -22,6 +29,31 @@ typedef struct {
  */
 int init_timer(double eps, double *quantiles, uint32_t num_quants, timer * timer);
 
+/**
+ * Initializes the timer struct, with a given quantile buffering mode
+ * @arg eps The maximum error for the quantiles
+ * @arg quantiles A sorted array of double quantile values, must be on (0, 1)
+ * @arg num_quants The number of entries in the quantiles array
+ * @arg mode The buffering mode for the cm_quantile
+ * @arg timeer The timer struct to initialize
+ * @return 0 on success.
+ */
+int init_timer_mode(double eps, double *quantiles, uint32_t num_quants, cm_buffer_mode mode, timer * timer);
+
+/**
+ * Initializes the timer struct, with a given quantile engine.
+ * For QUANTILE_DDSKETCH, eps is used as the relative accuracy.
+ * @arg eps The maximum error for the quantiles
+ * @arg quantiles A sorted array of double quantile values, must be on (0, 1)
+ * @arg num_quants The number of entries in the quantiles array
+ * @arg engine The quantile engine, QUANTILE_DEFAULT is QUANTILE_CM
+ * @arg mode The buffering mode for the cm_quantile
+ * @arg timeer The timer struct to initialize
+ * @return 0 on success.
+ */
+int init_timer_engine(double eps, double *quantiles, uint32_t num_quants, quantile_engine engine,
+		cm_buffer_mode mode, timer * timer);
+
 /**
  * Destroy the timer struct.
  * @arg timer The timer to destroy
@@ -94,6 +126,31 @@ double timer_squared_sum(timer * timer);
  */
 double timer_max(timer * timer);
 
+/**
+ * Merges the samples of one timer into another
+ * @arg dst The timer to merge into
+ * @arg src The timer to merge from. Finalized, but
+ * otherwise not modified.
+ * @return 0 on success, -1 if the engines differ or the
+ * quantiles could not be merged. The stats of dst are
+ * then unchanged.
+ */
+int timer_merge(timer * dst, timer * src);
+
+/**
+ * Finalizes the timer for queries, flushing the
+ * quantile buffers. Queries do this as needed.
+ * @arg timer The timer to finalize
+ */
+void finalize_timer(timer * timer);
+
 void reset_timer(double eps, double *quantiles, uint32_t num_quants, timer *timer);
 
+/**
+ * Returns the memory allocated by the quantile engine of a timer.
+ * @arg timer The timer
+ * @return The size in bytes, without the struct itself.
+ */
+size_t timer_memory(timer * timer);
+
 #endif
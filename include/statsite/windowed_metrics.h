@@ -0,0 +1,168 @@
+/**
+ * This module keeps sliding windows of metrics, like the
+ * last 1, 5 and 15 minutes, without keeping raw samples or
+ * adding every sample to one struct metrics per window.
+ *
+ * The samples go to a ring of per interval slots, each a
+ * plain struct metrics, and the host advances the ring once
+ * per interval. A window is the most recent slots of the
+ * ring, so a sample is added once and counted in all the
+ * windows that cover its interval. The ring has as many
+ * slots as the longest window.
+ *
+ * The counters also keep a running total per window, that
+ * samples are added to and expired slots are subtracted
+ * from, so the count, sum and rate of a window are read
+ * without touching the slots. Quantiles and cardinalities
+ * can not be subtracted, so the timers and sets of a window
+ * are merged from its slots, which costs one lookup and
+ * merge per slot, regardless of the number of samples.
+ *
+ * Gauges and K/V pairs are kept in the slots, but they
+ * are not windowed. Gauges keep their last value when a
+ * slot is reused, as with metrics_reset.
+ */
+#ifndef WINDOWED_METRICS_H
+#define WINDOWED_METRICS_H
+#include <stddef.h>
+#include <stdint.h>
+#include "metrics.h"
+
+struct windowed_metrics {
+	struct metrics *slots;         // Ring of per interval metrics
+	uint32_t num_slots;            // Size of the ring, the longest window
+	uint32_t current;              // Slot taking the samples
+	uint32_t *windows;             // Lengths of the windows in slots, ascending
+	uint32_t num_windows;          // Size of the windows array
+	struct hashmap *counters;      // Map of name -> running counter totals,
+	                               // an array of num_windows counters
+};
+
+/**
+ * Initializes the windowed metrics. Each slot is initialized
+ * with init_metrics using the same arguments. Settings like the
+ * timer engine can be changed on all the slots after this, and
+ * are kept when a slot is reused.
+ * @arg windows The lengths of the windows, in intervals. Must be
+ * positive and ascending, and is copied.
+ * @arg num_windows The number of windows, must be positive
+ * @arg eps The maximum error for the quantiles
+ * @arg quantiles A sorted array of double quantile values, must be on (0, 1)
+ * @arg num_quants The number of entries in the quantiles array
+ * @arg histograms A radix tree with histogram settings, shared by all
+ * the slots. It is not owned, and must exist for the life of the metrics.
+ * @arg set_precision The precision to use for sets
+ * @return 0 on success, -1 on invalid windows or allocation failure.
+ */
+int init_windowed_metrics(const uint32_t *windows, uint32_t num_windows, double timer_eps,
+		double *quantiles, uint32_t num_quants, struct radix_tree * histograms,
+		unsigned char set_precision, uint64_t set_max_exact, struct windowed_metrics * wm);
+
+/**
+ * Destroys the windowed metrics, and all the slots.
+ * @return 0 on success.
+ */
+int destroy_windowed_metrics(struct windowed_metrics * wm);
+
+/**
+ * Returns the slot taking the samples of this interval. It
+ * can be updated directly, except for the counters, which
+ * must go through windowed_metrics_add_sample_n to keep the
+ * running totals.
+ * @return The current slot
+ */
+struct metrics *windowed_metrics_current(struct windowed_metrics * wm);
+
+/**
+ * Adds a new sampled value to the current slot, and to the
+ * running totals of every window for counters. Counters
+ * folded by the name limit of the slot are totaled under
+ * METRICS_OVERFLOW_NAME, as they are stored.
+ * @arg type The type of the metrics
+ * @arg name The name of the metric, need not be null terminated
+ * @arg name_len The length of the name
+ * @arg hash The hash of the name, from hashmap_hash_key
+ * @arg val The sample to add
+ * @return 0 on success.
+ */
+int windowed_metrics_add_sample_n(struct windowed_metrics * wm, enum metric_type type, const char *name,
+		size_t name_len, uint64_t hash, double val, double sample_rate);
+
+/**
+ * Adds a value to a named set of the current slot.
+ * @arg name The name of the set, need not be null terminated
+ * @arg name_len The length of the name
+ * @arg hash The hash of the name, from hashmap_hash_key
+ * @arg value The value to add
+ * @arg value_len The length of the value
+ * @return 0 on success
+ */
+int windowed_metrics_set_update_n(struct windowed_metrics * wm, const char *name, size_t name_len,
+		uint64_t hash, const char *value, size_t value_len);
+
+/**
+ * Ends the current interval. The oldest slot of each window
+ * is subtracted from its counter totals, and the oldest slot
+ * of the ring is reset with metrics_reset to take the next
+ * interval, keeping its settings.
+ * @return 0 on success, -1 if the slot could not be reset.
+ */
+int windowed_metrics_advance(struct windowed_metrics * wm);
+
+/**
+ * Reads a counter over a window. The count, sum and squared
+ * sum come from the running totals, the min and the max are
+ * merged from the slots.
+ * @arg window The index of the window in the windows array
+ * @arg name The name of the counter, need not be null terminated
+ * @arg name_len The length of the name
+ * @arg hash The hash of the name, from hashmap_hash_key
+ * @arg out Output. The counter of the window
+ * @return 0 on success, -1 if the counter has no samples
+ * in the window.
+ */
+int windowed_metrics_counter(struct windowed_metrics * wm, uint32_t window, const char *name,
+		size_t name_len, uint64_t hash, struct counter * out);
+
+/**
+ * Merges a timer over the slots of a window. The output
+ * timer is initialized here with the engine of the slots,
+ * and must be destroyed with destroy_timer on success.
+ * @arg window The index of the window in the windows array
+ * @arg name The name of the timer, need not be null terminated
+ * @arg name_len The length of the name
+ * @arg hash The hash of the name, from hashmap_hash_key
+ * @arg out Output. The timer of the window
+ * @return 0 on success, -1 if the timer has no samples
+ * in the window or the merge failed.
+ */
+int windowed_metrics_timer(struct windowed_metrics * wm, uint32_t window, const char *name,
+		size_t name_len, uint64_t hash, timer * out);
+
+/**
+ * Merges a set over the slots of a window. The output
+ * set is initialized here, and must be destroyed with
+ * set_destroy on success.
+ * @arg window The index of the window in the windows array
+ * @arg name The name of the set, need not be null terminated
+ * @arg name_len The length of the name
+ * @arg hash The hash of the name, from hashmap_hash_key
+ * @arg out Output. The set of the window
+ * @return 0 on success, -1 if the set has no values
+ * in the window or the merge failed.
+ */
+int windowed_metrics_set(struct windowed_metrics * wm, uint32_t window, const char *name,
+		size_t name_len, uint64_t hash, set_t * out);
+
+/**
+ * Merges all the counters, timers and sets of a window into
+ * a metrics struct, to report the window with metrics_iter.
+ * Timer histograms are merged when their configs have the same
+ * scale, bounds, bin width and number of bins.
+ * @arg window The index of the window in the windows array
+ * @arg out The metrics to merge into, initialized by the caller
+ * @return 0 on success, -1 if any metric failed to merge.
+ */
+int windowed_metrics_merge(struct windowed_metrics * wm, uint32_t window, struct metrics * out);
+
+#endif
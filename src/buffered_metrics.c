@@ -0,0 +1,177 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include "buffered_metrics.h"
+
+static int gauge_carry_cb(void *data, const char *key, void *value);
+static int gauge_delete_cb(void *data, const char *key, void *value);
+
+/**
+ * Initializes the buffered metrics. Both generations are
+ * initialized with init_metrics using the same arguments.
+ * @arg max_idle The number of idle flushes of a generation before
+ * a metric is removed from it, as for metrics_reset
+ * @return 0 on success.
+ */
+int init_buffered_metrics(double timer_eps, double *quantiles, uint32_t num_quants,
+		struct radix_tree * histograms, unsigned char set_precision,
+		uint64_t set_max_exact, uint32_t max_idle, struct buffered_metrics * bm)
+{
+	int res = init_metrics(timer_eps, quantiles, num_quants, histograms,
+			set_precision, set_max_exact, bm->generations);
+	if (res)
+		return res;
+	res = init_metrics(timer_eps, quantiles, num_quants, histograms,
+			set_precision, set_max_exact, bm->generations + 1);
+	if (res) {
+		destroy_metrics(bm->generations);
+		return res;
+	}
+	res = hashmap_init(0, &bm->gauges);
+	if (res) {
+		destroy_metrics(bm->generations);
+		destroy_metrics(bm->generations + 1);
+		return res;
+	}
+
+	bm->active = 0;
+	bm->writers[0] = 0;
+	bm->writers[1] = 0;
+	bm->max_idle = max_idle;
+	return 0;
+}
+
+/**
+ * Destroys the buffered metrics, and both generations.
+ * @return 0 on success.
+ */
+int destroy_buffered_metrics(struct buffered_metrics * bm)
+{
+	destroy_metrics(bm->generations);
+	destroy_metrics(bm->generations + 1);
+	hashmap_iter(bm->gauges, gauge_delete_cb, NULL);
+	hashmap_destroy(bm->gauges);
+	return 0;
+}
+
+/**
+ * Enters the active generation for writing. Must be
+ * paired with buffered_metrics_release.
+ * @return The generation to update.
+ */
+struct metrics *buffered_metrics_acquire(struct buffered_metrics * bm)
+{
+	uint32_t gen;
+	for (;;) {
+		gen = __atomic_load_n(&bm->active, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&bm->writers[gen], 1, __ATOMIC_SEQ_CST);
+
+		// If a flush switched generations before we were
+		// counted, it may not wait for us, so try again
+		if (__atomic_load_n(&bm->active, __ATOMIC_SEQ_CST) == gen)
+			return bm->generations + gen;
+		__atomic_sub_fetch(&bm->writers[gen], 1, __ATOMIC_RELEASE);
+	}
+}
+
+/**
+ * Leaves a generation entered with buffered_metrics_acquire.
+ * @arg m The generation returned by buffered_metrics_acquire
+ */
+void buffered_metrics_release(struct buffered_metrics * bm, struct metrics * m)
+{
+	__atomic_sub_fetch(&bm->writers[m - bm->generations], 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Adds a new sampled value to the active generation.
+ * @arg type The type of the metrics
+ * @arg name The name of the metric
+ * @arg val The sample to add
+ * @return 0 on success.
+ */
+int buffered_metrics_add_sample(struct buffered_metrics * bm, enum metric_type type, char *name,
+		double val, double sample_rate)
+{
+	struct metrics *m = buffered_metrics_acquire(bm);
+	int res = metrics_add_sample(m, type, name, val, sample_rate);
+	buffered_metrics_release(bm, m);
+	return res;
+}
+
+/**
+ * Switches writers to the other generation, and iterates
+ * through the metrics of the old one as metrics_iter does.
+ * The old generation is then recycled for a later flush.
+ * @arg bm The metrics to flush
+ * @arg data Opaque handle passed to the callback
+ * @arg cb A callback function to invoke, as for metrics_iter
+ * @return 0 on success, or the return of the callback
+ */
+int buffered_metrics_flush(struct buffered_metrics * bm, void *data, metric_callback cb)
+{
+	// Switch the writers over, and wait for the stragglers
+	uint32_t old = bm->active;
+	__atomic_store_n(&bm->active, 1 - old, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&bm->writers[old], __ATOMIC_SEQ_CST))
+		sched_yield();
+	struct metrics *m = bm->generations + old;
+
+	// Apply the gauge updates to the last values
+	hashmap_iter(m->gauges, gauge_carry_cb, bm->gauges);
+
+	// Report the carried gauges in place of the generation's own
+	struct hashmap *gauges = m->gauges;
+	m->gauges = bm->gauges;
+	int res = metrics_iter(m, data, cb);
+	m->gauges = gauges;
+
+	// Recycle the generation for a later flush
+	metrics_reset(m, bm->max_idle);
+	return res;
+}
+
+// Applies a gauge update to the last gauge value
+static int gauge_carry_cb(void *data, const char *key, void *value)
+{
+	struct hashmap *last = data;
+	struct gauge *g = value;
+	if (g->updated == GAUGE_UNCHANGED)
+		return 0;
+
+	void **slot;
+	if (hashmap_get_or_insert(last, (char *)key, &slot) < 0)
+		return 0;
+	struct gauge *l = *slot;
+	if (!l) {
+		l = calloc(1, sizeof(struct gauge));
+		if (!l) {
+			hashmap_delete(last, (char *)key);
+			return 0;
+		}
+		*slot = l;
+	}
+
+	// Deltas apply on top of the last value
+	l->prev_value = l->value;
+	if (g->updated == GAUGE_DELTA)
+		l->value += g->value;
+	else
+		l->value = g->value;
+	l->user = g->user;
+	l->user_flags = g->user_flags;
+	l->timestamp_ms = g->timestamp_ms;
+	l->updated = g->updated;
+
+	// Start the generation's gauge over
+	g->value = 0;
+	g->updated = GAUGE_UNCHANGED;
+	return 0;
+}
+
+// Gauge map cleanup
+static int gauge_delete_cb(void *data, const char *key, void *value)
+{
+	free(value);
+	return 0;
+}
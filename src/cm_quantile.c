@@ -13,6 +13,7 @@
 #include <stdio.h>
 #include "heap.h"
 #include "cm_quantile.h"
+#include "perf_counters.h"
 
 /* Static declarations */
 static void cm_add_to_buffer(cm_quantile * cm, double value);
@@ -24,22 +25,31 @@ static void cm_append_sample(cm_quantile * cm, cm_sample * new);
 static void cm_insert(cm_quantile * cm);
 static void cm_compress(cm_quantile * cm);
 static uint64_t cm_threshold(cm_quantile * cm, uint64_t rank);
+static cm_sample *cm_alloc_sample(cm_quantile * cm);
+static void cm_free_sample(cm_quantile * cm, cm_sample * s);
+static int cm_add_to_array(cm_quantile * cm, double value);
+static void cm_insert_array(cm_quantile * cm);
+static void cm_compress_full(cm_quantile * cm);
+static int cm_flat_reserve(cm_quantile * cm, uint64_t size);
+static int cm_merge_list(cm_quantile * dst, double *values, uint64_t *widths, uint64_t *deltas,
+	uint32_t count);
+static int cm_merge_flat(cm_quantile * dst, double *values, uint64_t *widths, uint64_t *deltas,
+	uint32_t count);
+static void cm_flat_insert_array(cm_quantile * cm);
+static void cm_flat_compress(cm_quantile * cm);
+static double cm_flat_query(cm_quantile * cm, double quantile);
 
-// This is a comparison function that treats keys as doubles
-static int compare_double_keys(register void *key1, register void *key2)
-{
-	// Cast them as double* and read them in
-	register double val1 = *((double *)key1);
-	register double val2 = *((double *)key2);
+// Sample pool blocks start small, since most timers
+// only see a few samples, and double up to a limit
+#define POOL_MIN_BLOCK 16
+#define POOL_MAX_BLOCK 1024
 
-	// Perform the comparison
-	if (val1 < val2)
-		return -1;
-	else if (val1 == val2)
-		return 0;
-	else
-		return 1;
-}
+// In array mode, the array is merged once it holds as
+// many values as the summary, but at least this many
+#define ARRAY_MIN_FLUSH 128
+
+// Arrays smaller than this are insertion sorted
+#define ARRAY_RADIX_THRESHOLD 64
 
 /**
  * Initializes the CM quantile struct
@@ -50,6 +60,21 @@ static int compare_double_keys(register void *key1, register void *key2)
  * @return 0 on success.
  */
 int init_cm_quantile(double eps, double *quantiles, uint32_t num_quants, cm_quantile * cm)
+{
+	return init_cm_quantile_mode(eps, quantiles, num_quants, CM_BUFFER_HEAP, cm);
+}
+
+/**
+ * Initializes the CM quantile struct with a given buffering mode.
+ * @arg eps The maximum error for the quantiles
+ * @arg quantiles A sorted array of double quantile values, must be on (0, 1)
+ * @arg num_quants The number of entries in the quantiles array
+ * @arg mode The buffering mode to use
+ * @arg cm_quantile The cm_quantile struct to initialize
+ * @return 0 on success.
+ */
+int init_cm_quantile_mode(double eps, double *quantiles, uint32_t num_quants, cm_buffer_mode mode,
+	cm_quantile * cm)
 {
 	// Verify the sanity of epsilon
 	if (eps <= 0 or eps >= 0.5)
@@ -77,30 +102,49 @@ int init_cm_quantile(double eps, double *quantiles, uint32_t num_quants, cm_quan
 
 	// Copy the quantiles
 	cm->quantiles = malloc(num_quants * sizeof(double));
+	if (!cm->quantiles)
+		return -1;
 	memcpy(cm->quantiles, quantiles, num_quants * sizeof(double));
 	cm->num_quantiles = num_quants;
 
-	// Initialize the buffers
-	heap *heaps = malloc(2 * sizeof(heap));
-	cm->bufLess = heaps;
-	cm->bufMore = heaps + 1;
-	heap_create(cm->bufLess, 0, compare_double_keys);
-	heap_create(cm->bufMore, 0, compare_double_keys);
+	// Initialize the buffers. The array is allocated lazily.
+	cm->buffer_mode = mode;
+	cm->array = NULL;
+	cm->array_count = 0;
+	cm->array_size = 0;
+	cm->flat_values = NULL;
+	cm->flat_widths = NULL;
+	cm->flat_deltas = NULL;
+	cm->flat_max_ranks = NULL;
+	cm->flat_size = 0;
+	cm->flat_ranks_valid = 0;
+	if (mode == CM_BUFFER_HEAP) {
+		// Zeroed, so a failed setup can free both tables
+		dheap *heaps = calloc(2, sizeof(dheap));
+		if (!heaps || dheap_create(heaps, 0) || dheap_create(heaps + 1, 0)) {
+			if (heaps) {
+				free(heaps[0].table);
+				free(heaps[1].table);
+			}
+			free(heaps);
+			free(cm->quantiles);
+			return -1;
+		}
+		cm->bufLess = heaps;
+		cm->bufMore = heaps + 1;
+	} else {
+		cm->bufLess = NULL;
+		cm->bufMore = NULL;
+	}
 
 	// Setup the cursors
 	cm->insert.curs = NULL;
 	cm->compress.curs = NULL;
 
-	return 0;
-}
+	// Setup an empty pool
+	memset(&cm->pool, 0, sizeof(cm_sample_pool));
 
-/*
- * Callback function to delete the sample inside the
- * heap buffer.
- */
-static void free_buffer_sample(void *key, void *val)
-{
-	free(val);
+	return 0;
 }
 
 /**
@@ -113,27 +157,144 @@ int destroy_cm_quantile(cm_quantile * cm)
 	// Free the quantiles
 	free(cm->quantiles);
 
-	// Destroy everything in the buffer
-	heap_foreach(cm->bufLess, free_buffer_sample);
-	heap_destroy(cm->bufLess);
-	heap_foreach(cm->bufMore, free_buffer_sample);
-	heap_destroy(cm->bufMore);
+	// Destroy the buffers, the samples are owned by the pool
+	if (cm->buffer_mode == CM_BUFFER_HEAP) {
+		dheap_destroy(cm->bufLess);
+		dheap_destroy(cm->bufMore);
 
-	// Free the lower address, since they are allocated to be adjacent
-	free((cm->bufLess < cm->bufMore) ? cm->bufLess : cm->bufMore);
+		// Free the lower address, since they are allocated to be adjacent
+		free((cm->bufLess < cm->bufMore) ? cm->bufLess : cm->bufMore);
+	}
+	free(cm->array);
+	cm->array = NULL;
+	free(cm->flat_values);
+	free(cm->flat_widths);
+	free(cm->flat_deltas);
+	free(cm->flat_max_ranks);
+	cm->flat_values = NULL;
+	cm->flat_widths = NULL;
+	cm->flat_deltas = NULL;
+	cm->flat_max_ranks = NULL;
+	cm->flat_size = 0;
 
-	// Iterate through the linked list, free all
-	cm_sample *next;
-	cm_sample *current = cm->samples;
+	// Release all the samples at once
+	cm_sample_block *next;
+	cm_sample_block *current = cm->pool.blocks;
 	while (current) {
 		next = current->next;
 		free(current);
 		current = next;
 	}
+	memset(&cm->pool, 0, sizeof(cm_sample_pool));
+	cm->samples = NULL;
+	cm->end = NULL;
 
 	return 0;
 }
 
+/**
+ * Returns the sample pool usage, for sizing.
+ * @arg cm_quantile The cm_quantile to query
+ * @arg in_use Output. The number of live samples
+ * @arg allocated Output. The number of samples allocated
+ */
+void cm_pool_usage(cm_quantile * cm, uint64_t *in_use, uint64_t *allocated)
+{
+	if (in_use)
+		*in_use = cm->pool.in_use;
+	if (allocated)
+		*allocated = cm->pool.allocated;
+}
+
+/**
+ * Returns the memory allocated by a CM quantile, including
+ * the free samples of its pool and its sample buffers.
+ * @arg cm_quantile The cm_quantile to query
+ * @return The size in bytes, without the struct itself.
+ */
+size_t cm_memory(cm_quantile * cm)
+{
+	size_t bytes = cm->num_quantiles * sizeof(double);
+	bytes += cm->pool.allocated * sizeof(cm_sample);
+	if (cm->bufLess)
+		bytes += 2 * sizeof(dheap) + dheap_memory(cm->bufLess) + dheap_memory(cm->bufMore);
+	bytes += (size_t)cm->array_size * sizeof(uint64_t);
+	bytes += (size_t)cm->flat_size * (sizeof(double) + 2 * sizeof(uint64_t));
+	if (cm->flat_max_ranks)
+		bytes += (size_t)cm->flat_size * sizeof(uint64_t);
+	return bytes;
+}
+
+// Allocates a zeroed sample from the pool
+static cm_sample *cm_alloc_sample(cm_quantile * cm)
+{
+	cm_sample_pool *pool = &cm->pool;
+	if (!pool->free_list) {
+		// Grow with the pool, up to the max block size
+		uint32_t size = (pool->allocated < POOL_MIN_BLOCK) ? POOL_MIN_BLOCK : pool->allocated;
+		if (size > POOL_MAX_BLOCK)
+			size = POOL_MAX_BLOCK;
+
+		cm_sample_block *block = malloc(sizeof(cm_sample_block) + size * sizeof(cm_sample));
+		if (!block)
+			return NULL;
+		block->size = size;
+		block->next = pool->blocks;
+		pool->blocks = block;
+		pool->allocated += size;
+
+		// Thread the new samples onto the free list
+		for (uint32_t i = 0; i < size; i++) {
+			block->samples[i].next = (i + 1 < size) ? block->samples + i + 1 : NULL;
+		}
+		pool->free_list = block->samples;
+	}
+
+	cm_sample *s = pool->free_list;
+	pool->free_list = s->next;
+	pool->in_use++;
+	memset(s, 0, sizeof(cm_sample));
+	return s;
+}
+
+// Returns a sample to the pool
+static void cm_free_sample(cm_quantile * cm, cm_sample * s)
+{
+	s->next = cm->pool.free_list;
+	cm->pool.free_list = s;
+	cm->pool.in_use--;
+}
+
+/**
+ * Clears all the values, keeping the buffers and the
+ * sample pool allocated for reuse.
+ * @arg cm_quantile The cm_quantile to reset
+ */
+void cm_reset(cm_quantile * cm)
+{
+	// Return the buffered and summary samples to the pool
+	if (cm->buffer_mode == CM_BUFFER_HEAP) {
+		while (dheap_size(cm->bufLess))
+			cm_free_sample(cm, dheap_delmin_value(cm->bufLess));
+		while (dheap_size(cm->bufMore))
+			cm_free_sample(cm, dheap_delmin_value(cm->bufMore));
+	}
+	cm_sample *next;
+	for (cm_sample *s = cm->samples; s; s = next) {
+		next = s->next;
+		cm_free_sample(cm, s);
+	}
+
+	cm->samples = NULL;
+	cm->end = NULL;
+	cm->num_samples = 0;
+	cm->num_values = 0;
+	cm->array_count = 0;
+	cm->flat_ranks_valid = 0;
+	cm->insert.curs = NULL;
+	cm->compress.curs = NULL;
+}
+
 /**
  * Adds a new sample to the struct
  * @arg cm_quantile The cm_quantile to add to
@@ -142,9 +303,16 @@ int destroy_cm_quantile(cm_quantile * cm)
  */
 int cm_add_sample(cm_quantile * cm, double sample)
 {
+	if (cm->buffer_mode != CM_BUFFER_HEAP)
+		return cm_add_to_array(cm, sample);
 	cm_add_to_buffer(cm, sample);
+
+	// Only counted, timing every sample would cost more
+	// than the incremental work itself
 	cm_insert(cm);
 	cm_compress(cm);
+	PERF_ADD(cm_inserts, 1);
+	PERF_ADD(cm_compresses, 1);
 	return 0;
 }
 
@@ -156,17 +324,220 @@ int cm_add_sample(cm_quantile * cm, double sample)
  */
 int cm_flush(cm_quantile * cm)
 {
+	if (cm->buffer_mode != CM_BUFFER_HEAP) {
+		if (cm->array_count)
+			PERF_TIMED(cm_inserts, cm_insert_ns, cm_insert_array(cm));
+		return 0;
+	}
+
 	int rounds = 0;
-	while (heap_size(cm->bufLess) or heap_size(cm->bufMore)) {
-		if (heap_size(cm->bufMore) == 0)
+	while (dheap_size(cm->bufLess) or dheap_size(cm->bufMore)) {
+		if (dheap_size(cm->bufMore) == 0)
 			cm_reset_insert_cursor(cm);
-		cm_insert(cm);
-		cm_compress(cm);
+		PERF_TIMED(cm_inserts, cm_insert_ns, cm_insert(cm));
+		PERF_TIMED(cm_compresses, cm_compress_ns, cm_compress(cm));
 		rounds++;
 	}
 	return 0;
 }
 
+/*
+ * Merges sorted sample arrays into a sample list.
+ *
+ * Walk both in value order. A sample keeps its width,
+ * but its rank in the merged summary is now also uncertain
+ * by the rank range of the next sample from the other side,
+ * which is added to its delta.
+ */
+static int cm_merge_list(cm_quantile * dst, double *values, uint64_t *widths, uint64_t *deltas,
+	uint32_t count)
+{
+	cm_sample *a = dst->samples;
+	cm_sample *head = NULL, *tail = NULL, *s;
+	uint32_t j = 0;
+	int res = 0;
+	while (a || j < count) {
+		if (j == count || (a && a->value <= values[j])) {
+			s = a;
+			a = a->next;
+			if (j < count)
+				s->delta += widths[j] + deltas[j] - 1;
+		} else {
+			s = cm_alloc_sample(dst);
+			if (!s) {
+				// Keep the list intact, but drop the rest
+				res = -1;
+				j = count;
+				continue;
+			}
+			s->value = values[j];
+			s->width = widths[j];
+			s->delta = deltas[j];
+			if (a)
+				s->delta += a->width + a->delta - 1;
+			j++;
+			dst->num_samples++;
+		}
+
+		// Append to the merged list
+		s->prev = tail;
+		s->next = NULL;
+		if (tail)
+			tail->next = s;
+		else
+			head = s;
+		tail = s;
+	}
+	dst->samples = head;
+	dst->end = tail;
+	return res;
+}
+
+/*
+ * Merges sorted sample arrays into a flat summary, with
+ * the same delta rules as cm_merge_list. The merge runs
+ * backwards from the end, so it can be done in place.
+ */
+static int cm_merge_flat(cm_quantile * dst, double *values, uint64_t *widths, uint64_t *deltas,
+	uint32_t count)
+{
+	if (cm_flat_reserve(dst, dst->num_samples + count))
+		return -1;
+
+	double *v = dst->flat_values;
+	uint64_t *w = dst->flat_widths, *d = dst->flat_deltas;
+	int64_t i = (int64_t)dst->num_samples - 1, j = (int64_t)count - 1;
+	int64_t k = (int64_t)dst->num_samples + count - 1;
+
+	// The last placed destination sample, before its delta changed
+	uint64_t next_width = 0, next_delta = 0;
+	int has_next = 0;
+
+	// On equal values the source sample goes to the right
+	while (j >= 0) {
+		if (i >= 0 && v[i] > values[j]) {
+			next_width = w[i];
+			next_delta = d[i];
+			has_next = 1;
+			v[k] = v[i];
+			w[k] = w[i];
+			d[k] = d[i];
+			if (j + 1 < count)
+				d[k] += widths[j + 1] + deltas[j + 1] - 1;
+			i--;
+		} else {
+			v[k] = values[j];
+			w[k] = widths[j];
+			d[k] = deltas[j];
+			if (has_next)
+				d[k] += next_width + next_delta - 1;
+			j--;
+		}
+		k--;
+	}
+
+	// The rest of the destination is already in place,
+	// but is now to the left of every source sample
+	for (; i >= 0; i--) {
+		d[i] += widths[0] + deltas[0] - 1;
+	}
+
+	dst->num_samples += count;
+	dst->flat_ranks_valid = 0;
+	return 0;
+}
+
+/**
+ * Merges the samples of one CM quantile into another.
+ * Both are flushed first, and the merged summary is compressed
+ * using the epsilon and quantiles of the destination.
+ * @arg dst The cm_quantile to merge into
+ * @arg src The cm_quantile to merge from.
+ * @return 0 on success.
+ */
+int cm_merge(cm_quantile * dst, cm_quantile * src)
+{
+	cm_flush(dst);
+	cm_flush(src);
+	if (!src->num_samples)
+		return 0;
+
+	// Flat summaries are already arrays
+	if (src->buffer_mode == CM_BUFFER_FLAT)
+		return cm_merge_samples(dst, src->flat_values, src->flat_widths, src->flat_deltas,
+				src->num_samples, src->num_values);
+
+	// Get the source samples as arrays
+	uint32_t count = src->num_samples;
+	double *values = malloc(count * sizeof(double));
+	uint64_t *widths = malloc(count * sizeof(uint64_t));
+	uint64_t *deltas = malloc(count * sizeof(uint64_t));
+	int res = -1;
+	if (values && widths && deltas) {
+		cm_get_samples(src, values, widths, deltas);
+		res = cm_merge_samples(dst, values, widths, deltas, count, src->num_values);
+	}
+	free(values);
+	free(widths);
+	free(deltas);
+	return res;
+}
+
+/**
+ * Copies out the samples of the summary, in value order.
+ * The buffers must be flushed with cm_flush first.
+ * @arg cm_quantile The cm_quantile to read
+ * @arg values Output. The sample values
+ * @arg widths Output. The ranks represented by each sample
+ * @arg deltas Output. The delta between min/max rank of each sample
+ */
+void cm_get_samples(cm_quantile * cm, double *values, uint64_t *widths, uint64_t *deltas)
+{
+	if (cm->buffer_mode == CM_BUFFER_FLAT) {
+		memcpy(values, cm->flat_values, cm->num_samples * sizeof(double));
+		memcpy(widths, cm->flat_widths, cm->num_samples * sizeof(uint64_t));
+		memcpy(deltas, cm->flat_deltas, cm->num_samples * sizeof(uint64_t));
+		return;
+	}
+	uint32_t i = 0;
+	for (cm_sample *s = cm->samples; s; s = s->next, i++) {
+		values[i] = s->value;
+		widths[i] = s->width;
+		deltas[i] = s->delta;
+	}
+}
+
+/**
+ * Merges summary samples into a CM quantile. The destination
+ * is flushed first, and the merged summary is compressed.
+ * @arg dst The cm_quantile to merge into
+ * @arg values The sample values, sorted
+ * @arg widths The ranks represented by each sample
+ * @arg deltas The delta between min/max rank of each sample
+ * @arg count The number of samples
+ * @arg num_values The number of values the samples represent
+ * @return 0 on success.
+ */
+int cm_merge_samples(cm_quantile * dst, double *values, uint64_t *widths, uint64_t *deltas,
+		uint32_t count, uint64_t num_values)
+{
+	cm_flush(dst);
+	if (!count)
+		return 0;
+
+	int res;
+	if (dst->buffer_mode == CM_BUFFER_FLAT)
+		res = cm_merge_flat(dst, values, widths, deltas, count);
+	else
+		res = cm_merge_list(dst, values, widths, deltas, count);
+	if (res)
+		return res;
+
+	dst->num_values += num_values;
+	PERF_TIMED(cm_compresses, cm_compress_ns, cm_compress_full(dst));
+	return 0;
+}
+
 /**
  * Queries for a quantile value
  * @arg cm_quantile The cm_quantile to query
@@ -175,6 +546,9 @@ int cm_flush(cm_quantile * cm)
  */
 double cm_query(cm_quantile * cm, double quantile)
 {
+	if (cm->buffer_mode == CM_BUFFER_FLAT)
+		return cm_flat_query(cm, quantile);
+
 	uint64_t rank = ceil(quantile * cm->num_values);
 	uint64_t min_rank = 0;
 	uint64_t max_rank;
@@ -200,18 +574,173 @@ double cm_query(cm_quantile * cm, double quantile)
 static void cm_add_to_buffer(cm_quantile * cm, double value)
 {
 	// Allocate a new sample
-	cm_sample *s = calloc(1, sizeof(cm_sample));
+	cm_sample *s = cm_alloc_sample(cm);
+	if (!s)
+		return;
 	s->value = value;
 
 	/*
 	 * Check the cursor value.
 	 * Only use bufLess if we have at least a single value.
 	 */
-	if (cm->num_values && value < cm_insert_point_value(cm)) {
-		heap_insert(cm->bufLess, &s->value, s);
-	} else {
-		heap_insert(cm->bufMore, &s->value, s);
+	dheap *buf = (cm->num_values && value < cm_insert_point_value(cm)) ? cm->bufLess : cm->bufMore;
+	if (dheap_insert(buf, value, s))
+		cm_free_sample(cm, s);
+}
+
+/*
+ * Maps a double onto a 64bit key with the same ordering
+ * when compared as unsigned integers. Positive values
+ * get the sign bit set, negative values are inverted.
+ */
+static inline uint64_t double_to_key(double value)
+{
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	return (bits >> 63) ? ~bits : bits | (1ULL << 63);
+}
+
+// Inverse of double_to_key
+static inline double key_to_double(uint64_t key)
+{
+	uint64_t bits = (key >> 63) ? key & ~(1ULL << 63) : ~key;
+	double value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+// Sorts a small array of keys in place
+static void insertion_sort_keys(uint64_t *keys, uint32_t count)
+{
+	for (uint32_t i = 1; i < count; i++) {
+		uint64_t key = keys[i];
+		uint32_t j = i;
+		while (j > 0 && keys[j - 1] > key) {
+			keys[j] = keys[j - 1];
+			j--;
+		}
+		keys[j] = key;
+	}
+}
+
+/**
+ * Sorts the array of keys. Uses an LSD radix sort on
+ * bytes, skipping the passes where every key has the
+ * same byte, which is common for the high bytes.
+ */
+static void cm_sort_array(uint64_t *keys, uint32_t count)
+{
+	if (count < ARRAY_RADIX_THRESHOLD) {
+		insertion_sort_keys(keys, count);
+		return;
+	}
+
+	uint64_t *scratch = malloc(count * sizeof(uint64_t));
+	if (!scratch) {
+		// Fall back to sorting in place, slowly
+		insertion_sort_keys(keys, count);
+		return;
+	}
+
+	uint64_t *src = keys, *dst = scratch, *tmp;
+	uint32_t counts[256];
+	for (int shift = 0; shift < 64; shift += 8) {
+		memset(counts, 0, sizeof(counts));
+		for (uint32_t i = 0; i < count; i++) {
+			counts[(src[i] >> shift) & 0xFF]++;
+		}
+		if (counts[(src[0] >> shift) & 0xFF] == count)
+			continue;
+
+		// Convert to offsets
+		uint32_t offset = 0, c;
+		for (int b = 0; b < 256; b++) {
+			c = counts[b];
+			counts[b] = offset;
+			offset += c;
+		}
+		for (uint32_t i = 0; i < count; i++) {
+			dst[counts[(src[i] >> shift) & 0xFF]++] = src[i];
+		}
+		tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+
+	// Make sure the result ends up in the array
+	if (src != keys)
+		memcpy(keys, src, count * sizeof(uint64_t));
+	free(scratch);
+}
+
+/**
+ * Adds a new sample to the array buffer,
+ * merging the buffer in once it is full.
+ */
+static int cm_add_to_array(cm_quantile * cm, double value)
+{
+	if (cm->array_count == cm->array_size) {
+		uint32_t size = cm->array_size ? cm->array_size * 2 : 16;
+		uint64_t *array = realloc(cm->array, size * sizeof(uint64_t));
+		if (!array)
+			return -1;
+		cm->array = array;
+		cm->array_size = size;
 	}
+	cm->array[cm->array_count++] = double_to_key(value);
+
+	// Merge once the buffer is as big as the summary
+	uint64_t limit = (cm->num_samples > ARRAY_MIN_FLUSH) ? cm->num_samples : ARRAY_MIN_FLUSH;
+	if (cm->array_count >= limit)
+		PERF_TIMED(cm_inserts, cm_insert_ns, cm_insert_array(cm));
+	return 0;
+}
+
+/**
+ * Sorts the array buffer and merges it into the samples
+ * in a single pass, then compresses the whole summary.
+ * New samples below the minimum or above the maximum
+ * have an exact rank. Others are uncertain by the rank
+ * range of the existing sample they are inserted before.
+ */
+static void cm_insert_array(cm_quantile * cm)
+{
+	cm_sort_array(cm->array, cm->array_count);
+	if (cm->buffer_mode == CM_BUFFER_FLAT) {
+		cm_flat_insert_array(cm);
+		return;
+	}
+
+	cm_sample *curs = cm->samples;
+	cm_sample *s;
+	double value;
+	for (uint32_t i = 0; i < cm->array_count; i++) {
+		value = key_to_double(cm->array[i]);
+		while (curs && curs->value < value)
+			curs = curs->next;
+
+		s = cm_alloc_sample(cm);
+		if (!s)
+			break;
+		s->value = value;
+		s->width = 1;
+		if (!curs) {
+			s->delta = 0;
+			if (cm->end) {
+				cm_append_sample(cm, s);
+			} else {
+				cm->samples = s;
+				cm->end = s;
+			}
+		} else {
+			s->delta = (curs->prev) ? curs->width + curs->delta - 1 : 0;
+			cm_insert_sample(cm, curs, s);
+		}
+		cm->num_values++;
+		cm->num_samples++;
+	}
+	cm->array_count = 0;
+	PERF_TIMED(cm_compresses, cm_compress_ns, cm_compress_full(cm));
 }
 
 // Returns the value under the insertion cursor or 0
@@ -224,7 +753,7 @@ static double cm_insert_point_value(cm_quantile * cm)
 static void cm_reset_insert_cursor(cm_quantile * cm)
 {
 	// Swap the buffers, reset the cursor
-	heap *tmp = cm->bufLess;
+	dheap *tmp = cm->bufLess;
 	cm->bufLess = cm->bufMore;
 	cm->bufMore = tmp;
 	cm->insert.curs = NULL;
@@ -270,7 +799,7 @@ static void cm_insert(cm_quantile * cm)
 	// Check if this is the first element
 	cm_sample *samp;
 	if (!cm->samples) {
-		samp = heap_delmin_value(cm->bufMore);
+		samp = dheap_delmin_value(cm->bufMore);
 		if (!samp)
 			return;
 		samp->width = 1;
@@ -288,10 +817,10 @@ static void cm_insert(cm_quantile * cm)
 	}
 	// Handle adding values in the middle
 	int incr_size = cm_cursor_increment(cm);
-	double *val;
+	double val;
 	for (int i = 0; i < incr_size and cm->insert.curs; i++) {
-		while ((val = heap_min_key(cm->bufMore)) && *val <= cm_insert_point_value(cm)) {
-			samp = heap_delmin_value(cm->bufMore);
+		while (dheap_min(cm->bufMore, &val, NULL) && val <= cm_insert_point_value(cm)) {
+			samp = dheap_delmin_value(cm->bufMore);
 			samp->width = 1;
 			samp->delta = cm->insert.curs->width + cm->insert.curs->delta - 1;
 			cm_insert_sample(cm, cm->insert.curs, samp);
@@ -309,8 +838,8 @@ static void cm_insert(cm_quantile * cm)
 
 	// Handle adding values at the end
 	if (cm->insert.curs == NULL) {
-		while ((val = heap_min_key(cm->bufMore)) && *val > cm->end->value) {
-			samp = heap_delmin_value(cm->bufMore);
+		while (dheap_min(cm->bufMore, &val, NULL) && val > cm->end->value) {
+			samp = dheap_delmin_value(cm->bufMore);
 			samp->width = 1;
 			samp->delta = 0;
 			cm_append_sample(cm, samp);
@@ -360,7 +889,7 @@ static void cm_compress(cm_quantile * cm)
 			prev = cm->compress.curs->prev;
 			prev->next = next;
 			next->prev = prev;
-			free(cm->compress.curs);
+			cm_free_sample(cm, cm->compress.curs);
 			cm->compress.curs = prev;
 
 			// Reduce the sample count
@@ -375,6 +904,219 @@ static void cm_compress(cm_quantile * cm)
 		cm->compress.curs = NULL;
 }
 
+/* Runs compression over the whole list, resetting the cursors */
+static void cm_compress_full(cm_quantile * cm)
+{
+	if (cm->buffer_mode == CM_BUFFER_FLAT) {
+		cm_flat_compress(cm);
+		return;
+	}
+
+	// The cursors may point into an older list order
+	cm->insert.curs = NULL;
+	cm->compress.curs = NULL;
+	do {
+		cm_compress(cm);
+	} while (cm->compress.curs);
+}
+
+/**
+ * Returns the minimum value in the summary.
+ * @return The minimum value, or 0 if empty.
+ */
+double cm_min(cm_quantile * cm)
+{
+	if (cm->buffer_mode == CM_BUFFER_FLAT)
+		return (cm->num_samples) ? cm->flat_values[0] : 0;
+	return (cm->samples) ? cm->samples->value : 0;
+}
+
+/**
+ * Returns the maximum value in the summary.
+ * @return The maximum value, or 0 if empty.
+ */
+double cm_max(cm_quantile * cm)
+{
+	if (cm->buffer_mode == CM_BUFFER_FLAT)
+		return (cm->num_samples) ? cm->flat_values[cm->num_samples - 1] : 0;
+	return (cm->end) ? cm->end->value : 0;
+}
+
+/* Grows the flat arrays to hold at least size samples */
+static int cm_flat_reserve(cm_quantile * cm, uint64_t size)
+{
+	if (size <= cm->flat_size)
+		return 0;
+	if (size < 2 * (uint64_t)cm->flat_size)
+		size = 2 * (uint64_t)cm->flat_size;
+	if (size > UINT32_MAX)
+		return -1;
+
+	double *values = realloc(cm->flat_values, size * sizeof(double));
+	if (!values)
+		return -1;
+	cm->flat_values = values;
+
+	uint64_t *widths = realloc(cm->flat_widths, size * sizeof(uint64_t));
+	if (!widths)
+		return -1;
+	cm->flat_widths = widths;
+
+	uint64_t *deltas = realloc(cm->flat_deltas, size * sizeof(uint64_t));
+	if (!deltas)
+		return -1;
+	cm->flat_deltas = deltas;
+
+	// The max ranks are rebuilt on the next query
+	free(cm->flat_max_ranks);
+	cm->flat_max_ranks = NULL;
+	cm->flat_ranks_valid = 0;
+
+	cm->flat_size = size;
+	return 0;
+}
+
+/**
+ * Merges the sorted array buffer into the flat summary.
+ * Uses the same delta rules as cm_insert_array, but runs
+ * backwards from the end so it can be done in place.
+ */
+static void cm_flat_insert_array(cm_quantile * cm)
+{
+	uint32_t count = cm->array_count;
+	cm->array_count = 0;
+	if (cm_flat_reserve(cm, cm->num_samples + count))
+		return;
+
+	double *v = cm->flat_values;
+	uint64_t *w = cm->flat_widths, *d = cm->flat_deltas;
+	int64_t i = (int64_t)cm->num_samples - 1, j = (int64_t)count - 1;
+	int64_t k = (int64_t)cm->num_samples + count - 1;
+
+	// The existing sample to the right of the next new one
+	uint64_t next_width = 0, next_delta = 0;
+	int has_next = 0;
+
+	// New samples go before existing samples of equal value
+	double value;
+	while (j >= 0) {
+		value = key_to_double(cm->array[j]);
+		if (i >= 0 && v[i] >= value) {
+			next_width = w[i];
+			next_delta = d[i];
+			has_next = 1;
+			v[k] = v[i];
+			w[k] = w[i];
+			d[k] = d[i];
+			i--;
+		} else {
+			v[k] = value;
+			w[k] = 1;
+			d[k] = (has_next && k > 0) ? next_width + next_delta - 1 : 0;
+			j--;
+		}
+		k--;
+	}
+
+	cm->num_samples += count;
+	cm->num_values += count;
+	cm_flat_compress(cm);
+}
+
+/**
+ * Compresses the flat summary in a single pass from the
+ * end, merging each sample into its right neighbour when
+ * the combined rank range is within the threshold. The
+ * first and last samples are always kept.
+ */
+static void cm_flat_compress(cm_quantile * cm)
+{
+	cm->flat_ranks_valid = 0;
+	if (cm->num_samples < 3)
+		return;
+
+	double *v = cm->flat_values;
+	uint64_t *w = cm->flat_widths, *d = cm->flat_deltas;
+	uint32_t n = cm->num_samples;
+
+	// Output is written from the right, j is the last kept sample
+	uint32_t j = n - 1;
+	uint64_t suffix = w[n - 1];
+	uint64_t min_rank, max_rank;
+	for (uint32_t i = n - 2; i > 0; i--) {
+		min_rank = cm->num_values - suffix - w[i];
+		max_rank = min_rank + w[i] + d[i];
+		suffix += w[i];
+
+		if (w[i] + w[j] + d[j] <= cm_threshold(cm, max_rank)) {
+			w[j] += w[i];
+		} else {
+			j--;
+			v[j] = v[i];
+			w[j] = w[i];
+			d[j] = d[i];
+		}
+	}
+
+	// Keep the head, and shift everything down
+	j--;
+	v[j] = v[0];
+	w[j] = w[0];
+	d[j] = d[0];
+	if (j) {
+		memmove(v, v + j, (n - j) * sizeof(double));
+		memmove(w, w + j, (n - j) * sizeof(uint64_t));
+		memmove(d, d + j, (n - j) * sizeof(uint64_t));
+	}
+	cm->num_samples = n - j;
+}
+
+/**
+ * Queries the flat summary. The list walk in cm_query
+ * stops at the first sample whose max rank is past the
+ * target, which is a binary search over the running max
+ * of the max ranks.
+ */
+static double cm_flat_query(cm_quantile * cm, double quantile)
+{
+	uint32_t n = cm->num_samples;
+	if (!n)
+		return 0;
+
+	// Rebuild the max ranks if needed
+	if (!cm->flat_ranks_valid) {
+		if (!cm->flat_max_ranks) {
+			cm->flat_max_ranks = malloc(cm->flat_size * sizeof(uint64_t));
+			if (!cm->flat_max_ranks)
+				return 0;
+		}
+		uint64_t min_rank = 0, max_rank, running = 0;
+		for (uint32_t i = 0; i < n; i++) {
+			max_rank = min_rank + cm->flat_widths[i] + cm->flat_deltas[i];
+			if (max_rank > running)
+				running = max_rank;
+			cm->flat_max_ranks[i] = running;
+			min_rank += cm->flat_widths[i];
+		}
+		cm->flat_ranks_valid = 1;
+	}
+
+	uint64_t rank = ceil(quantile * cm->num_values);
+	uint64_t threshold = ceil(cm_threshold(cm, rank) / 2.);
+	uint64_t limit = rank + threshold;
+
+	// Find the first sample past the limit
+	uint32_t low = 0, high = n, mid;
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (cm->flat_max_ranks[mid] > limit)
+			high = mid;
+		else
+			low = mid + 1;
+	}
+	return cm->flat_values[(low) ? low - 1 : 0];
+}
+
 /* Computes the minimum threshold value */
 static uint64_t cm_threshold(cm_quantile * cm, uint64_t rank)
 {
@@ -14,6 +14,7 @@ int init_counter(struct counter *counter)
 	counter->squared_sum = 0;
 	counter->min = 0;
 	counter->max = 0;
+	counter->idle_intervals = 0;
 	return 0;
 }
 
@@ -113,3 +114,31 @@ double counter_max(struct counter *counter)
 {
 	return counter->max;
 }
+
+/**
+ * Merges the samples of one counter into another
+ * @arg dst The counter to merge into
+ * @arg src The counter to merge from. Not modified.
+ * @return 0 on success.
+ */
+int counter_merge(struct counter *dst, const struct counter *src)
+{
+	// Nothing to merge from an empty counter
+	if (src->count == 0)
+		return 0;
+
+	if (dst->count == 0) {
+		dst->min = src->min;
+		dst->max = src->max;
+	} else {
+		if (dst->min > src->min)
+			dst->min = src->min;
+		if (dst->max < src->max)
+			dst->max = src->max;
+	}
+	dst->actual_count += src->actual_count;
+	dst->count += src->count;
+	dst->sum += src->sum;
+	dst->squared_sum += src->squared_sum;
+	return 0;
+}
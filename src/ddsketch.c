@@ -0,0 +1,327 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "ddsketch.h"
+
+// Initial number of bins in a store
+#define STORE_MIN_BINS 32
+
+/* Static declarations */
+static int store_extend(ddsketch_store *store, int32_t low, int32_t high, uint32_t max_bins);
+static int store_add(ddsketch_store *store, int32_t index, uint64_t count, uint32_t max_bins);
+static int32_t ddsketch_index(ddsketch *dd, double magnitude);
+static double ddsketch_value(const ddsketch *dd, int32_t index);
+
+/**
+ * Initializes the sketch.
+ * @arg alpha The relative accuracy of the quantiles, on (0, 1)
+ * @arg max_bins The max number of bins for each sign, or 0
+ * to use DDSKETCH_DEFAULT_BINS
+ * @arg dd The sketch to initialize
+ * @return 0 on success.
+ */
+int init_ddsketch(double alpha, uint32_t max_bins, ddsketch *dd)
+{
+	// Verify the accuracy
+	if (alpha <= 0 || alpha >= 1)
+		return -1;
+
+	dd->alpha = alpha;
+	dd->gamma = (1 + alpha) / (1 - alpha);
+	dd->inv_log_gamma = 1 / log(dd->gamma);
+	dd->max_bins = (max_bins) ? max_bins : DDSKETCH_DEFAULT_BINS;
+	dd->zero_count = 0;
+	dd->count = 0;
+	dd->min = 0;
+	dd->max = 0;
+
+	// Bins are allocated on the first sample of each sign
+	memset(&dd->positive, 0, sizeof(ddsketch_store));
+	memset(&dd->negative, 0, sizeof(ddsketch_store));
+	return 0;
+}
+
+/**
+ * Destroys the sketch.
+ * @arg dd The sketch to destroy
+ * @return 0 on success.
+ */
+int destroy_ddsketch(ddsketch *dd)
+{
+	free(dd->positive.bins);
+	free(dd->negative.bins);
+	dd->positive.bins = NULL;
+	dd->negative.bins = NULL;
+	return 0;
+}
+
+/**
+ * Clears all the values, keeping the bins allocated.
+ * @arg dd The sketch to reset
+ */
+void ddsketch_reset(ddsketch *dd)
+{
+	ddsketch_store *stores[] = {&dd->positive, &dd->negative};
+	for (int s = 0; s < 2; s++) {
+		if (stores[s]->count)
+			memset(stores[s]->bins, 0, stores[s]->size * sizeof(uint64_t));
+		stores[s]->count = 0;
+	}
+	dd->zero_count = 0;
+	dd->count = 0;
+	dd->min = 0;
+	dd->max = 0;
+}
+
+/**
+ * Adds a new sample to the sketch.
+ * @arg dd The sketch to add to
+ * @arg sample The new sample value
+ * @return 0 on success, -1 on failure or
+ * if the sample is not finite.
+ */
+int ddsketch_add_sample(ddsketch *dd, double sample)
+{
+	if (!isfinite(sample))
+		return -1;
+
+	int res = 0;
+	if (sample > 0)
+		res = store_add(&dd->positive, ddsketch_index(dd, sample), 1, dd->max_bins);
+	else if (sample < 0)
+		res = store_add(&dd->negative, ddsketch_index(dd, -sample), 1, dd->max_bins);
+	else
+		dd->zero_count++;
+	if (res)
+		return res;
+
+	// Track the exact bounds
+	if (!dd->count || sample < dd->min)
+		dd->min = sample;
+	if (!dd->count || sample > dd->max)
+		dd->max = sample;
+	dd->count++;
+	return 0;
+}
+
+/**
+ * Queries for a quantile value.
+ * @arg dd The sketch to query
+ * @arg quantile The quantile to query, on [0, 1]
+ * @return The value on success or 0.
+ */
+double ddsketch_query(ddsketch *dd, double quantile)
+{
+	if (!dd->count || quantile < 0 || quantile > 1)
+		return 0;
+
+	// Find the bin holding the value at this rank,
+	// going from the most negative to the most positive
+	uint64_t rank = quantile * (dd->count - 1);
+	uint64_t seen = 0;
+	double value;
+
+	ddsketch_store *s = &dd->negative;
+	for (int32_t i = s->max_index; s->count && i >= s->min_index; i--) {
+		seen += s->bins[i - s->offset];
+		if (seen > rank) {
+			value = -ddsketch_value(dd, i);
+			goto FOUND;
+		}
+	}
+
+	seen += dd->zero_count;
+	if (seen > rank) {
+		value = 0;
+		goto FOUND;
+	}
+
+	s = &dd->positive;
+	for (int32_t i = s->min_index; s->count && i <= s->max_index; i++) {
+		seen += s->bins[i - s->offset];
+		if (seen > rank) {
+			value = ddsketch_value(dd, i);
+			goto FOUND;
+		}
+	}
+	return dd->max;
+
+FOUND:
+	// The estimate can not be outside what we have seen
+	if (value < dd->min)
+		return dd->min;
+	if (value > dd->max)
+		return dd->max;
+	return value;
+}
+
+/**
+ * Merges one sketch into another. Both sketches
+ * must have the same relative accuracy.
+ * @arg dst The sketch to merge into
+ * @arg src The sketch to merge from, not modified
+ * @return 0 on success, -1 on a mismatch or failure,
+ * leaving the counts of dst unchanged.
+ */
+int ddsketch_merge(ddsketch *dst, const ddsketch *src)
+{
+	if (dst->gamma != src->gamma)
+		return -1;
+	if (!src->count)
+		return 0;
+
+	// Size both stores before adding any bins, so a failed
+	// allocation leaves dst unchanged. The adds then fit in
+	// the windows, and do not allocate.
+	const ddsketch_store *stores[] = {&src->positive, &src->negative};
+	ddsketch_store *targets[] = {&dst->positive, &dst->negative};
+	for (int s = 0; s < 2; s++) {
+		const ddsketch_store *from = stores[s];
+		if (from->count && store_extend(targets[s], from->min_index, from->max_index, dst->max_bins))
+			return -1;
+	}
+
+	// Merge bin by bin
+	for (int s = 0; s < 2; s++) {
+		const ddsketch_store *from = stores[s];
+		ddsketch_store *to = targets[s];
+		if (!from->count)
+			continue;
+		for (int32_t i = from->min_index; i <= from->max_index; i++) {
+			uint64_t count = from->bins[i - from->offset];
+			if (count && store_add(to, i, count, dst->max_bins))
+				return -1;
+		}
+	}
+	dst->zero_count += src->zero_count;
+
+	if (!dst->count || src->min < dst->min)
+		dst->min = src->min;
+	if (!dst->count || src->max > dst->max)
+		dst->max = src->max;
+	dst->count += src->count;
+	return 0;
+}
+
+/**
+ * Adds a count to a bin of the sketch. The min and
+ * max are not updated.
+ * @arg dd The sketch to add to
+ * @arg negative Non-zero for the bins of negative values
+ * @arg index The bin index
+ * @arg count The count to add
+ * @return 0 on success, -1 on failure.
+ */
+int ddsketch_add_bin(ddsketch *dd, int negative, int32_t index, uint64_t count)
+{
+	if (!count)
+		return 0;
+	ddsketch_store *store = (negative) ? &dd->negative : &dd->positive;
+	if (store_add(store, index, count, dd->max_bins))
+		return -1;
+	dd->count += count;
+	return 0;
+}
+
+/* Returns the bin index for a positive magnitude */
+static int32_t ddsketch_index(ddsketch *dd, double magnitude)
+{
+	return (int32_t)ceil(log(magnitude) * dd->inv_log_gamma);
+}
+
+/*
+ * Returns the estimate for a bin index. This is the point
+ * with the same relative error to both bin boundaries.
+ */
+static double ddsketch_value(const ddsketch *dd, int32_t index)
+{
+	return 2 * pow(dd->gamma, index) / (dd->gamma + 1);
+}
+
+/**
+ * Ensures the store window covers the indexes from low
+ * to high. If that is wider than max_bins, the lowest
+ * indexes are collapsed into the first bin.
+ * @return 0 on success, -1 on allocation failure.
+ */
+static int store_extend(ddsketch_store *store, int32_t low, int32_t high, uint32_t max_bins)
+{
+	if (store->count) {
+		if (store->min_index < low)
+			low = store->min_index;
+		if (store->max_index > high)
+			high = store->max_index;
+	}
+
+	// Check if the window already covers the range. A window
+	// at the max size takes the low indexes as they are, since
+	// store_add collapses them into the first bin.
+	if (store->bins && (low >= store->offset || store->size >= max_bins) &&
+			(int64_t)high < (int64_t)store->offset + store->size)
+		return 0;
+
+	// Size the new window, doubling up to the limit
+	uint64_t range = (int64_t)high - low + 1;
+	uint32_t size = (store->size) ? store->size : STORE_MIN_BINS;
+	while (size < range && size < max_bins)
+		size *= 2;
+	if (size > max_bins)
+		size = max_bins;
+
+	// Center the range if it fits, otherwise keep the highest
+	int32_t offset;
+	if (range <= size)
+		offset = low - (int32_t)((size - range) / 2);
+	else
+		offset = high - (int32_t)size + 1;
+
+	uint64_t *bins = calloc(size, sizeof(uint64_t));
+	if (!bins)
+		return -1;
+
+	// Move the existing counts, collapsing the low ones
+	if (store->count) {
+		int32_t target;
+		for (int32_t i = store->min_index; i <= store->max_index; i++) {
+			target = (i < offset) ? offset : i;
+			bins[target - offset] += store->bins[i - store->offset];
+		}
+		if (store->min_index < offset)
+			store->min_index = offset;
+	}
+
+	free(store->bins);
+	store->bins = bins;
+	store->size = size;
+	store->offset = offset;
+	return 0;
+}
+
+/* Adds count values at an index to the store */
+static int store_add(ddsketch_store *store, int32_t index, uint64_t count, uint32_t max_bins)
+{
+	if (store_extend(store, index, index, max_bins))
+		return -1;
+
+	// Collapse the index if it is below the window
+	if (index < store->offset)
+		index = store->offset;
+	store->bins[index - store->offset] += count;
+
+	if (!store->count || index < store->min_index)
+		store->min_index = index;
+	if (!store->count || index > store->max_index)
+		store->max_index = index;
+	store->count += count;
+	return 0;
+}
+
+/**
+ * Returns the memory allocated for the bins of the sketch.
+ * @arg dd The sketch to query
+ * @return The size in bytes, without the struct itself.
+ */
+size_t ddsketch_memory(const ddsketch *dd)
+{
+	return ((size_t)dd->positive.size + dd->negative.size) * sizeof(uint64_t);
+}
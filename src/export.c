@@ -0,0 +1,513 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include "export.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// Room for the longest timer suffix, before its number
+#define EXPORT_MAX_SUFFIX 32
+
+// The state of one metrics_export call
+struct export_ctx {
+	struct metrics_export *e;
+	struct metrics *m;
+	size_t prefix_len;
+	char sep;					// Between the fields of a text line
+	char ts[24];				// The formatted timestamp
+	int ts_len;
+};
+
+static const uint64_t POW10[] = {
+	1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
+static int format_u64(char *out, uint64_t val);
+static int export_cb(void *data, enum metric_type type, char *name, void *value);
+
+/**
+ * Initializes an export. The format options can be set on the
+ * struct after this, and default to no prefixes, only counter
+ * sums, 6 decimals and a zero timestamp.
+ * @arg format The output format
+ * @arg bufs The buffers to write into, which must exist for the
+ * life of the export. A line or record must fit in one buffer.
+ * @arg num_bufs The number of buffers, must be positive
+ * @arg sink Called with the filled buffers
+ * @arg sink_data Opaque handle passed to the sink
+ * @arg e The export to initialize
+ * @return 0 on success.
+ */
+int init_metrics_export(export_format format, const struct iovec * bufs, int num_bufs, export_sink sink,
+		void *sink_data, struct metrics_export * e)
+{
+	if (num_bufs <= 0)
+		return -1;
+	e->filled = malloc(num_bufs * sizeof(struct iovec));
+	if (!e->filled)
+		return -1;
+	for (int i = 0; i < num_bufs; i++) {
+		e->filled[i].iov_base = bufs[i].iov_base;
+		e->filled[i].iov_len = 0;
+	}
+	e->format = format;
+	e->prefix = NULL;
+	e->use_type_prefix = 0;
+	e->extended_counters = 0;
+	e->precision = 6;
+	e->timestamp = 0;
+	e->bufs = bufs;
+	e->num_bufs = num_bufs;
+	e->cur = 0;
+	e->sink = sink;
+	e->sink_data = sink_data;
+	e->bytes = 0;
+	e->failed = 0;
+	return 0;
+}
+
+/**
+ * Destroys an export
+ * @arg e The export to destroy
+ * @return 0 on success.
+ */
+int destroy_metrics_export(struct metrics_export * e)
+{
+	free(e->filled);
+	e->filled = NULL;
+	return 0;
+}
+
+// Hands the filled buffers to the sink, and starts over
+static void flush(struct metrics_export * e)
+{
+	int count = e->cur + (e->filled[e->cur].iov_len > 0);
+	if (count && !e->failed) {
+		if (e->sink(e->sink_data, e->filled, count))
+			e->failed = 1;
+		for (int i = 0; i < count; i++)
+			e->bytes += e->filled[i].iov_len;
+	}
+	for (int i = 0; i < count; i++)
+		e->filled[i].iov_len = 0;
+	e->cur = 0;
+}
+
+// Returns room for len bytes in a buffer, moving to the next
+// buffer or flushing if the current one is full
+static char *reserve(struct metrics_export * e, size_t len)
+{
+	struct iovec *f = e->filled + e->cur;
+	if (f->iov_len + len > e->bufs[e->cur].iov_len) {
+		if (e->cur + 1 < e->num_bufs)
+			e->cur++;
+		else
+			flush(e);
+		f = e->filled + e->cur;
+		if (e->failed || len > e->bufs[e->cur].iov_len) {
+			e->failed = 1;
+			return NULL;
+		}
+	}
+	return (char *)f->iov_base + f->iov_len;
+}
+
+/**
+ * Writes all the metrics in the export format, handing
+ * the output to the sink. The export can be reused for
+ * other metrics, or another interval.
+ * @arg m The metrics to export
+ * @arg e The export to write with
+ * @return 0 on success, -1 if a record did not fit in a
+ * buffer or the sink failed.
+ */
+int metrics_export(struct metrics * m, struct metrics_export * e)
+{
+	struct export_ctx c;
+	c.e = e;
+	c.m = m;
+	c.prefix_len = (e->prefix) ? strlen(e->prefix) : 0;
+	c.sep = (e->format == EXPORT_GRAPHITE) ? ' ' : '|';
+	c.ts_len = format_u64(c.ts, e->timestamp);
+	if (e->precision < 0 || e->precision > 9)
+		e->precision = 6;
+
+	e->failed = 0;
+	metrics_iter(m, &c, export_cb);
+	flush(e);
+	return (e->failed) ? -1 : 0;
+}
+
+// Writes the digits of an integer, returning the length
+static int format_u64(char *out, uint64_t val)
+{
+	char digits[20];
+	int len = 0;
+	do {
+		digits[len++] = '0' + val % 10;
+		val /= 10;
+	} while (val);
+	for (int i = 0; i < len; i++)
+		out[i] = digits[len - 1 - i];
+	return len;
+}
+
+/**
+ * Formats a double with a fixed number of decimals, as
+ * printf "%.*f" does, without going through printf for
+ * values under 2^53, unless they are too close to a
+ * rounding tie to round from the scaled fraction.
+ * @arg out The output, at least EXPORT_MAX_NUMBER bytes
+ * @arg val The value to format
+ * @arg precision The number of decimals, on [0, 9]
+ * @return The length written, without a null terminator.
+ */
+int export_format_double(char *out, double val, int precision)
+{
+	if (precision < 0)
+		precision = 0;
+	else if (precision > 9)
+		precision = 9;
+	if (isnan(val)) {
+		memcpy(out, "nan", 3);
+		return 3;
+	}
+
+	char *p = out;
+	if (signbit(val)) {
+		*p++ = '-';
+		val = -val;
+	}
+	if (isinf(val)) {
+		memcpy(p, "inf", 3);
+		return p - out + 3;
+	}
+
+	// Large values are left to printf, since they
+	// have no fraction to speak of
+	if (!(val < 9007199254740992.0))
+		return p - out + snprintf(p, EXPORT_MAX_NUMBER - 1, "%.*f", precision, val);
+
+	if (!precision)
+		return p - out + format_u64(p, (uint64_t)rint(val));
+
+	// The fraction is split off exactly, and only it
+	// is scaled, carrying into the integer if it rounds up.
+	// Ties round to even, as printf does
+	double whole = floor(val);
+	double scaled = (val - whole) * POW10[precision];
+
+	// Scaling rounds by at most half an ulp, which can only
+	// change the rounding of a value within an ulp of a tie.
+	// printf rounds those from the exact decimal expansion.
+	double tie = scaled - floor(scaled) - 0.5;
+	if (fabs(tie) <= nextafter(scaled, INFINITY) - scaled)
+		return p - out + snprintf(p, EXPORT_MAX_NUMBER - 1, "%.*f", precision, val);
+
+	uint64_t ip = (uint64_t)whole;
+	uint64_t frac = (uint64_t)rint(scaled);
+	if (frac >= POW10[precision]) {
+		ip++;
+		frac -= POW10[precision];
+	}
+	p += format_u64(p, ip);
+	*p++ = '.';
+	for (int i = precision - 1; i >= 0; i--) {
+		p[i] = '0' + frac % 10;
+		frac /= 10;
+	}
+	return p - out + precision;
+}
+
+/*
+ * Text formats
+ */
+
+// Writes a line of prefix, name, suffix, value and timestamp
+static void put_line(struct export_ctx *c, const char *type_prefix, const char *name, size_t name_len,
+		const char *suffix, size_t suffix_len, const char *num, int num_len)
+{
+	size_t type_len = strlen(type_prefix);
+	size_t len = c->prefix_len + type_len + name_len + suffix_len + num_len + c->ts_len + 3;
+	char *p = reserve(c->e, len);
+	if (!p)
+		return;
+
+	if (c->prefix_len) {
+		memcpy(p, c->e->prefix, c->prefix_len);
+		p += c->prefix_len;
+	}
+	memcpy(p, type_prefix, type_len);
+	p += type_len;
+	memcpy(p, name, name_len);
+	p += name_len;
+	memcpy(p, suffix, suffix_len);
+	p += suffix_len;
+	*p++ = c->sep;
+	memcpy(p, num, num_len);
+	p += num_len;
+	*p++ = c->sep;
+	memcpy(p, c->ts, c->ts_len);
+	p += c->ts_len;
+	*p = '\n';
+	c->e->filled[c->e->cur].iov_len += len;
+}
+
+static void put_double_line(struct export_ctx *c, const char *type_prefix, const char *name, size_t name_len,
+		const char *suffix, double val)
+{
+	char num[EXPORT_MAX_NUMBER];
+	int num_len = export_format_double(num, val, c->e->precision);
+	put_line(c, type_prefix, name, name_len, suffix, strlen(suffix), num, num_len);
+}
+
+static void put_u64_line(struct export_ctx *c, const char *type_prefix, const char *name, size_t name_len,
+		const char *suffix, uint64_t val)
+{
+	char num[24];
+	int num_len = format_u64(num, val);
+	put_line(c, type_prefix, name, name_len, suffix, strlen(suffix), num, num_len);
+}
+
+// Writes the suffix of a quantile, as ".median" or ".p99"
+static int quantile_suffix(char *out, double quantile)
+{
+	if (quantile == 0.5) {
+		memcpy(out, ".median", 7);
+		return 7;
+	}
+	memcpy(out, ".p", 2);
+	int len = export_format_double(out + 2, quantile * 100, 3) + 2;
+
+	// Trim the decimals that are not needed
+	while (out[len - 1] == '0')
+		len--;
+	if (out[len - 1] == '.')
+		len--;
+	return len;
+}
+
+static void put_text_timer(struct export_ctx *c, const char *type_prefix, const char *name, size_t name_len,
+		struct timer_hist *t)
+{
+	timer *tm = &t->tm;
+	put_double_line(c, type_prefix, name, name_len, ".sum", timer_sum(tm));
+	put_double_line(c, type_prefix, name, name_len, ".sum_sq", timer_squared_sum(tm));
+	put_double_line(c, type_prefix, name, name_len, ".mean", timer_mean(tm));
+	put_double_line(c, type_prefix, name, name_len, ".lower", timer_min(tm));
+	put_double_line(c, type_prefix, name, name_len, ".upper", timer_max(tm));
+	put_u64_line(c, type_prefix, name, name_len, ".count", timer_count(tm));
+	put_double_line(c, type_prefix, name, name_len, ".stdev", timer_stddev(tm));
+
+	char suffix[EXPORT_MAX_SUFFIX + EXPORT_MAX_NUMBER];
+	char num[EXPORT_MAX_NUMBER];
+	for (uint32_t i = 0; i < c->m->num_quants; i++) {
+		int suffix_len = quantile_suffix(suffix, c->m->quantiles[i]);
+		int num_len = export_format_double(num, timer_query(tm, c->m->quantiles[i]), c->e->precision);
+		put_line(c, type_prefix, name, name_len, suffix, suffix_len, num, num_len);
+	}
+
+	// A line per histogram bin, named by its lower bound
+	histogram_config *conf = t->conf;
+	for (int i = 0; conf && i < conf->num_bins; i++) {
+		const char *bin_name = ".histogram.bin_";
+		if (i == 0)
+			bin_name = ".histogram.bin_<";
+		else if (i == conf->num_bins - 1)
+			bin_name = ".histogram.bin_>";
+		int suffix_len = strlen(bin_name);
+		memcpy(suffix, bin_name, suffix_len);
+		double bound = (i == 0) ? conf->min_val : histogram_bin_lower(conf, i);
+		suffix_len += export_format_double(suffix + suffix_len, bound, 2);
+		int num_len = format_u64(num, histogram_count(&t->counts, i));
+		put_line(c, type_prefix, name, name_len, suffix, suffix_len, num, num_len);
+	}
+}
+
+static void put_text(struct export_ctx *c, enum metric_type type, const char *name, void *value)
+{
+	size_t name_len = strlen(name);
+	int typed = c->e->use_type_prefix;
+	switch (type) {
+	case metric_type_KEY_VAL:
+		put_double_line(c, (typed) ? "kv." : "", name, name_len, "", *(double *)value);
+		break;
+
+	case metric_type_GAUGE:
+		put_double_line(c, (typed) ? "gauges." : "", name, name_len, "", ((struct gauge *)value)->value);
+		break;
+
+	case metric_type_SET:
+		put_u64_line(c, (typed) ? "sets." : "", name, name_len, "", set_size(value));
+		break;
+
+	case metric_type_COUNTER: {
+		struct counter *counter = value;
+		const char *type_prefix = (typed) ? "counts." : "";
+		if (!c->e->extended_counters) {
+			put_double_line(c, type_prefix, name, name_len, "", counter_sum(counter));
+			break;
+		}
+		put_u64_line(c, type_prefix, name, name_len, ".count", counter_count(counter));
+		put_double_line(c, type_prefix, name, name_len, ".mean", counter_mean(counter));
+		put_double_line(c, type_prefix, name, name_len, ".stdev", counter_stddev(counter));
+		put_double_line(c, type_prefix, name, name_len, ".sum", counter_sum(counter));
+		put_double_line(c, type_prefix, name, name_len, ".sum_sq", counter_squared_sum(counter));
+		put_double_line(c, type_prefix, name, name_len, ".lower", counter_min(counter));
+		put_double_line(c, type_prefix, name, name_len, ".upper", counter_max(counter));
+		break;
+	}
+
+	case metric_type_TIMER:
+		put_text_timer(c, (typed) ? "timers." : "", name, name_len, value);
+		break;
+
+	default:
+		break;
+	}
+}
+
+/*
+ * Binary format
+ */
+
+static void encode_u16(char *out, uint16_t val)
+{
+	out[0] = val;
+	out[1] = val >> 8;
+}
+
+static void encode_double(char *out, double val)
+{
+	uint64_t bits;
+	memcpy(&bits, &val, sizeof(bits));
+	for (int i = 0; i < 8; i++)
+		out[i] = bits >> (8 * i);
+}
+
+static void put_binary(struct export_ctx *c, enum metric_type type, const char *name, void *value)
+{
+	double vals[7 + 255];
+	int num_vals = 0;
+	switch (type) {
+	case metric_type_KEY_VAL:
+		vals[num_vals++] = *(double *)value;
+		break;
+
+	case metric_type_GAUGE:
+		vals[num_vals++] = ((struct gauge *)value)->value;
+		break;
+
+	case metric_type_SET:
+		vals[num_vals++] = set_size(value);
+		break;
+
+	case metric_type_COUNTER: {
+		struct counter *counter = value;
+		vals[num_vals++] = counter_count(counter);
+		vals[num_vals++] = counter_sum(counter);
+		vals[num_vals++] = counter_squared_sum(counter);
+		vals[num_vals++] = counter_mean(counter);
+		vals[num_vals++] = counter_min(counter);
+		vals[num_vals++] = counter_max(counter);
+		vals[num_vals++] = counter_stddev(counter);
+		break;
+	}
+
+	case metric_type_TIMER: {
+		timer *tm = &((struct timer_hist *)value)->tm;
+		if (c->m->num_quants > 255 - 7) {
+			c->e->failed = 1;
+			return;
+		}
+		vals[num_vals++] = timer_count(tm);
+		vals[num_vals++] = timer_sum(tm);
+		vals[num_vals++] = timer_squared_sum(tm);
+		vals[num_vals++] = timer_mean(tm);
+		vals[num_vals++] = timer_min(tm);
+		vals[num_vals++] = timer_max(tm);
+		vals[num_vals++] = timer_stddev(tm);
+		for (uint32_t i = 0; i < c->m->num_quants; i++)
+			vals[num_vals++] = timer_query(tm, c->m->quantiles[i]);
+		break;
+	}
+
+	default:
+		return;
+	}
+
+	size_t name_len = strlen(name);
+	if (name_len > UINT16_MAX) {
+		c->e->failed = 1;
+		return;
+	}
+	size_t len = 4 + name_len + 8 * num_vals;
+	char *p = reserve(c->e, len);
+	if (!p)
+		return;
+	p[0] = type;
+	p[1] = num_vals;
+	encode_u16(p + 2, name_len);
+	memcpy(p + 4, name, name_len);
+	p += 4 + name_len;
+	for (int i = 0; i < num_vals; i++)
+		encode_double(p + 8 * i, vals[i]);
+	c->e->filled[c->e->cur].iov_len += len;
+}
+
+static int export_cb(void *data, enum metric_type type, char *name, void *value)
+{
+	struct export_ctx *c = data;
+	if (c->e->format == EXPORT_BINARY)
+		put_binary(c, type, name, value);
+	else
+		put_text(c, type, name, value);
+	return c->e->failed;
+}
+
+/**
+ * A sink that writes the buffers to a file descriptor
+ * with writev, retrying partial writes.
+ * @arg data Pointer to an int file descriptor
+ * @arg iov The buffers to write
+ * @arg iovcnt The number of entries in iov
+ * @return 0 on success, -1 on a write error.
+ */
+int export_writev_sink(void *data, const struct iovec * iov, int iovcnt)
+{
+	int fd = *(int *)data;
+
+	// A copy, so partial writes can be resumed
+	struct iovec *left = malloc(iovcnt * sizeof(struct iovec));
+	if (!left)
+		return -1;
+	memcpy(left, iov, iovcnt * sizeof(struct iovec));
+
+	int i = 0;
+	while (i < iovcnt) {
+		int count = (iovcnt - i < IOV_MAX) ? iovcnt - i : IOV_MAX;
+		ssize_t n = writev(fd, left + i, count);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			free(left);
+			return -1;
+		}
+		while (i < iovcnt && (size_t)n >= left[i].iov_len) {
+			n -= left[i].iov_len;
+			i++;
+		}
+		if (i < iovcnt) {
+			left[i].iov_base = (char *)left[i].iov_base + n;
+			left[i].iov_len -= n;
+		}
+	}
+	free(left);
+	return 0;
+}
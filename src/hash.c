@@ -0,0 +1,184 @@
+#include <string.h>
+#include "hash.h"
+#include "MurmurHash3.h"
+
+// The hash function of the process
+static hash_function selected = HASH_MURMUR3;
+
+// Set once a hashmap, set or HLL exists, after which the
+// function can not change
+static int locked = 0;
+
+// The default secret of wyhash
+static const uint64_t wyhash_secret[4] = {
+	0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL, 0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL
+};
+
+/**
+ * Picks the hash function for the process. This must be
+ * called before any hashmap, set or HLL is created, since
+ * their contents depend on it.
+ * @arg f The hash function
+ * @return 0 on success, -1 for an unknown function, or
+ * for a change after the hash is in use.
+ */
+int hash_select(hash_function f)
+{
+	if (f != HASH_MURMUR3 && f != HASH_WYHASH)
+		return -1;
+	if (f == selected)
+		return 0;
+	if (__atomic_load_n(&locked, __ATOMIC_RELAXED))
+		return -1;
+	selected = f;
+	return 0;
+}
+
+/**
+ * Marks the hash function as in use, so hash_select
+ * refuses to change it. Called by the hashmaps, sets
+ * and HLLs when they are created.
+ */
+void hash_lock(void)
+{
+	if (!__atomic_load_n(&locked, __ATOMIC_RELAXED))
+		__atomic_store_n(&locked, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Returns the hash function in use
+ * @return The function picked with hash_select
+ */
+hash_function hash_selected(void)
+{
+	return selected;
+}
+
+/**
+ * Hashes a key with the selected hash function
+ * @arg key The key to hash
+ * @arg len The length of the key
+ * @return The 64 bit hash of the key
+ */
+uint64_t hash_bytes(const void *key, size_t len)
+{
+	if (selected == HASH_WYHASH)
+		return hash_wyhash(key, len);
+	return hash_murmur3(key, len);
+}
+
+/**
+ * Hashes a key with MurmurHash3_x64_128, keeping the
+ * second half of the output, as statsite does.
+ * @arg key The key to hash
+ * @arg len The length of the key
+ * @return The 64 bit hash of the key
+ */
+uint64_t hash_murmur3(const void *key, size_t len)
+{
+	uint64_t out[2];
+	MurmurHash3_x64_128(key, len, 0, &out);
+	return out[1];
+}
+
+// Multiplies two words into a 128 bit product, as low and high words
+static inline void wy_mum(uint64_t *a, uint64_t *b)
+{
+#ifdef __SIZEOF_INT128__
+	__uint128_t r = *a;
+	r *= *b;
+	*a = (uint64_t)r;
+	*b = (uint64_t)(r >> 64);
+#else
+	uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+	uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+	uint64_t t = rl + (rm0 << 32), c = t < rl;
+	uint64_t lo = t + (rm1 << 32);
+	c += lo < t;
+	*a = lo;
+	*b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+// Folds the 128 bit product of two words
+static inline uint64_t wy_mix(uint64_t a, uint64_t b)
+{
+	wy_mum(&a, &b);
+	return a ^ b;
+}
+
+// Unaligned reads. The hash is defined on little endian reads,
+// big endian hosts get another, equally good, hash.
+static inline uint64_t wy_r8(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, 8);
+	return v;
+}
+
+static inline uint64_t wy_r4(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+// Reads 1 to 3 bytes
+static inline uint64_t wy_r3(const uint8_t *p, size_t k)
+{
+	return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+}
+
+/**
+ * Hashes a key with wyhash, with the default secret
+ * @arg key The key to hash
+ * @arg len The length of the key
+ * @return The 64 bit hash of the key
+ */
+uint64_t hash_wyhash(const void *key, size_t len)
+{
+	const uint8_t *p = key;
+	const uint64_t *secret = wyhash_secret;
+	uint64_t seed = wy_mix(secret[0], secret[1]);
+	uint64_t a, b;
+
+	// Short keys are read as overlapping words, without a loop
+	if (__builtin_expect(len <= 16, 1)) {
+		if (len >= 4) {
+			a = (wy_r4(p) << 32) | wy_r4(p + ((len >> 3) << 2));
+			b = (wy_r4(p + len - 4) << 32) | wy_r4(p + len - 4 - ((len >> 3) << 2));
+		} else if (len > 0) {
+			a = wy_r3(p, len);
+			b = 0;
+		} else {
+			a = b = 0;
+		}
+	} else {
+		size_t i = len;
+
+		// Three independent lanes, so the multiplies overlap
+		if (i >= 48) {
+			uint64_t see1 = seed, see2 = seed;
+			do {
+				seed = wy_mix(wy_r8(p) ^ secret[1], wy_r8(p + 8) ^ seed);
+				see1 = wy_mix(wy_r8(p + 16) ^ secret[2], wy_r8(p + 24) ^ see1);
+				see2 = wy_mix(wy_r8(p + 32) ^ secret[3], wy_r8(p + 40) ^ see2);
+				p += 48;
+				i -= 48;
+			} while (i >= 48);
+			seed ^= see1 ^ see2;
+		}
+		while (i > 16) {
+			seed = wy_mix(wy_r8(p) ^ secret[1], wy_r8(p + 8) ^ seed);
+			i -= 16;
+			p += 16;
+		}
+		a = wy_r8(p + i - 16);
+		b = wy_r8(p + i - 8);
+	}
+
+	a ^= secret[1];
+	b ^= seed;
+	wy_mum(&a, &b);
+	return wy_mix(a ^ secret[0] ^ len, b ^ secret[1]);
+}
@@ -1,16 +1,42 @@
+/**
+ * Open addressing hashmap using Robin Hood probing.
+ *
+ * Each slot stores the full 64bit hash and the key length inline,
+ * so probing only touches the key string on a full hash match.
+ * Growth is incremental: the new table is allocated up front and
+ * slots are drained from the old table a few at a time on every
+ * write, instead of rehashing the whole map in one go.
+ *
+ * A map either owns a copy of each key, or interns its keys
+ * in a name pool that may be shared with other maps, in which
+ * case the slots only store the 32bit handle of the name.
+ */
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <limits.h>
 #include "hashmap.h"
+#include "hash.h"
+#include "perf_counters.h"
 
 #define MAX_CAPACITY 0.75
 #define DEFAULT_CAPACITY 128
 
+// Number of old table slots drained on each write while resizing.
+// The new table must absorb (MAX_CAPACITY * old size) inserts before
+// it grows again, so any step above 2 finishes in time.
+#define MIGRATE_STEP 16
+
 // Basic hash entry.
 typedef struct hashmap_entry {
-	char *key;
+	uint64_t hash;				// Full hash of the key
+	union {
+		char *ptr;				// Owned copy, for maps without a pool
+		uint32_t handle;		// Handle of the name, for maps with a pool
+	} key;
 	void *value;
-	struct hashmap_entry *next;	// Support linking.
+	uint32_t key_len;			// Length of the key, without the NULL
+	uint32_t dist;				// Probe distance + 1, 0 for an empty slot
 } hashmap_entry;
 
 struct hashmap {
@@ -18,10 +44,25 @@ struct hashmap {
 	int table_size;				// Size of table in nodes
 	int max_size;				// Max size before we resize
 	hashmap_entry *table;		// Pointer to an arry of hashmap_entry objects
+
+	// Incremental resize state. While old_table is set, its entries
+	// are moved into table starting at migrate_start, which is always
+	// a slot that was empty when the resize began.
+	hashmap_entry *old_table;	// Table being drained, or NULL
+	int old_size;				// Size of the old table in nodes
+	int migrate_start;			// First slot of the old table drained
+	int migrate_done;			// Number of old table slots drained
+
+	struct name_pool *pool;		// Pool of the keys, or NULL if they are owned
 };
 
-// Link the external murmur hash in
-extern void MurmurHash3_x64_128(const void *key, const int len, const uint32_t seed, void *out);
+static void hashmap_migrate(struct hashmap * map, int slots);
+
+// Returns the key of an entry
+static inline const char *entry_key(const struct name_pool *pool, const hashmap_entry * entry)
+{
+	return (pool) ? pool->data + entry->key.handle : entry->key.ptr;
+}
 
 /**
  * Creates a new hashmap and allocates space for it.
@@ -50,13 +91,22 @@ int hashmap_init(int initial_size, struct hashmap ** map)
 		initial_size = 1 << most_sig_bit;
 	}
 
+	// The contents depend on the hash from here on
+	hash_lock();
+
 	// Allocate the map
 	struct hashmap *m = calloc(1, sizeof(struct hashmap));
+	if (!m)
+		return -1;
 	m->table_size = initial_size;
 	m->max_size = MAX_CAPACITY * initial_size;
 
 	// Allocate the table
 	m->table = (hashmap_entry *) calloc(initial_size, sizeof(hashmap_entry));
+	if (!m->table) {
+		free(m);
+		return -1;
+	}
 
 	// Return the table
 	*map = m;
@@ -64,36 +114,46 @@ int hashmap_init(int initial_size, struct hashmap ** map)
 }
 
 /**
- * Destroys a map and cleans up all associated memory
- * @arg map The hashmap to destroy. Frees memory.
+ * Creates a new hashmap with its keys interned in a pool.
+ * @arg initial_size The minimim initial size. 0 for default (64).
+ * @arg pool The pool of the keys, which must exist for the
+ * life of the map. It may be shared between maps.
+ * @arg map Output. Set to the address of the map
+ * @return 0 on success.
  */
-int hashmap_destroy(struct hashmap * map)
+int hashmap_init_pool(int initial_size, struct name_pool * pool, struct hashmap ** map)
 {
-	// Free each entry
-	hashmap_entry *entry, *old;
-	int in_table;
-	for (int i = 0; i < map->table_size; i++) {
-		entry = map->table + i;
-		in_table = 1;
-		while (entry && entry->key) {
-			// Walk the next links
-			old = entry;
-			entry = entry->next;
-
-			// Clear the objects
-			free(old->key);
-
-			// The initial entry is in the table
-			// and we should not free that one.
-			if (!in_table) {
-				free(old);
-			}
-			in_table = 0;
+	int res = hashmap_init(initial_size, map);
+	if (!res)
+		(*map)->pool = pool;
+	return res;
+}
+
+// Frees all the owned keys in a table, and marks the slots empty
+static void free_table_keys(struct hashmap * map, hashmap_entry * table, int table_size)
+{
+	for (int i = 0; i < table_size; i++) {
+		if (table[i].dist) {
+			if (!map->pool)
+				free(table[i].key.ptr);
+			table[i].key.ptr = NULL;
+			table[i].dist = 0;
 		}
 	}
+}
 
-	// Free the table and hash map
+/**
+ * Destroys a map and cleans up all associated memory
+ * @arg map The hashmap to destroy. Frees memory.
+ */
+int hashmap_destroy(struct hashmap * map)
+{
+	free_table_keys(map, map->table, map->table_size);
 	free(map->table);
+	if (map->old_table) {
+		free_table_keys(map, map->old_table, map->old_size);
+		free(map->old_table);
+	}
 	free(map);
 	return 0;
 }
@@ -107,146 +167,323 @@ int hashmap_size(struct hashmap * map)
 }
 
 /**
- * Gets a value.
- * @arg key The key to look for
+ * Computes the hash of a key, as used by all hashmaps,
+ * with the function picked by hash_select.
+ * @arg key The key to hash
  * @arg key_len The key length
- * @arg value Output. Set to the value of th key.
- * 0 on success. -1 if not found.
+ * @return The 64bit hash of the key
  */
-int hashmap_get(struct hashmap * map, char *key, void **value)
+uint64_t hashmap_hash_key(const char *key, size_t key_len)
 {
-	// Compute the hash value of the key
-	uint64_t out[2];
-	MurmurHash3_x64_128(key, strlen(key), 0, &out);
-
-	// Mod the lower 64bits of the hash function with the table
-	// size to get the index
-	unsigned int index = out[1] % map->table_size;
-
-	// Look for an entry
-	hashmap_entry *entry = map->table + index;
-
-	// Scan the keys
-	while (entry && entry->key) {
-		// Found it
-		if (strcmp(entry->key, key) == 0) {
-			*value = entry->value;
-			return 0;
-		}
-		// Walk the chain
-		entry = entry->next;
-	}
+	return hash_bytes(key, key_len);
+}
+
+/**
+ * Hints that the slot for a hash will be probed soon,
+ * so the cache miss can overlap with other work.
+ * @arg hash The hash of the key, from hashmap_hash_key
+ */
+void hashmap_prefetch(struct hashmap * map, uint64_t hash)
+{
+	__builtin_prefetch(map->table + (hash & (map->table_size - 1)));
+	if (map->old_table)
+		__builtin_prefetch(map->old_table + (hash & (map->old_size - 1)));
+}
 
-	// Not found
-	return -1;
+/**
+ * Probes a table for a key, starting at a given slot.
+ * @arg dist The probe distance + 1 of the starting slot
+ * @return The matching entry, or NULL if not found.
+ */
+static hashmap_entry *table_probe(const struct name_pool *pool, hashmap_entry * table, unsigned mask,
+	unsigned pos, uint32_t dist, const char *key, uint32_t key_len, uint64_t hash)
+{
+	hashmap_entry *entry;
+	for (;; pos = (pos + 1) & mask, dist++) {
+		entry = table + pos;
+		PERF_ADD(hashmap_probes, 1);
+
+		// Empty slots and entries closer to their home slot
+		// than we are terminate the search
+		if (entry->dist < dist)
+			return NULL;
+
+		// Only compare the key on a full hash and length match
+		if (entry->hash == hash && entry->key_len == key_len && !memcmp(entry_key(pool, entry), key, key_len))
+			return entry;
+	}
 }
 
-void *hashmap_get_value(struct hashmap * map, char *key)
+/**
+ * Looks for a key in both the current table, and
+ * the old table if we are in the middle of a resize.
+ * @arg in_old Output. Set to 1 if found in the old table. Can be NULL.
+ * @return The matching entry or NULL.
+ */
+static hashmap_entry *hashmap_lookup(struct hashmap * map, const char *key, uint32_t key_len,
+	uint64_t hash, int *in_old)
 {
-	void *value = NULL;
-	hashmap_get(map, key, &value);
-	return value;
+	PERF_ADD(hashmap_lookups, 1);
+	unsigned mask = map->table_size - 1;
+	hashmap_entry *entry = table_probe(map->pool, map->table, mask, hash & mask, 1, key, key_len, hash);
+	if (entry || !map->old_table) {
+		if (in_old)
+			*in_old = 0;
+		return entry;
+	}
+
+	// The slots starting at migrate_start have been drained and are
+	// empty. If the home slot is in that range, the entry can only be
+	// past the drained range, so skip ahead to the first live slot.
+	mask = map->old_size - 1;
+	unsigned pos = hash & mask;
+	uint32_t dist = 1;
+	if (((pos - map->migrate_start) & mask) < map->migrate_done) {
+		unsigned first_live = (map->migrate_start + map->migrate_done) & mask;
+		dist += (first_live - pos) & mask;
+		pos = first_live;
+	}
+	if (in_old)
+		*in_old = 1;
+	return table_probe(map->pool, map->old_table, mask, pos, dist, key, key_len, hash);
 }
 
 /**
- * Internal method to insert into a hash table
+ * Internal method to insert into a hash table, using
+ * Robin Hood displacement. The key must not already exist.
  * @arg table The table to insert into
  * @arg table_size The size of the table
- * @arg key The key to insert
- * @arg key_len The length of the key
- * @arg value The value to associate
- * @arg should_cmp Should keys be compared to existing ones.
- * @arg should_dup Should duplicate keys
- * @return 1 if the key is new, 0 if updated.
+ * @arg new The entry to insert. The dist field is ignored.
+ * @return The slot the new entry was stored in.
  */
-static int hashmap_insert_table(hashmap_entry * table, int table_size, char *key, int key_len,
-	void *value, int should_cmp, int should_dup)
+static hashmap_entry *hashmap_insert_table(hashmap_entry * table, int table_size, hashmap_entry new)
 {
-	// Compute the hash value of the key
-	uint64_t out[2];
-	MurmurHash3_x64_128(key, key_len, 0, &out);
-
-	// Mod the lower 64bits of the hash function with the table
-	// size to get the index
-	unsigned int index = out[1] % table_size;
-
-	// Look for an entry
-	hashmap_entry *entry = table + index;
-	hashmap_entry *last_entry = NULL;
-
-	// Scan the keys
-	while (entry && entry->key) {
-		// Found it, update the value
-		if (should_cmp && (strcmp(entry->key, key) == 0)) {
-			entry->value = value;
-			return 0;
+	unsigned mask = table_size - 1;
+	unsigned pos = new.hash & mask;
+	hashmap_entry *result = NULL;
+	hashmap_entry *entry, tmp;
+
+	new.dist = 1;
+	for (;; pos = (pos + 1) & mask, new.dist++) {
+		entry = table + pos;
+
+		// Found an empty slot
+		if (!entry->dist) {
+			*entry = new;
+			return result ? result : entry;
 		}
-		// Walk the chain
-		last_entry = entry;
-		entry = entry->next;
-	}
 
-	// If last entry is NULL, we can just
-	// insert directly into the table slot
-	// since it is empty
-	if (last_entry == NULL) {
-		entry->key = (should_dup) ? strdup(key) : key;
-		entry->value = value;
+		// Take the slot from a richer entry, and keep going with it
+		if (entry->dist < new.dist) {
+			tmp = *entry;
+			*entry = new;
+			new = tmp;
+			if (!result)
+				result = entry;
+		}
+	}
+}
 
-		// We have a last value, need to link against it
-	} else {
-		entry = calloc(1, sizeof(hashmap_entry));
-		entry->key = (should_dup) ? strdup(key) : key;
-		entry->value = value;
-		last_entry->next = entry;
+/**
+ * Internal method to remove an entry from a table,
+ * shifting the following entries back into place.
+ */
+static void hashmap_remove_table(hashmap_entry * table, int table_size, hashmap_entry * entry)
+{
+	unsigned mask = table_size - 1;
+	unsigned pos = entry - table;
+	hashmap_entry *next;
+	for (;;) {
+		next = table + ((pos + 1) & mask);
+		if (next->dist <= 1)
+			break;
+		table[pos] = *next;
+		table[pos].dist--;
+		pos = (pos + 1) & mask;
 	}
-	return 1;
+	table[pos].key.ptr = NULL;
+	table[pos].value = NULL;
+	table[pos].dist = 0;
 }
 
 /**
- * Internal method to double the size of a hashmap
+ * Internal method to start doubling the size of a hashmap.
+ * The existing table becomes the old table, and is drained
+ * incrementally by hashmap_migrate.
  */
-static void hashmap_double_size(struct hashmap * map)
+static int hashmap_double_size(struct hashmap * map)
 {
-	// Calculate the new sizes
-	int new_size = map->table_size * 2;
-	int new_max_size = map->max_size * 2;
+	// Only one resize can be in progress
+	if (map->old_table)
+		hashmap_migrate(map, INT_MAX);
 
 	// Allocate the table
+	int new_size = map->table_size * 2;
 	hashmap_entry *new_table = (hashmap_entry *) calloc(new_size, sizeof(hashmap_entry));
+	if (!new_table)
+		return -1;
 
-	// Move each entry
-	hashmap_entry *entry, *old;
-	int in_table;
-	for (int i = 0; i < map->table_size; i++) {
-		entry = map->table + i;
-		in_table = 1;
-		while (entry && entry->key) {
-			// Walk the next links
-			old = entry;
-			entry = entry->next;
-
-			// Insert the value in the new map
-			// Do not compare keys or duplicate since we are just doubling our
-			// size, and we have unique keys and duplicates already.
-			hashmap_insert_table(new_table, new_size, old->key, strlen(old->key), old->value, 0, 0);
-
-			// The initial entry is in the table
-			// and we should not free that one.
-			if (!in_table) {
-				free(old);
-			}
-			in_table = 0;
-		}
-	}
+	// Start draining from an empty slot, which guarantees no
+	// probe sequence crosses from the live into the drained range
+	int start = 0;
+	while (map->table[start].dist)
+		start++;
 
-	// Free the old table
-	free(map->table);
+	map->old_table = map->table;
+	map->old_size = map->table_size;
+	map->migrate_start = start;
+	map->migrate_done = 0;
 
 	// Update the pointers
 	map->table = new_table;
 	map->table_size = new_size;
-	map->max_size = new_max_size;
+	map->max_size = MAX_CAPACITY * new_size;
+	PERF_ADD(hashmap_resizes, 1);
+	return 0;
+}
+
+/**
+ * Internal method to move a number of slots from the
+ * old table into the new one, if a resize is in progress.
+ */
+static void hashmap_migrate(struct hashmap * map, int slots)
+{
+	unsigned mask = map->old_size - 1;
+	hashmap_entry *entry;
+	while (map->old_table && slots-- > 0) {
+		entry = map->old_table + ((map->migrate_start + map->migrate_done) & mask);
+		if (entry->dist) {
+			hashmap_insert_table(map->table, map->table_size, *entry);
+			entry->dist = 0;
+		}
+
+		// Free the old table once fully drained
+		if (++map->migrate_done == map->old_size) {
+			free(map->old_table);
+			map->old_table = NULL;
+			map->old_size = 0;
+		}
+	}
+}
+
+/**
+ * Gets a value.
+ * @arg key The key to look for
+ * @arg value Output. Set to the value of th key.
+ * 0 on success. -1 if not found.
+ */
+int hashmap_get(struct hashmap * map, char *key, void **value)
+{
+	uint32_t key_len = strlen(key);
+	hashmap_entry *entry = hashmap_lookup(map, key, key_len, hashmap_hash_key(key, key_len), NULL);
+	if (!entry)
+		return -1;
+	*value = entry->value;
+	return 0;
+}
+
+void *hashmap_get_value(struct hashmap * map, char *key)
+{
+	void *value = NULL;
+	hashmap_get(map, key, &value);
+	return value;
+}
+
+/**
+ * Length-aware version of hashmap_get, for keys that are
+ * not null terminated and have already been hashed.
+ * @arg key The key to look for
+ * @arg key_len The key length
+ * @arg hash The hash of the key, from hashmap_hash_key
+ * @arg value Output. Set to the value of the key.
+ * @return 0 on success. -1 if not found.
+ */
+int hashmap_get_n(struct hashmap * map, const char *key, size_t key_len, uint64_t hash, void **value)
+{
+	hashmap_entry *entry = hashmap_lookup(map, key, key_len, hash, NULL);
+	if (!entry)
+		return -1;
+	*value = entry->value;
+	return 0;
+}
+
+/**
+ * Internal method to find a key, or insert it with a
+ * NULL value if it does not exist.
+ * @arg entry Output. Set to the matching or new entry.
+ * @return 0 if found, 1 if added, -1 on allocation failure.
+ */
+static int hashmap_upsert(struct hashmap * map, const char *key, uint32_t key_len, uint64_t hash,
+	hashmap_entry ** entry)
+{
+	// Make progress on any pending resize
+	hashmap_migrate(map, MIGRATE_STEP);
+
+	// Check if the key exists
+	*entry = hashmap_lookup(map, key, key_len, hash, NULL);
+	if (*entry)
+		return 0;
+
+	// Check if we need to double the size
+	if (map->count + 1 > map->max_size && hashmap_double_size(map))
+		return -1;
+
+	// Duplicate or intern the key, and insert into the current table
+	hashmap_entry new;
+	new.hash = hash;
+	new.key_len = key_len;
+	new.value = NULL;
+	if (map->pool) {
+		new.key.handle = name_pool_intern(map->pool, key, key_len, hash);
+		if (new.key.handle == NAME_POOL_NONE)
+			return -1;
+	} else {
+		new.key.ptr = malloc(key_len + 1);
+		if (!new.key.ptr)
+			return -1;
+		memcpy(new.key.ptr, key, key_len);
+		new.key.ptr[key_len] = 0;
+	}
+	*entry = hashmap_insert_table(map->table, map->table_size, new);
+	map->count += 1;
+	return 1;
+}
+
+/**
+ * Gets the value slot for a key, inserting the key
+ * with a NULL value if it does not exist.
+ * @notes This method is not thread safe.
+ * @arg key The key to look for. Copied if inserted.
+ * @arg value Output. Set to the address of the value slot.
+ * @return 0 if found, 1 if added, -1 on allocation failure.
+ */
+int hashmap_get_or_insert(struct hashmap * map, char *key, void ***value)
+{
+	hashmap_entry *entry;
+	uint32_t key_len = strlen(key);
+	int res = hashmap_upsert(map, key, key_len, hashmap_hash_key(key, key_len), &entry);
+	if (res >= 0)
+		*value = &entry->value;
+	return res;
+}
+
+/**
+ * Length-aware version of hashmap_get_or_insert, for keys
+ * that are not null terminated and have already been hashed.
+ * @arg key The key to look for. Copied and null terminated if inserted.
+ * @arg key_len The key length
+ * @arg hash The hash of the key, from hashmap_hash_key
+ * @arg value Output. Set to the address of the value slot.
+ * @return 0 if found, 1 if added, -1 on allocation failure.
+ */
+int hashmap_get_or_insert_n(struct hashmap * map, const char *key, size_t key_len, uint64_t hash,
+	void ***value)
+{
+	hashmap_entry *entry;
+	int res = hashmap_upsert(map, key, key_len, hash, &entry);
+	if (res >= 0)
+		*value = &entry->value;
+	return res;
 }
 
 /**
@@ -254,24 +491,17 @@ static void hashmap_double_size(struct hashmap * map)
  * @arg key The key to set. This is copied, and a seperate
  * version is owned by the hashmap. The caller the key at will.
  * @notes This method is not thread safe.
- * @arg key_len The key length
  * @arg value The value to set.
- * 0 if updated, 1 if added.
+ * 0 if updated, 1 if added, -1 on allocation failure.
  */
 int hashmap_put(struct hashmap * map, char *key, void *value)
 {
-	// Check if we need to double the size
-	if (map->count + 1 > map->max_size) {
-		// Doubles the size of the hashmap, re-try the insert
-		hashmap_double_size(map);
-		return hashmap_put(map, key, value);
-	}
-	// Insert into the map, comparing keys and duplicating keys
-	int new = hashmap_insert_table(map->table, map->table_size, key, strlen(key), value, 1, 1);
-	if (new)
-		map->count += 1;
-
-	return new;
+	hashmap_entry *entry;
+	uint32_t key_len = strlen(key);
+	int res = hashmap_upsert(map, key, key_len, hashmap_hash_key(key, key_len), &entry);
+	if (res >= 0)
+		entry->value = value;
+	return res;
 }
 
 /**
@@ -282,57 +512,36 @@ int hashmap_put(struct hashmap * map, char *key, void *value)
  */
 int hashmap_delete(struct hashmap * map, char *key)
 {
-	// Compute the hash value of the key
-	uint64_t out[2];
-	MurmurHash3_x64_128(key, strlen(key), 0, &out);
-
-	// Mod the lower 64bits of the hash function with the table
-	// size to get the index
-	unsigned int index = out[1] % map->table_size;
-
-	// Look for an entry
-	hashmap_entry *entry = map->table + index;
-	hashmap_entry *last_entry = NULL;
-
-	// Scan the keys
-	while (entry && entry->key) {
-		// Found it
-		if (strcmp(entry->key, key) == 0) {
-			// Free the key
-			free(entry->key);
-			map->count -= 1;
-
-			// Check if we are in the table
-			if (last_entry == NULL) {
-				// Copy the keys from the node, and free it
-				if (entry->next) {
-					hashmap_entry *n = entry->next;
-					entry->key = n->key;
-					entry->value = n->value;
-					entry->next = n->next;
-					free(n);
-
-					// Zero everything out
-				} else {
-					entry->key = NULL;
-					entry->value = NULL;
-				}
-
-			} else {
-				// Skip us in the list
-				last_entry->next = entry->next;
-
-				// Free ourself
-				free(entry);
-			}
-			return 0;
-		}
-		// Walk the chain
-		entry = entry->next;
-	}
+	uint32_t key_len = strlen(key);
+	return hashmap_delete_n(map, key, key_len, hashmap_hash_key(key, key_len));
+}
 
-	// Not found
-	return -1;
+/**
+ * Length-aware version of hashmap_delete, for keys that are
+ * not null terminated and have already been hashed. Does not
+ * allocate, so it can undo a hashmap_get_or_insert_n.
+ * @notes This method is not thread safe.
+ * @arg key The key to delete
+ * @arg key_len The key length
+ * @arg hash The hash of the key, from hashmap_hash_key
+ * 0 on success. -1 if not found.
+ */
+int hashmap_delete_n(struct hashmap * map, const char *key, size_t key_len, uint64_t hash)
+{
+	int in_old;
+	hashmap_entry *entry = hashmap_lookup(map, key, key_len, hash, &in_old);
+	if (!entry)
+		return -1;
+
+	// Free the key, and close the gap
+	if (!map->pool)
+		free(entry->key.ptr);
+	if (in_old)
+		hashmap_remove_table(map->old_table, map->old_size, entry);
+	else
+		hashmap_remove_table(map->table, map->table_size, entry);
+	map->count -= 1;
+	return 0;
 }
 
 /**
@@ -342,28 +551,14 @@ int hashmap_delete(struct hashmap * map, char *key)
  */
 int hashmap_clear(struct hashmap * map)
 {
-	hashmap_entry *entry, *old;
-	int in_table;
-	for (int i = 0; i < map->table_size; i++) {
-		entry = map->table + i;
-		in_table = 1;
-		while (entry && entry->key) {
-			// Walk the next links
-			old = entry;
-			entry = entry->next;
-
-			// Clear the objects
-			free(old->key);
-
-			// The initial entry is in the table
-			// and we should not free that one.
-			if (!in_table) {
-				free(old);
-			} else {
-				old->key = NULL;
-			}
-			in_table = 0;
-		}
+	free_table_keys(map, map->table, map->table_size);
+
+	// Drop any pending resize
+	if (map->old_table) {
+		free_table_keys(map, map->old_table, map->old_size);
+		free(map->old_table);
+		map->old_table = NULL;
+		map->old_size = 0;
 	}
 
 	// Reset the sizes
@@ -371,6 +566,57 @@ int hashmap_clear(struct hashmap * map)
 	return 0;
 }
 
+// Iterates a range of a table, invoking the callback on each entry
+static int iter_table(const struct name_pool *pool, hashmap_entry * table, int start, int end,
+	hashmap_callback cb, void *data)
+{
+	int should_break = 0;
+	for (int i = start; i < end && !should_break; i++) {
+		if (table[i].dist)
+			should_break = cb(data, entry_key(pool, table + i), table[i].value);
+	}
+	return should_break;
+}
+
+/**
+ * Iterates through the key/value pairs in the map, removing
+ * every pair for which the callback returns non-zero. The
+ * callback is responsible for releasing a removed value.
+ * @notes This method is not thread safe.
+ * @arg map The hashmap to filter
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return The number of pairs removed.
+ */
+int hashmap_filter(struct hashmap * map, hashmap_callback cb, void *data)
+{
+	// Finish any resize, so there is a single table
+	if (map->old_table)
+		hashmap_migrate(map, INT_MAX);
+
+	// Start from an empty slot, so the backward shift on
+	// removal never moves an entry we already visited
+	unsigned mask = map->table_size - 1;
+	int start = 0;
+	while (start < map->table_size && map->table[start].dist)
+		start++;
+
+	int removed = 0;
+	hashmap_entry *entry;
+	for (int i = 0; i < map->table_size; i++) {
+		entry = map->table + ((start + i) & mask);
+		while (entry->dist && cb(data, entry_key(map->pool, entry), entry->value)) {
+			// Another entry may be shifted into this slot
+			if (!map->pool)
+				free(entry->key.ptr);
+			hashmap_remove_table(map->table, map->table_size, entry);
+			map->count -= 1;
+			removed++;
+		}
+	}
+	return removed;
+}
+
 /**
  * Iterates through the key/value pairs in the map,
  * invoking a callback for each. The call back gets a
@@ -383,15 +629,111 @@ int hashmap_clear(struct hashmap * map)
  */
 int hashmap_iter(struct hashmap * map, hashmap_callback cb, void *data)
 {
-	hashmap_entry *entry;
 	int should_break = 0;
-	for (int i = 0; i < map->table_size && !should_break; i++) {
-		entry = map->table + i;
-		while (entry && entry->key && !should_break) {
-			// Invoke the callback
-			should_break = cb(data, entry->key, entry->value);
-			entry = entry->next;
-		}
+	if (map->old_table)
+		should_break = iter_table(map->pool, map->old_table, 0, map->old_size, cb, data);
+	if (!should_break)
+		should_break = iter_table(map->pool, map->table, 0, map->table_size, cb, data);
+	return should_break;
+}
+
+/**
+ * Returns the number of slots that hashmap_iter_range
+ * covers. Ranges of slots can be iterated concurrently,
+ * as long as the map is not modified.
+ * @arg map The hashmap
+ * @return The number of slots
+ */
+int hashmap_slots(struct hashmap * map)
+{
+	return map->old_size + map->table_size;
+}
+
+/**
+ * Iterates through the key/value pairs in a range of slots,
+ * invoking a callback for each, as with hashmap_iter. The
+ * slots of the old table, while resizing, come first.
+ * @arg map The hashmap to iterate over
+ * @arg start The first slot, on [0, hashmap_slots)
+ * @arg end One past the last slot
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, or the return of the callback.
+ */
+int hashmap_iter_range(struct hashmap * map, int start, int end, hashmap_callback cb, void *data)
+{
+	int should_break = 0;
+	int old_size = map->old_size;
+	if (map->old_table && start < old_size)
+		should_break = iter_table(map->pool, map->old_table, start, (end < old_size) ? end : old_size, cb,
+			data);
+	if (!should_break && end > old_size) {
+		start = (start > old_size) ? start - old_size : 0;
+		should_break = iter_table(map->pool, map->table, start, end - old_size, cb, data);
 	}
 	return should_break;
 }
+
+/**
+ * Interns the keys of a pooled map into another pool, and
+ * switches the map to it. The names of all the maps sharing
+ * the old pool must be moved before it is destroyed.
+ * @notes This method is not thread safe.
+ * @arg map The hashmap, which must have a pool
+ * @arg pool The new pool
+ * @return 0 on success, -1 on allocation failure, in
+ * which case the map keeps its old pool.
+ */
+int hashmap_move_keys(struct hashmap * map, struct name_pool * pool)
+{
+	if (!map->pool)
+		return -1;
+
+	// Intern all the keys before any handle is changed, so a
+	// failure leaves the map as it was. The second pass only
+	// finds the names, and can not fail.
+	hashmap_entry *tables[] = { map->table, map->old_table };
+	int sizes[] = { map->table_size, map->old_size };
+	for (int pass = 0; pass < 2; pass++) {
+		for (int t = 0; t < 2; t++) {
+			for (int i = 0; tables[t] && i < sizes[t]; i++) {
+				hashmap_entry *entry = tables[t] + i;
+				if (!entry->dist)
+					continue;
+				uint32_t handle = name_pool_intern(pool, entry_key(map->pool, entry), entry->key_len,
+						entry->hash);
+				if (handle == NAME_POOL_NONE)
+					return -1;
+				if (pass)
+					entry->key.handle = handle;
+			}
+		}
+	}
+	map->pool = pool;
+	return 0;
+}
+
+/**
+ * Returns the memory allocated by a map, for its tables
+ * and owned keys. Interned keys are accounted for by
+ * their pool, and the values by their owner.
+ * @arg map The hashmap
+ * @return The size in bytes.
+ */
+size_t hashmap_memory(struct hashmap * map)
+{
+	size_t bytes = sizeof(struct hashmap);
+	bytes += ((size_t)map->table_size + map->old_size) * sizeof(hashmap_entry);
+	if (map->pool)
+		return bytes;
+
+	hashmap_entry *tables[] = { map->table, map->old_table };
+	int sizes[] = { map->table_size, map->old_size };
+	for (int t = 0; t < 2; t++) {
+		for (int i = 0; tables[t] && i < sizes[t]; i++) {
+			if (tables[t][i].dist)
+				bytes += tables[t][i].key_len + 1;
+		}
+	}
+	return bytes;
+}
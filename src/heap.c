@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "heap.h"
+#include "perf_counters.h"
 
 // Helpful Macro's
 #define LEFT_CHILD(i)   ((i<<1)+1)
@@ -27,6 +28,10 @@
 
 #define GET_ENTRY(index,table) ((heap_entry*)(table+index))
 
+// The double keyed heap is 4-ary
+#define DHEAP_FIRST_CHILD(i) ((i<<2)+1)
+#define DHEAP_PARENT(i)      ((i-1)>>2)
+
 #ifdef _WIN32
 # include <windows.h>
 long getpagesize(void)
@@ -52,6 +57,13 @@ long getpagesize(void)
  */
 static int ENTRIES_PER_PAGE = 0;
 
+/**
+ * Stores the number of dheap_entry structures
+ * we can fit into a single page of memory. These
+ * are larger than heap_entry on 32bit systems.
+ */
+static int DHEAP_ENTRIES_PER_PAGE = 0;
+
 /**
  * Stores the number of bytes in a single
  * page of memory.
@@ -107,17 +119,24 @@ int compare_int_keys(register void *key1, register void *key2)
 		return 1;
 }
 
-// Creates a new heap
-void heap_create(heap * h, int initial_size, int (*comp_func) (void *, void *))
+// Sets up the page size globals on first use
+static void init_page_size(void)
 {
-	// Check if we need to setup our globals
 	if (PAGE_SIZE == 0) {
 		// Get the page size
 		PAGE_SIZE = getpagesize();
 
 		// Calculate the max entries
 		ENTRIES_PER_PAGE = PAGE_SIZE / sizeof(heap_entry);
+		DHEAP_ENTRIES_PER_PAGE = PAGE_SIZE / sizeof(dheap_entry);
 	}
+}
+
+// Creates a new heap
+void heap_create(heap * h, int initial_size, int (*comp_func) (void *, void *))
+{
+	// Check if we need to setup our globals
+	init_page_size();
 	// Check that initial size is greater than 0, else set it to ENTRIES_PER_PAGE
 	if (initial_size <= 0)
 		initial_size = ENTRIES_PER_PAGE;
@@ -212,6 +231,8 @@ void heap_insert(heap * h, void *key, void *value)
 		map_out_pages(h->table, h->allocated_pages);
 
 		// Switch to the new table
+		PERF_ADD(heap_grows, 1);
+		PERF_ADD(heap_pages, new_size - h->allocated_pages);
 		h->table = new_table;
 		h->allocated_pages = new_size;
 	}
@@ -402,3 +423,152 @@ void heap_foreach(heap * h, void (*func) (void *, void *))
 		func(entry->key, entry->value);
 	}
 }
+
+// Returns the memory allocated for the entries of the heap
+size_t heap_memory(heap * h)
+{
+	return (size_t)h->allocated_pages * PAGE_SIZE;
+}
+
+/*
+ * The double keyed heap.
+ */
+
+// Creates a new double keyed heap
+int dheap_create(dheap * h, int initial_size)
+{
+	init_page_size();
+	if (initial_size <= 0)
+		initial_size = DHEAP_ENTRIES_PER_PAGE;
+
+	h->active_entries = 0;
+	h->allocated_pages =
+		initial_size / DHEAP_ENTRIES_PER_PAGE + ((initial_size % DHEAP_ENTRIES_PER_PAGE > 0) ? 1 : 0);
+	h->minimum_pages = h->allocated_pages;
+
+	// The entries are written before they are read, so there
+	// is no need to clear the table
+	h->table = malloc(h->allocated_pages * PAGE_SIZE);
+	return (h->table) ? 0 : -1;
+}
+
+// Cleanup a double keyed heap
+void dheap_destroy(dheap * h)
+{
+	free(h->table);
+	h->active_entries = 0;
+	h->allocated_pages = 0;
+	h->table = NULL;
+}
+
+// Gets the size of the heap
+int dheap_size(dheap * h)
+{
+	return h->active_entries;
+}
+
+// Gets the minimum element
+int dheap_min(dheap * h, double *key, void **value)
+{
+	if (h->active_entries == 0)
+		return 0;
+	if (key)
+		*key = h->table[0].key;
+	if (value)
+		*value = h->table[0].value;
+	return 1;
+}
+
+// Insert a new element
+int dheap_insert(dheap * h, double key, void *value)
+{
+	// Double the table if it is full. realloc can extend the
+	// table in place, or remap large tables, instead of copying.
+	if (h->active_entries + 1 > h->allocated_pages * DHEAP_ENTRIES_PER_PAGE) {
+		int new_size = h->allocated_pages * 2;
+		dheap_entry *new_table = realloc(h->table, (size_t)new_size * PAGE_SIZE);
+		if (!new_table)
+			return -1;
+		PERF_ADD(heap_grows, 1);
+		PERF_ADD(heap_pages, new_size - h->allocated_pages);
+		h->table = new_table;
+		h->allocated_pages = new_size;
+	}
+
+	// Move the parents down into the hole until the key fits
+	dheap_entry *table = h->table;
+	int index = h->active_entries;
+	int parent;
+	while (index > 0) {
+		parent = DHEAP_PARENT(index);
+		if (!(key < table[parent].key))
+			break;
+		table[index] = table[parent];
+		index = parent;
+	}
+	table[index].key = key;
+	table[index].value = value;
+	h->active_entries++;
+	return 0;
+}
+
+// Deletes the minimum entry in the heap
+int dheap_delmin(dheap * h, double *key, void **value)
+{
+	if (h->active_entries == 0)
+		return 0;
+
+	dheap_entry *table = h->table;
+	if (key)
+		*key = table[0].key;
+	if (value)
+		*value = table[0].value;
+
+	// Sift the last entry down from the root, moving the
+	// smallest of the children up into the hole
+	int entries = --h->active_entries;
+	if (entries > 0) {
+		dheap_entry last = table[entries];
+		int index = 0;
+		int child, end, min;
+		while (child = DHEAP_FIRST_CHILD(index), child < entries) {
+			end = (child + 4 < entries) ? child + 4 : entries;
+			min = child;
+			for (child++; child < end; child++) {
+				if (table[child].key < table[min].key)
+					min = child;
+			}
+			if (!(table[min].key < last.key))
+				break;
+			table[index] = table[min];
+			index = min;
+		}
+		table[index] = last;
+	}
+
+	// Allow one empty page, but not two. Shrinking in place
+	// keeps the entries, so a failure just keeps the old table.
+	int used_pages = entries / DHEAP_ENTRIES_PER_PAGE + ((entries % DHEAP_ENTRIES_PER_PAGE > 0) ? 1 : 0);
+	if (h->allocated_pages / 2 > used_pages + 1 && h->allocated_pages / 2 >= h->minimum_pages) {
+		int new_size = h->allocated_pages / 2;
+		dheap_entry *new_table = realloc(h->table, (size_t)new_size * PAGE_SIZE);
+		if (new_table) {
+			h->table = new_table;
+			h->allocated_pages = new_size;
+		}
+	}
+	return 1;
+}
+
+void *dheap_delmin_value(dheap * h)
+{
+	void *value = NULL;
+	dheap_delmin(h, NULL, &value);
+	return value;
+}
+
+// Returns the memory allocated for the entries of the heap
+size_t dheap_memory(dheap * h)
+{
+	return (size_t)h->allocated_pages * PAGE_SIZE;
+}
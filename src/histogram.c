@@ -0,0 +1,347 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <limits.h>
+#include "histogram.h"
+
+// Number of samples binned at a time by histogram_add_samples
+#define HISTOGRAM_BLOCK 64
+
+// Initial number of bins allocated for sparse counts
+#define HISTOGRAM_SPARSE_MIN 4
+
+/**
+ * Prepares a histogram config for binning, computing the
+ * number of bins and the bin scale from the other settings.
+ * @arg conf The config, with the min, max, width and scale set
+ * @return 0 on success, -1 if the settings are invalid.
+ */
+int histogram_init(histogram_config * conf)
+{
+	if (!(conf->min_val < conf->max_val))
+		return -1;
+
+	// The range is divided by the bin width, and we add 2
+	// for the less than min, and more than max bins
+	double range;
+	switch (conf->scale) {
+	case HISTOGRAM_LINEAR:
+		if (!(conf->bin_width > 0))
+			return -1;
+		conf->bin_scale = 1.0 / conf->bin_width;
+		conf->bin_offset = conf->min_val;
+		range = (conf->max_val - conf->min_val) * conf->bin_scale;
+		break;
+
+	case HISTOGRAM_LOG:
+		if (!(conf->min_val > 0) || !(conf->bin_width > 1))
+			return -1;
+		conf->bin_scale = 1.0 / log(conf->bin_width);
+		conf->bin_offset = log(conf->min_val);
+		// Round off the error of the logs, so a max that is
+		// an exact power of the width from the min gets its bin
+		range = log(conf->max_val / conf->min_val) * conf->bin_scale + 1e-9;
+		break;
+
+	default:
+		return -1;
+	}
+	if (!(range < INT_MAX - 2))
+		return -1;
+	conf->num_bins = (int)range + 2;
+	return 0;
+}
+
+// Maps a sample to a fractional bin position, clamped to the
+// bins. This has no branches, so it can be vectorized. NaN
+// samples go into the first bin.
+static inline double bin_position(const histogram_config * conf, double val, double last)
+{
+	if (conf->scale == HISTOGRAM_LOG)
+		val = log(fmax(val, DBL_MIN));
+	double pos = (val - conf->bin_offset) * conf->bin_scale + 1;
+	pos = (pos >= 0) ? pos : 0;
+	return (pos < last) ? pos : last;
+}
+
+/**
+ * Returns the bin of a sample
+ * @arg conf The histogram config
+ * @arg val The sample
+ * @return The index of the bin, on [0, num_bins)
+ */
+int histogram_bin(const histogram_config * conf, double val)
+{
+	return (int)bin_position(conf, val, conf->num_bins - 1);
+}
+
+/**
+ * Returns the lower bound of a bin. The first bin has
+ * no lower bound, and returns the min of the config.
+ * @arg conf The histogram config
+ * @arg bin The bin, on [0, num_bins)
+ * @return The smallest value in the bin
+ */
+double histogram_bin_lower(const histogram_config * conf, int bin)
+{
+	int steps = (bin > 0) ? bin - 1 : 0;
+	if (conf->scale == HISTOGRAM_LOG)
+		return conf->min_val * pow(conf->bin_width, steps);
+	return conf->min_val + steps * conf->bin_width;
+}
+
+/**
+ * Initializes the counts for a histogram, with
+ * the storage of the config.
+ * @arg conf The histogram config
+ * @arg counts The counts to initialize
+ * @return 0 on success, -1 if the counts could not be allocated.
+ */
+int histogram_counts_init(const histogram_config * conf, histogram_counts * counts)
+{
+	counts->storage = conf->storage;
+	counts->num_bins = conf->num_bins;
+	counts->used = 0;
+	counts->size = 0;
+	switch (conf->storage) {
+	case HISTOGRAM_DENSE32:
+		counts->store.counts32 = calloc(conf->num_bins, sizeof(uint32_t));
+		break;
+	case HISTOGRAM_DENSE64:
+		counts->store.counts64 = calloc(conf->num_bins, sizeof(uint64_t));
+		break;
+	case HISTOGRAM_SPARSE:
+		// Nothing is allocated until a bin is hit
+		counts->store.sparse = NULL;
+		return 0;
+	default:
+		return -1;
+	}
+	return (counts->store.counts32) ? 0 : -1;
+}
+
+/**
+ * Destroys the counts of a histogram
+ * @arg counts The counts to destroy
+ */
+void histogram_counts_destroy(histogram_counts * counts)
+{
+	// All the stores share the pointer
+	free(counts->store.counts32);
+	counts->store.counts32 = NULL;
+	counts->used = 0;
+	counts->size = 0;
+}
+
+/**
+ * Zeroes the counts of a histogram, keeping the allocations
+ * @arg counts The counts to reset
+ */
+void histogram_counts_reset(histogram_counts * counts)
+{
+	switch (counts->storage) {
+	case HISTOGRAM_DENSE32:
+		memset(counts->store.counts32, 0, counts->num_bins * sizeof(uint32_t));
+		break;
+	case HISTOGRAM_DENSE64:
+		memset(counts->store.counts64, 0, counts->num_bins * sizeof(uint64_t));
+		break;
+	case HISTOGRAM_SPARSE:
+		counts->used = 0;
+		break;
+	}
+}
+
+// Returns the position of a bin in sparse counts, or the
+// position it would be inserted at
+static uint32_t sparse_find(const histogram_counts * counts, uint32_t bin)
+{
+	uint32_t low = 0, high = counts->used;
+	while (low < high) {
+		uint32_t mid = (low + high) / 2;
+		if (counts->store.sparse[mid].bin < bin)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+/**
+ * Returns the count of a bin
+ * @arg counts The counts of the histogram
+ * @arg bin The bin, on [0, num_bins)
+ * @return The count of the bin
+ */
+uint64_t histogram_count(const histogram_counts * counts, int bin)
+{
+	switch (counts->storage) {
+	case HISTOGRAM_DENSE32:
+		return counts->store.counts32[bin];
+	case HISTOGRAM_DENSE64:
+		return counts->store.counts64[bin];
+	case HISTOGRAM_SPARSE: {
+		uint32_t idx = sparse_find(counts, bin);
+		if (idx < counts->used && counts->store.sparse[idx].bin == (uint32_t)bin)
+			return counts->store.sparse[idx].count;
+		return 0;
+	}
+	default:
+		return 0;
+	}
+}
+
+// Adds to a bin of sparse counts, inserting it if needed
+static int sparse_add(histogram_counts * counts, uint32_t bin, uint64_t count)
+{
+	uint32_t idx = sparse_find(counts, bin);
+	histogram_sparse_bin *sparse = counts->store.sparse;
+	if (idx < counts->used && sparse[idx].bin == bin) {
+		sparse[idx].count += count;
+		return 0;
+	}
+
+	// Grow the array, there are at most num_bins entries
+	if (counts->used == counts->size) {
+		uint32_t size = (counts->size) ? counts->size * 2 : HISTOGRAM_SPARSE_MIN;
+		if (size > counts->num_bins)
+			size = counts->num_bins;
+		sparse = realloc(sparse, size * sizeof(histogram_sparse_bin));
+		if (!sparse)
+			return -1;
+		counts->store.sparse = sparse;
+		counts->size = size;
+	}
+	memmove(sparse + idx + 1, sparse + idx, (counts->used - idx) * sizeof(histogram_sparse_bin));
+	sparse[idx].bin = bin;
+	sparse[idx].count = count;
+	counts->used++;
+	return 0;
+}
+
+// Increments a bin, in any storage
+static inline int increment_bin(histogram_counts * counts, int bin)
+{
+	switch (counts->storage) {
+	case HISTOGRAM_DENSE32:
+		counts->store.counts32[bin]++;
+		return 0;
+	case HISTOGRAM_DENSE64:
+		counts->store.counts64[bin]++;
+		return 0;
+	default:
+		return sparse_add(counts, bin, 1);
+	}
+}
+
+/**
+ * Adds to the count of a bin
+ * @arg counts The counts of the histogram
+ * @arg bin The bin, on [0, num_bins)
+ * @arg count The count to add
+ * @return 0 on success, -1 if sparse counts could not grow.
+ */
+int histogram_counts_add(histogram_counts * counts, int bin, uint64_t count)
+{
+	switch (counts->storage) {
+	case HISTOGRAM_DENSE32:
+		counts->store.counts32[bin] += count;
+		return 0;
+	case HISTOGRAM_DENSE64:
+		counts->store.counts64[bin] += count;
+		return 0;
+	default:
+		return (count) ? sparse_add(counts, bin, count) : 0;
+	}
+}
+
+/**
+ * Adds a sample to the counts of a histogram
+ * @arg conf The histogram config
+ * @arg counts The counts, initialized for the config
+ * @arg val The sample to add
+ * @return 0 on success, -1 if sparse counts could not grow.
+ */
+int histogram_add_sample(const histogram_config * conf, histogram_counts * counts, double val)
+{
+	return increment_bin(counts, histogram_bin(conf, val));
+}
+
+/**
+ * Adds an array of samples to the counts of a histogram. The bins
+ * are computed a block at a time before the counts are incremented.
+ * @arg conf The histogram config
+ * @arg counts The counts, initialized for the config
+ * @arg vals The samples to add
+ * @arg num_vals The number of samples
+ * @return 0 on success, -1 if sparse counts could not grow.
+ */
+int histogram_add_samples(const histogram_config * conf, histogram_counts * counts, const double *vals,
+		size_t num_vals)
+{
+	int bins[HISTOGRAM_BLOCK];
+	double last = conf->num_bins - 1;
+	double offset = conf->bin_offset;
+	double scale = conf->bin_scale;
+	double pos;
+	int rc = 0;
+	while (num_vals) {
+		size_t block = (num_vals < HISTOGRAM_BLOCK) ? num_vals : HISTOGRAM_BLOCK;
+
+		// Compute the bins. The linear case is kept separate, as
+		// the same loop with a log would not be vectorized.
+		if (conf->scale == HISTOGRAM_LOG) {
+			for (size_t i = 0; i < block; i++) {
+				bins[i] = (int)bin_position(conf, vals[i], last);
+			}
+		} else {
+			for (size_t i = 0; i < block; i++) {
+				pos = (vals[i] - offset) * scale + 1;
+				pos = (pos >= 0) ? pos : 0;
+				pos = (pos < last) ? pos : last;
+				bins[i] = (int)pos;
+			}
+		}
+
+		// Increment the counts
+		switch (counts->storage) {
+		case HISTOGRAM_DENSE32:
+			for (size_t i = 0; i < block; i++) {
+				counts->store.counts32[bins[i]]++;
+			}
+			break;
+		case HISTOGRAM_DENSE64:
+			for (size_t i = 0; i < block; i++) {
+				counts->store.counts64[bins[i]]++;
+			}
+			break;
+		default:
+			for (size_t i = 0; i < block; i++) {
+				if (sparse_add(counts, bins[i], 1))
+					rc = -1;
+			}
+			break;
+		}
+		vals += block;
+		num_vals -= block;
+	}
+	return rc;
+}
+
+/**
+ * Returns the memory allocated for the counts of a histogram
+ * @arg counts The counts of the histogram
+ * @return The size in bytes, without the struct itself.
+ */
+size_t histogram_counts_memory(const histogram_counts * counts)
+{
+	switch (counts->storage) {
+	case HISTOGRAM_DENSE32:
+		return (size_t)counts->num_bins * sizeof(uint32_t);
+	case HISTOGRAM_DENSE64:
+		return (size_t)counts->num_bins * sizeof(uint64_t);
+	default:
+		return (size_t)counts->size * sizeof(histogram_sparse_bin);
+	}
+}
@@ -4,8 +4,10 @@
 State of The Art Cardinality Estimation Algorithm"
  *
  * We implement a HyperLogLog using 6 bits for register,
- * and a 64bit hash function. For our needs, we always use
- * a dense representation and avoid the sparse/dense conversions.
+ * and a 64bit hash function. Small HLLs use the sparse
+ * representation, with a sorted array of 32bit entries
+ * rather than the varint delta encoding from the paper,
+ * and are converted to dense once they grow.
  *
  */
 #include <stdlib.h>
@@ -15,6 +17,7 @@ State of The Art Cardinality Estimation Algorithm"
 #include <stdint.h>
 #include <stdio.h>
 #include "hll.h"
+#include "hash.h"
 #include "hll_constants.h"
 
 #define REG_WIDTH 6				// Bits per register
@@ -23,8 +26,31 @@ State of The Art Cardinality Estimation Algorithm"
 
 #define NUM_REG(precision) ((1 << precision))
 
-// Link the external murmur hash in
-extern void MurmurHash3_x64_128(const void *key, const int len, const uint32_t seed, void *out);
+// Masks for the even registers of a word (0, 2, 4), and
+// the bit just above each one. Odd registers (1, 3) are
+// shifted down onto the positions of registers 0 and 2.
+#define EVEN_REG_MASK 0x3F03F03F
+#define EVEN_REG_GUARD 0x40040040
+#define ODD_REG_MASK 0x0003F03F
+#define ODD_REG_GUARD 0x00040040
+
+// The sparse representation uses a 25 bit index. Each entry
+// is the index, followed by the register value for the
+// remaining hash bits and a flag. The register and flag
+// are only set if the index bits after the dense index
+// are all zero, because otherwise they determine the
+// dense register value.
+#define SPARSE_PRECISION 25
+#define SPARSE_MIN_SIZE 16
+#define SPARSE_INDEX(entry) ((entry) >> 7)
+
+/* Static declarations */
+static int hll_words(unsigned char precision);
+static uint32_t dense_size(const hll_t * h);
+static void sparse_add(hll_t * h, uint32_t entry);
+static void sparse_flush(hll_t * h);
+static int sparse_to_dense(hll_t * h);
+static void dense_add_hash(hll_t * h, uint64_t hash);
 
 /**
  * Initializes a new HLL
@@ -33,25 +59,55 @@ extern void MurmurHash3_x64_128(const void *key, const int len, const uint32_t s
  * @return 0 on success
  */
 int hll_init(unsigned char precision, hll_t * h)
+{
+	return hll_init_layout(precision, HLL_LAYOUT_PACKED, h);
+}
+
+/**
+ * Initializes a new HLL, with a given register layout
+ * @arg precision The digits of precision to use
+ * @arg layout The layout of the dense registers
+ * @arg h The HLL to initialize
+ * @return 0 on success
+ */
+int hll_init_layout(unsigned char precision, hll_layout layout, hll_t * h)
 {
 	// Ensure the precision is somewhat sane
 	if (precision < HLL_MIN_PRECISION || precision > HLL_MAX_PRECISION)
 		return -1;
 
+	// The contents depend on the hash from here on
+	hash_lock();
+
 	// Store precision
 	h->precision = precision;
+	h->layout = layout;
 
-	// Determine how many registers are needed
-	int reg = NUM_REG(precision);
+	// Start with an empty sparse representation
+	h->registers = NULL;
+	h->bytes = NULL;
+	h->sparse = malloc(SPARSE_MIN_SIZE * sizeof(uint32_t));
+	if (!h->sparse)
+		return -1;
+	h->sparse_len = 0;
+	h->sparse_pending = 0;
+	h->sparse_size = SPARSE_MIN_SIZE;
+	return 0;
+}
 
+/* Returns the number of words for the dense registers */
+static int hll_words(unsigned char precision)
+{
 	// Get the full words required
-	int words = ceil(reg / (double)REG_PER_WORD);
+	return (NUM_REG(precision) + REG_PER_WORD - 1) / REG_PER_WORD;
+}
 
-	// Allocate and zero out the registers
-	h->registers = calloc(words, sizeof(uint32_t));
-	if (!h->registers)
-		return -1;
-	return 0;
+/* Returns the size in bytes of the dense registers */
+static uint32_t dense_size(const hll_t * h)
+{
+	if (h->layout == HLL_LAYOUT_BYTE)
+		return NUM_REG(h->precision);
+	return hll_words(h->precision) * sizeof(uint32_t);
 }
 
 /**
@@ -61,11 +117,28 @@ int hll_init(unsigned char precision, hll_t * h)
 int hll_destroy(hll_t * h)
 {
 	free(h->registers);
+	free(h->bytes);
+	free(h->sparse);
+	h->registers = NULL;
+	h->bytes = NULL;
+	h->sparse = NULL;
 	return 0;
 }
 
-static int get_register(hll_t * h, int idx)
+/**
+ * Checks if the HLL still uses the sparse representation
+ * @arg h The hll to check
+ * @return 1 if sparse, 0 if dense
+ */
+int hll_is_sparse(const hll_t * h)
+{
+	return h->sparse != NULL;
+}
+
+static int get_register(const hll_t * h, int idx)
 {
+	if (h->layout == HLL_LAYOUT_BYTE)
+		return h->bytes[idx];
 	uint32_t word = *(h->registers + (idx / REG_PER_WORD));
 	word = word >> REG_WIDTH * (idx % REG_PER_WORD);
 	return word & ((1 << REG_WIDTH) - 1);
@@ -73,6 +146,10 @@ static int get_register(hll_t * h, int idx)
 
 static void set_register(hll_t * h, int idx, int val)
 {
+	if (h->layout == HLL_LAYOUT_BYTE) {
+		h->bytes[idx] = val;
+		return;
+	}
 	uint32_t *word = h->registers + (idx / REG_PER_WORD);
 
 	// Shift the val into place
@@ -92,11 +169,7 @@ static void set_register(hll_t * h, int idx, int val)
 void hll_add(hll_t * h, char *key)
 {
 	// Compute the hash value of the key
-	uint64_t out[2];
-	MurmurHash3_x64_128(key, strlen(key), 0, &out);
-
-	// Add the hashed value
-	hll_add_hash(h, out[1]);
+	hll_add_hash(h, hash_bytes(key, strlen(key)));
 }
 
 /**
@@ -105,6 +178,26 @@ void hll_add(hll_t * h, char *key)
  * @arg hash The hash to add
  */
 void hll_add_hash(hll_t * h, uint64_t hash)
+{
+	if (!h->sparse) {
+		dense_add_hash(h, hash);
+		return;
+	}
+
+	// Encode the sparse entry, with the register
+	// value only if the extra index bits are zero
+	uint32_t idx = hash >> (64 - SPARSE_PRECISION);
+	uint32_t entry = idx << 7;
+	uint32_t extra = idx & ((1 << (SPARSE_PRECISION - h->precision)) - 1);
+	if (!extra) {
+		uint64_t rest = hash << SPARSE_PRECISION | (1 << (SPARSE_PRECISION - 1));
+		entry |= (__builtin_clzll(rest) + 1) << 1 | 1;
+	}
+	sparse_add(h, entry);
+}
+
+/* Adds a hash to the dense registers */
+static void dense_add_hash(hll_t * h, uint64_t hash)
 {
 	// Determine the index using the first p bits
 	int idx = hash >> (64 - h->precision);
@@ -115,12 +208,297 @@ void hll_add_hash(hll_t * h, uint64_t hash)
 	// Determine the count of leading zeros
 	int leading = __builtin_clzll(hash) + 1;
 
+	// Byte registers are a plain max
+	if (h->layout == HLL_LAYOUT_BYTE) {
+		uint8_t *reg = h->bytes + idx;
+		*reg = (leading > *reg) ? leading : *reg;
+		return;
+	}
+
 	// Update the register if the new value is larger
 	if (leading > get_register(h, idx)) {
 		set_register(h, idx, leading);
 	}
 }
 
+/*
+ * Decodes a sparse entry into the dense index
+ * and register value.
+ */
+static void sparse_decode(unsigned char precision, uint32_t entry, int *idx, int *reg)
+{
+	uint32_t sparse_idx = SPARSE_INDEX(entry);
+	int extra_bits = SPARSE_PRECISION - precision;
+	*idx = sparse_idx >> extra_bits;
+	if (entry & 1) {
+		*reg = extra_bits + ((entry >> 1) & ((1 << REG_WIDTH) - 1));
+	} else {
+		// The leading zeros within the extra index bits
+		uint32_t extra = sparse_idx & ((1 << extra_bits) - 1);
+		*reg = __builtin_clz(extra) - (INT_WIDTH - extra_bits) + 1;
+	}
+}
+
+static int cmp_entry(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Sorts the pending sparse entries into the list. Entries
+ * for the same index sort by register value, so only the
+ * last one of each index is kept.
+ */
+static void sparse_flush(hll_t * h)
+{
+	if (!h->sparse_pending)
+		return;
+	uint32_t count = h->sparse_len + h->sparse_pending;
+	qsort(h->sparse, count, sizeof(uint32_t), cmp_entry);
+
+	uint32_t out = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		if (i + 1 < count && SPARSE_INDEX(h->sparse[i]) == SPARSE_INDEX(h->sparse[i + 1]))
+			continue;
+		h->sparse[out++] = h->sparse[i];
+	}
+	h->sparse_len = out;
+	h->sparse_pending = 0;
+}
+
+/*
+ * Adds an entry to the sparse list. When the list is full
+ * it is sorted, and then either grown or, once it would
+ * not be smaller than the dense registers, converted.
+ */
+static void sparse_add(hll_t * h, uint32_t entry)
+{
+	if (h->sparse_len + h->sparse_pending == h->sparse_size) {
+		sparse_flush(h);
+
+		// Grow if the list is mostly full
+		if (h->sparse_len >= h->sparse_size / 4 * 3) {
+			uint32_t max_size = dense_size(h) / sizeof(uint32_t);
+			uint32_t *sparse = NULL;
+			if (h->sparse_size < max_size) {
+				uint32_t size = h->sparse_size * 2;
+				if (size > max_size)
+					size = max_size;
+				sparse = realloc(h->sparse, size * sizeof(uint32_t));
+				if (sparse) {
+					h->sparse = sparse;
+					h->sparse_size = size;
+				}
+			}
+
+			// Convert if we can not grow any more
+			if (!sparse) {
+				if (sparse_to_dense(h))
+					return;
+				int idx, reg;
+				sparse_decode(h->precision, entry, &idx, &reg);
+				if (reg > get_register(h, idx))
+					set_register(h, idx, reg);
+				return;
+			}
+		}
+	}
+	h->sparse[h->sparse_len + h->sparse_pending++] = entry;
+}
+
+/* Converts a sparse HLL to the dense representation */
+static int sparse_to_dense(hll_t * h)
+{
+	if (h->layout == HLL_LAYOUT_BYTE) {
+		h->bytes = calloc(NUM_REG(h->precision), sizeof(uint8_t));
+		if (!h->bytes)
+			return -1;
+	} else {
+		h->registers = calloc(hll_words(h->precision), sizeof(uint32_t));
+		if (!h->registers)
+			return -1;
+	}
+
+	int idx, reg;
+	uint32_t count = h->sparse_len + h->sparse_pending;
+	for (uint32_t i = 0; i < count; i++) {
+		sparse_decode(h->precision, h->sparse[i], &idx, &reg);
+		if (reg > get_register(h, idx))
+			set_register(h, idx, reg);
+	}
+
+	free(h->sparse);
+	h->sparse = NULL;
+	h->sparse_len = 0;
+	h->sparse_pending = 0;
+	h->sparse_size = 0;
+	return 0;
+}
+
+/*
+ * Computes the register-wise maximum of two sets of
+ * 6 bit registers, with empty bits between each one.
+ * Setting the guard bit above each register before
+ * subtracting keeps the borrows from crossing registers,
+ * and leaves the guard set where a >= b.
+ */
+static uint32_t register_lanes_max(uint32_t a, uint32_t b, uint32_t guard)
+{
+	uint32_t ge = ((a | guard) - b) & guard;
+	uint32_t mask = ge - (ge >> REG_WIDTH);
+	return (a & mask) | (b & ~mask);
+}
+
+/**
+ * Merges one HLL into another, by taking the
+ * maximum of each register.
+ * @arg dst The hll to merge into
+ * @arg src The hll to merge from. Not modified.
+ * @return 0 on success, -1 if the precisions differ.
+ */
+int hll_merge(hll_t * dst, const hll_t * src)
+{
+	if (dst->precision != src->precision)
+		return -1;
+
+	// A sparse source is added entry by entry
+	int reg;
+	if (src->sparse) {
+		return hll_merge_sparse(dst, src->sparse, src->sparse_len + src->sparse_pending);
+	}
+	if (dst->sparse && sparse_to_dense(dst))
+		return -1;
+
+	// Byte registers are a plain max
+	if (dst->layout == HLL_LAYOUT_BYTE && src->layout == HLL_LAYOUT_BYTE) {
+		int num_reg = NUM_REG(dst->precision);
+		uint8_t *a = dst->bytes;
+		const uint8_t *b = src->bytes;
+		for (int i = 0; i < num_reg; i++)
+			a[i] = (b[i] > a[i]) ? b[i] : a[i];
+		return 0;
+	}
+
+	// Mixed layouts go register by register
+	if (dst->layout != src->layout) {
+		int num_reg = NUM_REG(dst->precision);
+		for (int i = 0; i < num_reg; i++) {
+			reg = get_register(src, i);
+			if (reg > get_register(dst, i))
+				set_register(dst, i, reg);
+		}
+		return 0;
+	}
+
+	// Compare all the registers of a word at once
+	uint32_t a, b, even, odd;
+	int words = hll_words(dst->precision);
+	for (int i = 0; i < words; i++) {
+		a = dst->registers[i];
+		b = src->registers[i];
+		even = register_lanes_max(a & EVEN_REG_MASK, b & EVEN_REG_MASK, EVEN_REG_GUARD);
+		odd = register_lanes_max((a >> REG_WIDTH) & ODD_REG_MASK, (b >> REG_WIDTH) & ODD_REG_MASK,
+				ODD_REG_GUARD);
+		dst->registers[i] = even | (odd << REG_WIDTH);
+	}
+	return 0;
+}
+
+/**
+ * Returns the entries of a sparse HLL, sorted and unique.
+ * @arg h The hll to read
+ * @arg entries Output. The sparse entries, owned by the HLL
+ * @return The number of entries, or 0 if the HLL is dense.
+ */
+uint32_t hll_sparse_entries(hll_t * h, const uint32_t **entries)
+{
+	if (!h->sparse) {
+		*entries = NULL;
+		return 0;
+	}
+	sparse_flush(h);
+	*entries = h->sparse;
+	return h->sparse_len;
+}
+
+/**
+ * Copies out the registers of a dense HLL, a byte
+ * per register, whatever the layout.
+ * @arg h The hll to read, must be dense
+ * @arg regs Output. 2^precision register values
+ */
+void hll_get_registers(const hll_t * h, uint8_t *regs)
+{
+	int num_reg = NUM_REG(h->precision);
+	if (h->layout == HLL_LAYOUT_BYTE) {
+		memcpy(regs, h->bytes, num_reg);
+		return;
+	}
+	for (int i = 0; i < num_reg; i++)
+		regs[i] = get_register(h, i);
+}
+
+/**
+ * Merges sparse entries into an HLL with the same precision.
+ * @arg dst The hll to merge into
+ * @arg entries The sparse entries
+ * @arg count The number of entries
+ * @return 0 on success, -1 if an entry is not valid.
+ */
+int hll_merge_sparse(hll_t * dst, const uint32_t *entries, uint32_t count)
+{
+	// Entries without a register value must have extra index
+	// bits to count the leading zeros of, and the others must
+	// fit a register once those bits are added
+	int extra_bits = SPARSE_PRECISION - dst->precision;
+	uint32_t extra_mask = (1 << extra_bits) - 1;
+	for (uint32_t i = 0; i < count; i++) {
+		if (entries[i] & 1) {
+			if (extra_bits + ((entries[i] >> 1) & ((1 << REG_WIDTH) - 1)) >= (1 << REG_WIDTH))
+				return -1;
+		} else if (!(SPARSE_INDEX(entries[i]) & extra_mask)) {
+			return -1;
+		}
+	}
+
+	int idx, reg;
+	for (uint32_t i = 0; i < count; i++) {
+		if (dst->sparse) {
+			sparse_add(dst, entries[i]);
+		} else {
+			sparse_decode(dst->precision, entries[i], &idx, &reg);
+			if (reg > get_register(dst, idx))
+				set_register(dst, idx, reg);
+		}
+	}
+	return 0;
+}
+
+/**
+ * Merges registers into an HLL with the same precision.
+ * It is made dense.
+ * @arg dst The hll to merge into
+ * @arg regs 2^precision register values
+ * @return 0 on success, -1 if a register is out of range or
+ * the registers could not be allocated.
+ */
+int hll_merge_registers(hll_t * dst, const uint8_t *regs)
+{
+	int num_reg = NUM_REG(dst->precision);
+	for (int i = 0; i < num_reg; i++) {
+		if (regs[i] >> REG_WIDTH)
+			return -1;
+	}
+	if (dst->sparse && sparse_to_dense(dst))
+		return -1;
+	for (int i = 0; i < num_reg; i++) {
+		if (regs[i] > get_register(dst, i))
+			set_register(dst, i, regs[i]);
+	}
+	return 0;
+}
+
 /*
  * Returns the bias correctors from the
  * hyperloglog paper
@@ -139,6 +517,19 @@ static double alpha(unsigned char precision)
 	}
 }
 
+/*
+ * Returns 2^-reg, by building the double directly
+ */
+static inline double inv_pow2(uint32_t reg)
+{
+	union {
+		uint64_t bits;
+		double value;
+	} u;
+	u.bits = (uint64_t)(1023 - reg) << 52;
+	return u.value;
+}
+
 /*
  * Computes the raw cardinality estimate
  */
@@ -148,14 +539,37 @@ static double raw_estimate(hll_t * h, int *num_zero)
 	int num_reg = NUM_REG(precision);
 	double multi = alpha(precision) * num_reg * num_reg;
 
-	int reg_val;
-	double inv_sum = 0;
-	for (int i = 0; i < num_reg; i++) {
-		reg_val = get_register(h, i);
-		inv_sum += pow(2.0, -1 * reg_val);
-		if (!reg_val)
-			*num_zero += 1;
+	// Byte registers need no unpacking
+	if (h->layout == HLL_LAYOUT_BYTE) {
+		double inv_sum = 0;
+		int zeros = 0;
+		for (int i = 0; i < num_reg; i++) {
+			inv_sum += inv_pow2(h->bytes[i]);
+			zeros += !h->bytes[i];
+		}
+		*num_zero += zeros;
+		return multi * (1.0 / inv_sum);
 	}
+
+	// Unpack each word with shifts, keeping a separate sum
+	// per register position so the adds are independent
+	uint32_t word, reg;
+	double sums[REG_PER_WORD] = {0};
+	int zeros = 0;
+	int words = hll_words(precision);
+	for (int i = 0; i < words; i++) {
+		word = h->registers[i];
+		for (int j = 0; j < REG_PER_WORD; j++) {
+			reg = (word >> (REG_WIDTH * j)) & ((1 << REG_WIDTH) - 1);
+			sums[j] += inv_pow2(reg);
+			zeros += !reg;
+		}
+	}
+
+	// Remove the unused registers in the last word
+	int unused = words * REG_PER_WORD - num_reg;
+	double inv_sum = sums[0] + sums[1] + sums[2] + sums[3] + sums[4] - unused;
+	*num_zero += zeros - unused;
 	return multi * (1.0 / inv_sum);
 }
 
@@ -232,6 +646,13 @@ static double bias_estimate(hll_t * h, double raw_est)
  */
 double hll_size(hll_t * h)
 {
+	// Sparse HLLs use linear counting at the sparse precision
+	if (h->sparse) {
+		sparse_flush(h);
+		double registers = 1 << SPARSE_PRECISION;
+		return registers * log(registers / (registers - h->sparse_len));
+	}
+
 	int num_zero = 0;
 	double raw_est = raw_estimate(h, &num_zero);
 
@@ -277,3 +698,16 @@ int hll_precision_for_error(double err)
 	double p = log2(pow(1.04 / err, 2));
 	return ceil(p);
 }
+
+/**
+ * Returns the memory allocated for the registers, or
+ * the sparse entries while the HLL is sparse.
+ * @arg h The hll to query
+ * @return The size in bytes, without the struct itself.
+ */
+size_t hll_memory(const hll_t * h)
+{
+	if (h->sparse)
+		return (size_t)h->sparse_size * sizeof(uint32_t);
+	return dense_size(h);
+}
@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include "metrics.h"
 #include "set.h"
 
@@ -8,6 +9,21 @@ static int timer_delete_cb(void *data, const char *key, void *value);
 static int set_delete_cb(void *data, const char *key, void *value);
 static int gauge_delete_cb(void *data, const char *key, void *value);
 static int iter_cb(void *data, const char *key, void *value);
+static int counter_reset_cb(void *data, const char *key, void *value);
+static int timer_reset_cb(void *data, const char *key, void *value);
+static int set_reset_cb(void *data, const char *key, void *value);
+static void metrics_free_kv(struct metrics * m);
+static int metrics_compact_names(struct metrics * m);
+static int metrics_index_add(struct metrics * m, int type, const char *name, size_t name_len, void *value);
+static void metrics_index_remove(struct metrics * m, int type, const char *name);
+static int metrics_index_build(struct metrics * m);
+static void metrics_index_free(struct metrics * m);
+
+// Number of samples hashed and prefetched at a time
+#define SAMPLE_BATCH_SIZE 64
+
+// Bytes of K/V pairs in a chunk, unless a pair needs more
+#define KV_CHUNK_SIZE 65536
 
 struct cb_info {
 	enum metric_type type;
@@ -15,6 +31,43 @@ struct cb_info {
 	metric_callback cb;
 };
 
+struct worker_info {
+	struct metrics *m;
+	uint32_t index;			// Index of this worker
+	uint32_t num_workers;
+	void *data;
+	metric_callback cb;
+	int result;				// Return of the callback that stopped
+};
+
+static void *iter_worker(void *arg);
+static int iter_finalize_cb(void *data, const char *key, void *value);
+
+struct reset_info {
+	struct metrics *m;
+	uint32_t max_idle;
+};
+
+struct index_info {
+	struct metrics *m;
+	int type;				// One of the METRIC_NAMES_ types
+};
+
+// The metric type reported for each METRIC_NAMES_ type
+static const enum metric_type index_types[METRIC_NAMES_TYPES] = {
+	metric_type_COUNTER, metric_type_TIMER, metric_type_GAUGE, metric_type_SET
+};
+
+static int index_build_cb(void *data, const char *key, void *value);
+static int index_free_cb(void *data, char *key, void *value);
+static int index_clear_cb(void *data, char *key, void *value);
+static int sorted_iter_cb(void *data, char *key, void *value);
+
+static int metrics_names_type(enum metric_type type);
+static int timer_stats_cb(void *data, const char *key, void *value);
+static int histogram_prepare_cb(void *data, char *key, void *value);
+static int set_stats_cb(void *data, const char *key, void *value);
+
 /**
  * Initializes the metrics struct.
  * @arg eps The maximum error for the quantiles
@@ -23,12 +76,17 @@ struct cb_info {
  * @arg histograms A radix tree with histogram settings. This is not owned
  * by the metrics object. It is assumed to exist for the life of the metrics.
  * @arg set_precision The precision to use for sets
- * @return 0 on success.
+ * @return 0 on success, -1 if a histogram config is invalid.
  */
 int init_metrics(double timer_eps, double *quantiles, uint32_t num_quants,
 		struct radix_tree * histograms, unsigned char set_precision,
 		uint64_t set_max_exact, struct metrics * m)
 {
+	// Prepare the histogram configs for binning here, since the
+	// metrics sharing them may be updated from other threads
+	if (histograms && radix_foreach(histograms, NULL, histogram_prepare_cb))
+		return -1;
+
 	// Copy the inputs
 	m->timer_eps = timer_eps;
 	m->num_quants = num_quants;
@@ -37,23 +95,44 @@ int init_metrics(double timer_eps, double *quantiles, uint32_t num_quants,
 	m->histograms = histograms;
 	m->set_precision = set_precision;
 	m->set_max_exact = set_max_exact;
+	m->timer_buffer_mode = CM_BUFFER_HEAP;
+	m->timer_engine = QUANTILE_CM;
+	m->set_layout = HLL_LAYOUT_PACKED;
+	m->names = NULL;
+	m->names_size = 0;
+	m->names_unused = 0;
+	for (int i = 0; i < METRIC_NAMES_TYPES; i++) {
+		m->name_limits[i] = 0;
+		m->limit_actions[i] = METRICS_LIMIT_DROP;
+		m->names_limited[i] = 0;
+	}
+	m->overflow_hash = hashmap_hash_key(METRICS_OVERFLOW_NAME, sizeof(METRICS_OVERFLOW_NAME) - 1);
+
+	// Allocate the name pool, shared by the hashmaps
+	m->name_pool = malloc(sizeof(struct name_pool));
+	if (!m->name_pool)
+		return -1;
+	int res = name_pool_init(m->name_pool);
+	if (res)
+		return res;
 
 	// Allocate the hashmaps
-	int res = hashmap_init(0, &m->counters);
+	res = hashmap_init_pool(0, m->name_pool, &m->counters);
 	if (res)
 		return res;
-	res = hashmap_init(0, &m->timers);
+	res = hashmap_init_pool(0, m->name_pool, &m->timers);
 	if (res)
 		return res;
-	res = hashmap_init(0, &m->sets);
+	res = hashmap_init_pool(0, m->name_pool, &m->sets);
 	if (res)
 		return res;
-	res = hashmap_init(0, &m->gauges);
+	res = hashmap_init_pool(0, m->name_pool, &m->gauges);
 	if (res)
 		return res;
 
-	// Set the head of our linked list to null
-	m->kv_vals = NULL;
+	// The K/V chunks are allocated on the first pair
+	m->kv_head = NULL;
+	m->kv_tail = NULL;
 	return 0;
 }
 
@@ -80,14 +159,10 @@ int destroy_metrics(struct metrics * m)
 	free(m->quantiles);
 
 	// Nuke all the k/v pairs
-	struct key_val *current = m->kv_vals;
-	struct key_val *prev = NULL;
-	while (current) {
-		free(current->name);
-		prev = current;
-		current = current->next;
-		free(prev);
-	}
+	metrics_free_kv(m);
+	free(m->kv_head);
+	m->kv_head = NULL;
+	m->kv_tail = NULL;
 
 	// Nuke the counters
 	hashmap_iter(m->counters, counter_delete_cb, NULL);
@@ -105,142 +180,423 @@ int destroy_metrics(struct metrics * m)
 	hashmap_iter(m->gauges, gauge_delete_cb, NULL);
 	hashmap_destroy(m->gauges);
 
+	// Nuke the ordered index
+	if (m->names) {
+		metrics_index_free(m);
+		free(m->names);
+		m->names = NULL;
+	}
+
+	// Nuke the names, once nothing refers to them
+	name_pool_destroy(m->name_pool);
+	free(m->name_pool);
+	m->name_pool = NULL;
 	return 0;
 }
 
 int metrics_clear_hash(struct metrics * m, enum metric_type metric_type)
 {
 	int rc = 0;
+	struct index_info info = { m, 0 };
 
 	switch (metric_type) {
 		case metric_type_GAUGE:
 		case metric_type_GAUGE_DELTA:
 			hashmap_clear(m->gauges);
+			info.type = METRIC_NAMES_GAUGE;
 			break;
 		case metric_type_COUNTER:
 			hashmap_clear(m->counters);
+			info.type = METRIC_NAMES_COUNTER;
 			break;
 		case metric_type_TIMER:
 			hashmap_clear(m->timers);
+			info.type = METRIC_NAMES_TIMER;
 			break;
 		case metric_type_SET:
 			hashmap_clear(m->sets);
+			info.type = METRIC_NAMES_SET;
 			break;
 		default:
 			rc = -1;
 			break;
 	}
+
+	// Drop the cleared metrics from the index
+	if (!rc && m->names)
+		radix_foreach(m->names, &info, index_clear_cb);
 	return rc;
 }
 
+/**
+ * Resets the metrics for the next interval, keeping the keys
+ * and allocations of recently active metrics. Counters are
+ * zeroed, timers are reset and sets are reset to report their
+ * last count. Gauges keep their values. Counters, timers and
+ * sets without samples for more than max_idle intervals in a
+ * row are removed, and the K/V pairs are always removed.
+ * @arg max_idle The number of idle intervals to keep a metric
+ * @return 0 on success.
+ */
+int metrics_reset(struct metrics * m, uint32_t max_idle)
+{
+	metrics_free_kv(m);
+	struct reset_info info = { m, max_idle };
+	hashmap_filter(m->counters, counter_reset_cb, &info);
+	hashmap_filter(m->timers, timer_reset_cb, &info);
+	hashmap_filter(m->sets, set_reset_cb, &info);
+
+	// The pool can not remove names either, so the names
+	// still in use are moved to a new one
+	int res = metrics_compact_names(m);
+
+	// Rebuild the index once most of its names are unused,
+	// since the radix tree can not remove them
+	if (m->names && m->names_unused > m->names_size / 2) {
+		metrics_index_free(m);
+		if (metrics_index_build(m))
+			res = -1;
+	}
+	return res;
+}
+
+// Moves the names in use into a new pool, once most of the
+// names in the pool are unused. A name can be in several
+// maps, so the sum of their sizes bounds the names in use.
+static int metrics_compact_names(struct metrics * m)
+{
+	struct hashmap *maps[] = { m->counters, m->timers, m->sets, m->gauges };
+	int num_maps = sizeof(maps) / sizeof(maps[0]);
+	uint64_t in_use = 0;
+	for (int i = 0; i < num_maps; i++)
+		in_use += hashmap_size(maps[i]);
+	if (m->name_pool->count <= in_use * 2)
+		return 0;
+
+	struct name_pool *pool = malloc(sizeof(struct name_pool));
+	if (!pool)
+		return -1;
+	if (name_pool_init(pool)) {
+		free(pool);
+		return -1;
+	}
+
+	// Moving the keys back only finds the names in the
+	// old pool, so undoing a failed move can not fail
+	for (int i = 0; i < num_maps; i++) {
+		if (hashmap_move_keys(maps[i], pool)) {
+			while (i--)
+				hashmap_move_keys(maps[i], m->name_pool);
+			name_pool_destroy(pool);
+			free(pool);
+			return -1;
+		}
+	}
+	name_pool_destroy(m->name_pool);
+	free(m->name_pool);
+	m->name_pool = pool;
+	return 0;
+}
+
+// Frees all the K/V pairs, keeping the first chunk for reuse
+static void metrics_free_kv(struct metrics * m)
+{
+	if (!m->kv_head)
+		return;
+	struct key_val_chunk *current = m->kv_head->next;
+	struct key_val_chunk *next;
+	while (current) {
+		next = current->next;
+		free(current);
+		current = next;
+	}
+	m->kv_head->next = NULL;
+	m->kv_head->len = 0;
+	m->kv_tail = m->kv_head;
+}
+
+// Returns the bytes of a K/V pair, padded to keep the values aligned
+static size_t kv_size(size_t name_len)
+{
+	size_t size = offsetof(struct key_val, name) + name_len + 1;
+	return (size + sizeof(double) - 1) & ~(sizeof(double) - 1);
+}
+
+/**
+ * Applies the name limit of a type before a lookup that may
+ * insert a name. This only costs a load and a branch until
+ * the limit is reached, after which new names are looked up
+ * first, and either rejected or swapped for the overflow name.
+ * @arg type The METRIC_NAMES_ type
+ * @arg map The hashmap of the type
+ * @arg name In/out. The name, may be set to the overflow name
+ * @arg name_len In/out. The length of the name
+ * @arg hash In/out. The hash of the name
+ * @return 0 if the name can be used, -1 to drop the sample.
+ */
+static inline int metrics_limit_name(struct metrics * m, int type, struct hashmap * map,
+		const char **name, size_t *name_len, uint64_t *hash)
+{
+	uint64_t limit = m->name_limits[type];
+	if (!limit || (uint64_t)hashmap_size(map) < limit)
+		return 0;
+
+	void *value;
+	if (!hashmap_get_n(map, *name, *name_len, *hash, &value))
+		return 0;
+	m->names_limited[type]++;
+	if (m->limit_actions[type] == METRICS_LIMIT_DROP)
+		return -1;
+
+	// The overflow name is always let in, so it may be one over
+	*name = METRICS_OVERFLOW_NAME;
+	*name_len = sizeof(METRICS_OVERFLOW_NAME) - 1;
+	*hash = m->overflow_hash;
+	return 0;
+}
+
 /**
  * Increments the counter with the given name
  * by a value.
  * @arg name The name of the counter
+ * @arg name_len The length of the name
+ * @arg hash The hash of the name
  * @arg val The value to add
  * @return 0 on success
  */
-static int metrics_increment_counter(struct metrics * m, char *name, double val, double sample_rate)
+static int metrics_increment_counter(struct metrics * m, const char *name, size_t name_len,
+		uint64_t hash, double val, double sample_rate)
 {
-	struct counter *c = hashmap_get_value(m->counters, name);
+	struct counter *c = metrics_get_counter(m, name, name_len, hash);
+	if (!c)
+		return -1;
 
-	// New counter
+	// Add the sample value
+	return counter_add_sample(c, val, sample_rate);
+}
+
+/**
+ * Returns the counter with a given name, creating
+ * it if needed.
+ * @arg name The name of the counter
+ * @arg name_len The length of the name
+ * @arg hash The hash of the name
+ * @return The counter, or NULL on failure or if the
+ * name is over the name limit.
+ */
+struct counter *metrics_get_counter(struct metrics * m, const char *name, size_t name_len, uint64_t hash)
+{
+	void **slot;
+	if (metrics_limit_name(m, METRIC_NAMES_COUNTER, m->counters, &name, &name_len, &hash))
+		return NULL;
+	if (hashmap_get_or_insert_n(m->counters, name, name_len, hash, &slot) < 0)
+		return NULL;
+
+	// New counter, the name is removed again if it fails
+	struct counter *c = *slot;
 	if (!c) {
 		c = malloc(sizeof(struct counter));
+		if (!c || metrics_index_add(m, METRIC_NAMES_COUNTER, name, name_len, c)) {
+			free(c);
+			hashmap_delete_n(m->counters, name, name_len, hash);
+			return NULL;
+		}
 		init_counter(c);
-		hashmap_put(m->counters, name, c);
+		*slot = c;
 	}
-	// Add the sample value
-	return counter_add_sample(c, val, sample_rate);
+	return c;
+}
+
+/**
+ * Returns the timer with a given name, creating it
+ * if needed.
+ * @arg name The name of the timer
+ * @arg name_len The length of the name
+ * @arg hash The hash of the name
+ * @return The timer, or NULL on failure or if the
+ * name is over the name limit.
+ */
+struct timer_hist *metrics_get_timer(struct metrics * m, const char *name, size_t name_len, uint64_t hash)
+{
+	histogram_config *conf = NULL;
+	void **slot;
+	if (metrics_limit_name(m, METRIC_NAMES_TIMER, m->timers, &name, &name_len, &hash))
+		return NULL;
+	if (hashmap_get_or_insert_n(m->timers, name, name_len, hash, &slot) < 0)
+		return NULL;
+
+	// Existing timer
+	struct timer_hist *t = *slot;
+	if (t)
+		return t;
+
+	// Check if we have any histograms configured. The config
+	// may also pick the quantile engine for this prefix. This
+	// is the only lookup, the timer keeps the config across
+	// metrics_reset until it is removed as idle.
+	if (m->histograms && radix_longest_prefix_n(m->histograms, name, name_len, (void **)&conf))
+		conf = NULL;
+
+	// A config without a bin scale was added after init_metrics.
+	// An invalid one fails the timer, rather than binning every
+	// sample into one bin.
+	if (conf && !conf->bin_scale && histogram_init(conf)) {
+		hashmap_delete_n(m->timers, name, name_len, hash);
+		return NULL;
+	}
+
+	// New timer, the name is removed again if it fails
+	t = malloc(sizeof(struct timer_hist));
+	quantile_engine engine = m->timer_engine;
+	if (conf && conf->engine != QUANTILE_DEFAULT)
+		engine = conf->engine;
+	if (!t || init_timer_engine(m->timer_eps, m->quantiles, m->num_quants, engine,
+				m->timer_buffer_mode, &t->tm)) {
+		free(t);
+		hashmap_delete_n(m->timers, name, name_len, hash);
+		return NULL;
+	}
+	t->idle_intervals = 0;
+
+	// Without counts the timer still works, just not the histogram
+	t->conf = conf;
+	if (conf && histogram_counts_init(conf, &t->counts))
+		t->conf = NULL;
+	if (metrics_index_add(m, METRIC_NAMES_TIMER, name, name_len, t)) {
+		timer_delete_cb(NULL, NULL, t);
+		hashmap_delete_n(m->timers, name, name_len, hash);
+		return NULL;
+	}
+	*slot = t;
+	return t;
 }
 
 /**
  * Adds a new timer sample for the timer with a
  * given name.
  * @arg name The name of the timer
+ * @arg name_len The length of the name
+ * @arg hash The hash of the name
  * @arg val The sample to add
  * @return 0 on success.
  */
-static int metrics_add_timer_sample(struct metrics * m, char *name, double val, double sample_rate)
-{
-	histogram_config *conf;
-	struct timer_hist *t = hashmap_get_value(m->timers, name);
-
-	// New timer
-	if (!t) {
-		t = malloc(sizeof(struct timer_hist));
-		init_timer(m->timer_eps, m->quantiles, m->num_quants, &t->tm);
-		hashmap_put(m->timers, name, t);
-
-		// Check if we have any histograms configured
-		if (m->histograms && (conf = radix_longest_prefix_value(m->histograms, name))) {
-			t->conf = conf;
-			t->counts = calloc(conf->num_bins, sizeof(unsigned int));
-		} else {
-			t->conf = NULL;
-			t->counts = NULL;
-		}
-	}
-	// Add the histogram value
-	if (t->conf) {
-		conf = t->conf;
-		if (val < conf->min_val)
-			t->counts[0]++;
-		else if (val >= conf->max_val)
-			t->counts[conf->num_bins - 1]++;
-		else {
-			int idx = ((val - conf->min_val) / conf->bin_width) + 1;
-			if (idx >= conf->num_bins)
-				idx = conf->num_bins - 1;
-			t->counts[idx]++;
-		}
+static int metrics_add_timer_sample(struct metrics * m, const char *name, size_t name_len,
+		uint64_t hash, double val, double sample_rate)
+{
+	struct timer_hist *t = metrics_get_timer(m, name, name_len, hash);
+	if (!t)
+		return -1;
+
+	// Add the sample value, and bin it only if the timer took it
+	if (timer_add_sample(&t->tm, val, sample_rate))
+		return -1;
+	if (t->conf)
+		return histogram_add_sample(t->conf, &t->counts, val);
+	return 0;
+}
+
+/**
+ * Adds an array of samples to a timer. The histogram
+ * bins of the samples are computed at once, skipping
+ * any the timer rejects.
+ * @arg name The name of the timer, need not be null terminated
+ * @arg name_len The length of the name
+ * @arg hash The hash of the name, from hashmap_hash_key
+ * @arg vals The samples to add
+ * @arg num_vals The number of samples
+ * @arg sample_rate The sample rate of all the samples
+ * @return 0 on success.
+ */
+int metrics_add_timer_samples(struct metrics * m, const char *name, size_t name_len, uint64_t hash,
+		const double *vals, size_t num_vals, double sample_rate)
+{
+	struct timer_hist *t = metrics_get_timer(m, name, name_len, hash);
+	if (!t)
+		return -1;
+
+	// Add the sample values. Only the samples the timer took are
+	// binned, a run of them at a time.
+	int rc = 0;
+	size_t run = 0;
+	for (size_t i = 0; i < num_vals; i++) {
+		if (!timer_add_sample(&t->tm, vals[i], sample_rate))
+			continue;
+		rc = -1;
+		if (t->conf && i > run && histogram_add_samples(t->conf, &t->counts, vals + run, i - run))
+			rc = -1;
+		run = i + 1;
 	}
-	// Add the sample value
-	return timer_add_sample(&t->tm, val, sample_rate);
+	if (t->conf && num_vals > run && histogram_add_samples(t->conf, &t->counts, vals + run, num_vals - run))
+		rc = -1;
+	return rc;
 }
 
 /**
- * Adds a new K/V pair
+ * Adds a new K/V pair, appended to the last chunk
  * @arg name The key name
+ * @arg name_len The length of the name
  * @arg val The value associated
  * @return 0 on success.
  */
-static int metrics_add_kv(struct metrics * m, char *name, double val)
+static int metrics_add_kv(struct metrics * m, const char *name, size_t name_len, double val)
 {
-	struct key_val *kv = malloc(sizeof(struct key_val));
-	kv->name = strdup(name);
+	if (name_len >= UINT32_MAX - KV_CHUNK_SIZE)
+		return -1;
+	size_t size = kv_size(name_len);
+
+	// Start a new chunk if this pair does not fit
+	struct key_val_chunk *chunk = m->kv_tail;
+	if (!chunk || chunk->len + size > chunk->size) {
+		size_t chunk_size = (size > KV_CHUNK_SIZE) ? size : KV_CHUNK_SIZE;
+		chunk = malloc(sizeof(struct key_val_chunk) + chunk_size);
+		if (!chunk)
+			return -1;
+		chunk->next = NULL;
+		chunk->len = 0;
+		chunk->size = chunk_size;
+		if (m->kv_tail)
+			m->kv_tail->next = chunk;
+		else
+			m->kv_head = chunk;
+		m->kv_tail = chunk;
+	}
+
+	struct key_val *kv = (struct key_val *)(chunk->data + chunk->len);
 	kv->val = val;
-	kv->next = m->kv_vals;
-	m->kv_vals = kv;
+	kv->name_len = name_len;
+	memcpy(kv->name, name, name_len);
+	kv->name[name_len] = 0;
+	chunk->len += size;
 	return 0;
 }
 
 /**
  * Sets a gauge value
  * @arg name The name of the gauge
+ * @arg name_len The length of the name
+ * @arg hash The hash of the name
  * @arg val The value to set
  * @arg delta Is this a delta update
  * @arg timestamp_ms User-specified timestamp in milliseconds
  * @return 0 on success
  */
-int metrics_set_gauge_ts(struct metrics * m, char *name, double val, bool delta, uint64_t user, uint64_t timestamp_ms)
+static int metrics_set_gauge_n(struct metrics * m, const char *name, size_t name_len, uint64_t hash,
+		double val, bool delta, uint64_t user, uint64_t timestamp_ms)
 {
-	struct gauge *g = hashmap_get_value(m->gauges, name);
-
-	// New gauge
-	if (!g) {
-		g = malloc(sizeof(struct gauge));
-		g->value = 0;
-		hashmap_put(m->gauges, name, g);
-	}
+	struct gauge *g = metrics_get_gauge(m, name, name_len, hash);
+	if (!g)
+		return -1;
 
 	g->user = user;
 	g->timestamp_ms = timestamp_ms;
 	g->prev_value = g->value;
 	if (delta) {
 		g->value += val;
+		if (g->updated == GAUGE_UNCHANGED)
+			g->updated = GAUGE_DELTA;
 	} else {
 		g->value = val;
+		g->updated = GAUGE_SET;
 	}
 
 	g->user_flags = 0;
@@ -248,6 +604,53 @@ int metrics_set_gauge_ts(struct metrics * m, char *name, double val, bool delta,
 	return 0;
 }
 
+/**
+ * Returns the gauge with a given name, creating
+ * it with a zero value if needed.
+ * @arg name The name of the gauge
+ * @arg name_len The length of the name
+ * @arg hash The hash of the name
+ * @return The gauge, or NULL on failure or if the
+ * name is over the name limit.
+ */
+struct gauge *metrics_get_gauge(struct metrics * m, const char *name, size_t name_len, uint64_t hash)
+{
+	void **slot;
+	if (metrics_limit_name(m, METRIC_NAMES_GAUGE, m->gauges, &name, &name_len, &hash))
+		return NULL;
+	if (hashmap_get_or_insert_n(m->gauges, name, name_len, hash, &slot) < 0)
+		return NULL;
+
+	// New gauge, the name is removed again if it fails
+	struct gauge *g = *slot;
+	if (!g) {
+		g = calloc(1, sizeof(struct gauge));
+		if (!g || metrics_index_add(m, METRIC_NAMES_GAUGE, name, name_len, g)) {
+			free(g);
+			hashmap_delete_n(m->gauges, name, name_len, hash);
+			return NULL;
+		}
+		g->updated = GAUGE_UNCHANGED;
+		*slot = g;
+	}
+	return g;
+}
+
+/**
+ * Sets a gauge value
+ * @arg name The name of the gauge
+ * @arg val The value to set
+ * @arg delta Is this a delta update
+ * @arg timestamp_ms User-specified timestamp in milliseconds
+ * @return 0 on success
+ */
+int metrics_set_gauge_ts(struct metrics * m, char *name, double val, bool delta, uint64_t user, uint64_t timestamp_ms)
+{
+	size_t name_len = strlen(name);
+	return metrics_set_gauge_n(m, name, name_len, hashmap_hash_key(name, name_len), val, delta, user,
+			timestamp_ms);
+}
+
 /**
  * Sets a guage value
  * @arg name The name of the gauge
@@ -268,28 +671,107 @@ int metrics_set_gauge(struct metrics * m, char *name, double val, bool delta, ui
  * @return 0 on success.
  */
 int metrics_add_sample(struct metrics * m, enum metric_type type, char *name, double val, double sample_rate)
+{
+	// K/V pairs are appended, not looked up, so skip the hash
+	size_t name_len = strlen(name);
+	if (type == metric_type_KEY_VAL)
+		return metrics_add_kv(m, name, name_len, val);
+	return metrics_add_sample_n(m, type, name, name_len, hashmap_hash_key(name, name_len), val,
+			sample_rate);
+}
+
+/**
+ * Adds a new sampled value, for names that are not
+ * null terminated and have already been hashed.
+ * @arg type The type of the metrics
+ * @arg name The name of the metric
+ * @arg name_len The length of the name
+ * @arg hash The hash of the name, from hashmap_hash_key
+ * @arg val The sample to add
+ * @return 0 on success.
+ */
+int metrics_add_sample_n(struct metrics * m, enum metric_type type, const char *name, size_t name_len,
+		uint64_t hash, double val, double sample_rate)
 {
 	switch (type) {
 	case metric_type_KEY_VAL:
-		return metrics_add_kv(m, name, val);
+		return metrics_add_kv(m, name, name_len, val);
 
 	case metric_type_GAUGE:
-		return metrics_set_gauge(m, name, val, false, 0);
+		return metrics_set_gauge_n(m, name, name_len, hash, val, false, 0, 0);
 
 	case metric_type_GAUGE_DELTA:
-		return metrics_set_gauge(m, name, val, true, 0);
+		return metrics_set_gauge_n(m, name, name_len, hash, val, true, 0, 0);
 
 	case metric_type_COUNTER:
-		return metrics_increment_counter(m, name, val, sample_rate);
+		return metrics_increment_counter(m, name, name_len, hash, val, sample_rate);
 
 	case metric_type_TIMER:
-		return metrics_add_timer_sample(m, name, val, sample_rate);
+		return metrics_add_timer_sample(m, name, name_len, hash, val, sample_rate);
 
 	default:
 		return -1;
 	}
 }
 
+// Returns the hashmap used for a metric type, or NULL
+static struct hashmap *metrics_type_map(struct metrics * m, enum metric_type type)
+{
+	switch (type) {
+	case metric_type_GAUGE:
+	case metric_type_GAUGE_DELTA:
+		return m->gauges;
+	case metric_type_COUNTER:
+		return m->counters;
+	case metric_type_TIMER:
+		return m->timers;
+	case metric_type_SET:
+		return m->sets;
+	default:
+		return NULL;
+	}
+}
+
+/**
+ * Adds a batch of sampled values. All the names are hashed
+ * and their hashmap slots prefetched before any update is
+ * applied, so the cache misses overlap.
+ * @arg batch An array of samples, sets are rejected
+ * @arg n The number of samples in the batch
+ * @return 0 on success, -1 if any sample failed.
+ */
+int metrics_add_samples(struct metrics * m, const struct metric_sample *batch, size_t n)
+{
+	uint64_t hashes[SAMPLE_BATCH_SIZE];
+	struct hashmap *map;
+	const struct metric_sample *s;
+	int rc = 0;
+	while (n) {
+		size_t chunk = (n < SAMPLE_BATCH_SIZE) ? n : SAMPLE_BATCH_SIZE;
+
+		// Hash everything and issue the prefetches. Sets need a
+		// value rather than a number, so they are not hashed.
+		for (size_t i = 0; i < chunk; i++) {
+			s = batch + i;
+			map = (s->type != metric_type_SET) ? metrics_type_map(m, s->type) : NULL;
+			hashes[i] = map ? hashmap_hash_key(s->name, s->name_len) : 0;
+			if (map)
+				hashmap_prefetch(map, hashes[i]);
+		}
+
+		// Apply the updates
+		for (size_t i = 0; i < chunk; i++) {
+			s = batch + i;
+			if (s->type == metric_type_SET ||
+					metrics_add_sample_n(m, s->type, s->name, s->name_len, hashes[i], s->value, s->sample_rate))
+				rc = -1;
+		}
+		batch += chunk;
+		n -= chunk;
+	}
+	return rc;
+}
+
 /**
  * Adds a value to a named set.
  * @arg name The name of the set
@@ -298,16 +780,131 @@ int metrics_add_sample(struct metrics * m, enum metric_type type, char *name, do
  */
 int metrics_set_update(struct metrics * m, char *name, char *value)
 {
-	set_t *s = hashmap_get_value(m->sets, name);
+	size_t name_len = strlen(name);
+	return metrics_set_update_n(m, name, name_len, hashmap_hash_key(name, name_len), value,
+			strlen(value));
+}
+
+/**
+ * Adds a value to a named set, for names and values
+ * that are not null terminated.
+ * @arg name The name of the set
+ * @arg name_len The length of the name
+ * @arg hash The hash of the name, from hashmap_hash_key
+ * @arg value The value to add
+ * @arg value_len The length of the value
+ * @return 0 on success
+ */
+int metrics_set_update_n(struct metrics * m, const char *name, size_t name_len, uint64_t hash,
+		const char *value, size_t value_len)
+{
+	set_t *s = metrics_get_set(m, name, name_len, hash);
+	if (!s)
+		return -1;
+
+	// Add the sample value
+	set_add_n(s, value, value_len);
+	return 0;
+}
+
+/**
+ * Returns the set with a given name, creating
+ * it if needed.
+ * @arg name The name of the set
+ * @arg name_len The length of the name
+ * @arg hash The hash of the name
+ * @return The set, or NULL on failure or if the
+ * name is over the name limit.
+ */
+set_t *metrics_get_set(struct metrics * m, const char *name, size_t name_len, uint64_t hash)
+{
+	void **slot;
+	if (metrics_limit_name(m, METRIC_NAMES_SET, m->sets, &name, &name_len, &hash))
+		return NULL;
+	if (hashmap_get_or_insert_n(m->sets, name, name_len, hash, &slot) < 0)
+		return NULL;
 
-	// New set
+	// New set, the name is removed again if it fails
+	set_t *s = *slot;
 	if (!s) {
 		s = malloc(sizeof(set_t));
-		set_init(m->set_precision, s, m->set_max_exact);
-		hashmap_put(m->sets, name, s);
+		if (!s || set_init_layout(m->set_precision, m->set_layout, s, m->set_max_exact) ||
+				metrics_index_add(m, METRIC_NAMES_SET, name, name_len, s)) {
+			if (s)
+				set_delete_cb(NULL, NULL, s);
+			hashmap_delete_n(m->sets, name, name_len, hash);
+			return NULL;
+		}
+		*slot = s;
 	}
-	// Add the sample value
-	set_add(s, value);
+	return s;
+}
+
+/**
+ * Limits the number of distinct names of a metric type. Once
+ * a type has that many names, samples for other names are
+ * dropped, or folded into METRICS_OVERFLOW_NAME, and counted
+ * in names_limited. Names already present are not affected.
+ * Names removed by metrics_reset make room for new ones.
+ * @arg type The metric type, GAUGE_DELTA is the same as GAUGE
+ * @arg limit The max number of names, 0 for no limit
+ * @arg action What to do with the samples of new names
+ * @return 0 on success, -1 for a type without names.
+ */
+int metrics_set_name_limit(struct metrics * m, enum metric_type type, uint64_t limit,
+		metrics_limit_action action)
+{
+	int i = metrics_names_type(type);
+	if (i < 0)
+		return -1;
+	m->name_limits[i] = limit;
+	m->limit_actions[i] = action;
+	return 0;
+}
+
+/**
+ * Computes the memory used by the metrics, and their number
+ * of each type. This visits every metric, so it should be
+ * called at most once an interval, not on the insert path.
+ * @arg stats Output. The stats of the metrics
+ * @return 0 on success.
+ */
+int metrics_get_stats(struct metrics * m, struct metrics_stats * stats)
+{
+	memset(stats, 0, sizeof(struct metrics_stats));
+	struct hashmap *maps[METRIC_NAMES_TYPES];
+	maps[METRIC_NAMES_COUNTER] = m->counters;
+	maps[METRIC_NAMES_TIMER] = m->timers;
+	maps[METRIC_NAMES_GAUGE] = m->gauges;
+	maps[METRIC_NAMES_SET] = m->sets;
+	for (int i = 0; i < METRIC_NAMES_TYPES; i++) {
+		stats->names[i] = hashmap_size(maps[i]);
+		stats->map_bytes[i] = hashmap_memory(maps[i]);
+		stats->names_limited[i] = m->names_limited[i];
+	}
+
+	// Counters and gauges have no allocations of their own
+	stats->value_bytes[METRIC_NAMES_COUNTER] = stats->names[METRIC_NAMES_COUNTER] * sizeof(struct counter);
+	stats->value_bytes[METRIC_NAMES_GAUGE] = stats->names[METRIC_NAMES_GAUGE] * sizeof(struct gauge);
+	hashmap_iter(m->timers, timer_stats_cb, stats);
+	hashmap_iter(m->sets, set_stats_cb, stats);
+	stats->value_bytes[METRIC_NAMES_TIMER] = stats->names[METRIC_NAMES_TIMER] * sizeof(struct timer_hist) +
+		stats->timer_bytes + stats->histogram_bytes;
+	stats->value_bytes[METRIC_NAMES_SET] = stats->names[METRIC_NAMES_SET] * sizeof(set_t) + stats->set_bytes;
+
+	struct key_val *kv;
+	for (struct key_val_chunk *chunk = m->kv_head; chunk; chunk = chunk->next) {
+		stats->kv_bytes += sizeof(struct key_val_chunk) + chunk->size;
+		for (uint32_t pos = 0; pos < chunk->len; pos += kv_size(kv->name_len)) {
+			kv = (struct key_val *)(chunk->data + pos);
+			stats->kv_pairs++;
+		}
+	}
+
+	stats->name_bytes = sizeof(struct name_pool) + name_pool_memory(m->name_pool);
+	stats->total_bytes = stats->kv_bytes + stats->name_bytes;
+	for (int i = 0; i < METRIC_NAMES_TYPES; i++)
+		stats->total_bytes += stats->map_bytes[i] + stats->value_bytes[i];
 	return 0;
 }
 
@@ -324,42 +921,351 @@ int metrics_set_update(struct metrics * m, char *name, char *value)
 int metrics_iter(struct metrics * m, void *data, metric_callback cb)
 {
 	// Handle the K/V pairs first
-	struct key_val *current = m->kv_vals;
-	int should_break = 0;
-	while (current && !should_break) {
-		should_break = cb(data, metric_type_KEY_VAL, current->name, &current->val);
-		current = current->next;
-	}
+	int should_break = metrics_iter_kv(m, data, cb);
 	if (should_break)
 		return should_break;
 
-	// Store our data in a small struct
-	struct cb_info info = { metric_type_COUNTER, data, cb };
-
 	// Send the counters
-	should_break = hashmap_iter(m->counters, iter_cb, &info);
+	should_break = metrics_iter_type(m, metric_type_COUNTER, data, cb);
 	if (should_break)
 		return should_break;
 
 	// Send the timers
-	info.type = metric_type_TIMER;
-	should_break = hashmap_iter(m->timers, iter_cb, &info);
+	should_break = metrics_iter_type(m, metric_type_TIMER, data, cb);
 	if (should_break)
 		return should_break;
 
 	// Send the gauges
-	info.type = metric_type_GAUGE;
-	should_break = hashmap_iter(m->gauges, iter_cb, &info);
+	should_break = metrics_iter_type(m, metric_type_GAUGE, data, cb);
 	if (should_break)
 		return should_break;
 
 	// Send the sets
-	info.type = metric_type_SET;
-	should_break = hashmap_iter(m->sets, iter_cb, &info);
+	should_break = metrics_iter_type(m, metric_type_SET, data, cb);
+
+	return should_break;
+}
 
+/**
+ * Iterates through the K/V pairs only, in the order
+ * they were added.
+ * @arg m The metrics to iterate through
+ * @arg data Opaque handle passed to the callback
+ * @arg cb A callback function to invoke, as for metrics_iter
+ * @return 0 on success, or the return of the callback
+ */
+int metrics_iter_kv(struct metrics * m, void *data, metric_callback cb)
+{
+	int should_break = 0;
+	struct key_val *kv;
+	for (struct key_val_chunk *chunk = m->kv_head; chunk && !should_break; chunk = chunk->next) {
+		for (uint32_t pos = 0; pos < chunk->len && !should_break; pos += kv_size(kv->name_len)) {
+			kv = (struct key_val *)(chunk->data + pos);
+			should_break = cb(data, metric_type_KEY_VAL, kv->name, &kv->val);
+		}
+	}
 	return should_break;
 }
 
+/**
+ * Iterates through the metrics of one type, in the same way
+ * as metrics_iter, skipping the same metrics.
+ * @arg m The metrics to iterate through
+ * @arg type The type to iterate, one stored in a hashmap.
+ * GAUGE_DELTA is the same as GAUGE.
+ * @arg data Opaque handle passed to the callback
+ * @arg cb A callback function to invoke, as for metrics_iter
+ * @return 0 on success, the return of the callback, or -1
+ * for a type without a hashmap.
+ */
+int metrics_iter_type(struct metrics * m, enum metric_type type, void *data, metric_callback cb)
+{
+	struct hashmap *map = metrics_type_map(m, type);
+	if (!map)
+		return -1;
+	if (type == metric_type_GAUGE_DELTA)
+		type = metric_type_GAUGE;
+	struct cb_info info = { type, data, cb };
+	return hashmap_iter(map, iter_cb, &info);
+}
+
+/**
+ * Checks if metrics_iter skips a metric. The counters and
+ * timers kept by metrics_reset are skipped until they have
+ * samples again.
+ * @arg type The type of the metric
+ * @arg value The metric, as stored in its hashmap
+ * @return 1 if the metric is skipped, 0 if not.
+ */
+int metrics_iter_skips(enum metric_type type, void *value)
+{
+	if (type == metric_type_COUNTER)
+		return !((struct counter *)value)->actual_count;
+	if (type == metric_type_TIMER)
+		return !((struct timer_hist *)value)->tm.actual_count;
+	return 0;
+}
+
+/**
+ * Iterates through all the metrics using a number of threads.
+ * The slots of each hashmap are partitioned between the workers,
+ * and timers are finalized by the worker that visits them. The
+ * callback is invoked concurrently, but each worker only gets its
+ * own data handle. If a thread can not be started, its partition
+ * is run on the calling thread, still with its own data handle.
+ * @arg num_workers The number of workers, including the calling thread
+ * @arg data An array of num_workers opaque handles, one per worker
+ * @return 0 on success, the return of a callback, or -1 if the
+ * workers could not be allocated.
+ */
+int metrics_iter_parallel(struct metrics * m, uint32_t num_workers, void **data, metric_callback cb)
+{
+	if (!num_workers)
+		return -1;
+
+	struct worker_info *workers = calloc(num_workers, sizeof(struct worker_info));
+	pthread_t *threads = calloc(num_workers, sizeof(pthread_t));
+	if (!workers || !threads) {
+		free(workers);
+		free(threads);
+		return -1;
+	}
+
+	// Start the other workers, the calling thread is the first.
+	// The partitions of any workers that could not be started
+	// are run on the calling thread after its own, so the output
+	// is always complete.
+	uint32_t started = 1;
+	for (uint32_t i = 0; i < num_workers; i++) {
+		workers[i] = (struct worker_info) { m, i, num_workers, data[i], cb, 0 };
+		if (i && started == i && !pthread_create(threads + i, NULL, iter_worker, workers + i))
+			started++;
+	}
+	iter_worker(workers);
+	for (uint32_t i = started; i < num_workers; i++) {
+		iter_worker(workers + i);
+	}
+	for (uint32_t i = 1; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	// Report the first worker that stopped early
+	int res = 0;
+	for (uint32_t i = 0; i < num_workers && !res; i++) {
+		res = workers[i].result;
+	}
+	free(workers);
+	free(threads);
+	return res;
+}
+
+/**
+ * Enables the ordered index of metric names, used by
+ * metrics_iter_sorted. The index is built from the current
+ * metrics, and then kept up to date as metrics are added
+ * and removed. Calling this again has no effect.
+ * @return 0 on success.
+ */
+int metrics_enable_index(struct metrics * m)
+{
+	if (m->names)
+		return 0;
+	m->names = malloc(sizeof(struct radix_tree));
+	if (!m->names)
+		return -1;
+	return metrics_index_build(m);
+}
+
+/**
+ * Iterates through all the metrics, in the lexicographic
+ * byte order of their names. The K/V pairs are sent first,
+ * then each name has its metrics sent in the metrics_iter
+ * type order.
+ * @arg m The metrics to iterate through
+ * @arg data Opaque handle passed to the callback
+ * @arg cb A callback function to invoke, as for metrics_iter
+ * @return 0 on success, the return of the callback, or -1
+ * if the index is not enabled.
+ */
+int metrics_iter_sorted(struct metrics * m, void *data, metric_callback cb)
+{
+	if (!m->names)
+		return -1;
+
+	// Handle the K/V pairs first
+	int should_break = metrics_iter_kv(m, data, cb);
+	if (should_break)
+		return should_break;
+
+	// Walk the index, the type is set per metric
+	struct cb_info info = { metric_type_UNKNOWN, data, cb };
+	return radix_foreach(m->names, &info, sorted_iter_cb);
+}
+
+// Checks if an index entry has no metrics left
+static bool index_entry_unused(struct metric_names_entry *e)
+{
+	for (int i = 0; i < METRIC_NAMES_TYPES; i++) {
+		if (e->values[i])
+			return false;
+	}
+	return true;
+}
+
+// Adds a new metric to the index, if it is enabled
+static int metrics_index_add(struct metrics * m, int type, const char *name, size_t name_len, void *value)
+{
+	if (!m->names)
+		return 0;
+
+	// Reuse the entry of another type, or an unused one
+	struct metric_names_entry *e;
+	if (!radix_search_n(m->names, name, name_len, (void **)&e)) {
+		if (index_entry_unused(e))
+			m->names_unused--;
+		e->values[type] = value;
+		return 0;
+	}
+
+	// The entry holds the name, so the tree need not copy it
+	e = calloc(1, sizeof(struct metric_names_entry) + name_len + 1);
+	if (!e)
+		return -1;
+	e->values[type] = value;
+	memcpy(e->name, name, name_len);
+	if (radix_insert_ref_n(m->names, e->name, name_len, (void **)&e)) {
+		free(e);
+		return -1;
+	}
+	m->names_size++;
+	return 0;
+}
+
+// Removes a metric from the index, if it is enabled. The entry
+// is kept, as the radix tree does not support deletes.
+static void metrics_index_remove(struct metrics * m, int type, const char *name)
+{
+	struct metric_names_entry *e;
+	if (!m->names || radix_search(m->names, (char *)name, (void **)&e))
+		return;
+	if (!e->values[type])
+		return;
+	e->values[type] = NULL;
+	if (index_entry_unused(e))
+		m->names_unused++;
+}
+
+// Builds the index from all the hashmaps
+static int metrics_index_build(struct metrics * m)
+{
+	if (radix_init(m->names))
+		return -1;
+	m->names_size = 0;
+	m->names_unused = 0;
+
+	struct index_info info = { m, METRIC_NAMES_COUNTER };
+	int res = hashmap_iter(m->counters, index_build_cb, &info);
+	if (res)
+		return res;
+	info.type = METRIC_NAMES_TIMER;
+	res = hashmap_iter(m->timers, index_build_cb, &info);
+	if (res)
+		return res;
+	info.type = METRIC_NAMES_GAUGE;
+	res = hashmap_iter(m->gauges, index_build_cb, &info);
+	if (res)
+		return res;
+	info.type = METRIC_NAMES_SET;
+	return hashmap_iter(m->sets, index_build_cb, &info);
+}
+
+// Frees the index entries and the radix tree nodes
+static void metrics_index_free(struct metrics * m)
+{
+	radix_foreach(m->names, NULL, index_free_cb);
+	radix_destroy(m->names);
+}
+
+// Adds a metric from a hashmap to the index
+static int index_build_cb(void *data, const char *key, void *value)
+{
+	struct index_info *info = data;
+	return metrics_index_add(info->m, info->type, key, strlen(key), value);
+}
+
+// Index entry cleanup
+static int index_free_cb(void *data, char *key, void *value)
+{
+	free(value);
+	return 0;
+}
+
+// Drops the metrics of one type from an index entry
+static int index_clear_cb(void *data, char *key, void *value)
+{
+	struct index_info *info = data;
+	struct metric_names_entry *e = value;
+	if (!e->values[info->type])
+		return 0;
+	e->values[info->type] = NULL;
+	if (index_entry_unused(e))
+		info->m->names_unused++;
+	return 0;
+}
+
+// Sends the metrics of one index entry, in the metrics_iter type order
+static int sorted_iter_cb(void *data, char *key, void *value)
+{
+	struct cb_info *info = data;
+	struct metric_names_entry *e = value;
+	int should_break = 0;
+	for (int i = 0; i < METRIC_NAMES_TYPES && !should_break; i++) {
+		if (!e->values[i])
+			continue;
+		info->type = index_types[i];
+		should_break = iter_cb(info, key, e->values[i]);
+	}
+	return should_break;
+}
+
+// Visits one partition of every hashmap
+static void *iter_worker(void *arg)
+{
+	struct worker_info *w = arg;
+	struct metrics *m = w->m;
+
+	// The K/V pairs can not be partitioned
+	if (!w->index)
+		w->result = metrics_iter_kv(m, w->data, w->cb);
+
+	struct cb_info info = { metric_type_COUNTER, w->data, w->cb };
+	enum metric_type types[] = { metric_type_COUNTER, metric_type_TIMER, metric_type_GAUGE, metric_type_SET };
+	struct hashmap *map;
+	int slots, start, end;
+	for (int t = 0; t < sizeof(types) / sizeof(types[0]) && !w->result; t++) {
+		info.type = types[t];
+		map = metrics_type_map(m, types[t]);
+		slots = hashmap_slots(map);
+		start = (uint64_t)slots * w->index / w->num_workers;
+		end = (uint64_t)slots * (w->index + 1) / w->num_workers;
+
+		// Timers are finalized here, rather than lazily on the first query
+		if (info.type == metric_type_TIMER)
+			w->result = hashmap_iter_range(map, start, end, iter_finalize_cb, &info);
+		else
+			w->result = hashmap_iter_range(map, start, end, iter_cb, &info);
+	}
+	return NULL;
+}
+
+// Finalizes a timer, before invoking the user code
+static int iter_finalize_cb(void *data, const char *key, void *value)
+{
+	struct timer_hist *t = value;
+	finalize_timer(&t->tm);
+	return iter_cb(data, key, value);
+}
+
 // Counter map cleanup
 static int counter_delete_cb(void *data, const char *key, void *value)
 {
@@ -372,8 +1278,8 @@ static int timer_delete_cb(void *data, const char *key, void *value)
 {
 	struct timer_hist *t = value;
 	destroy_timer(&t->tm);
-	if (t->counts)
-		free(t->counts);
+	if (t->conf)
+		histogram_counts_destroy(&t->counts);
 	free(t);
 	return 0;
 }
@@ -395,9 +1301,110 @@ static int gauge_delete_cb(void *data, const char *key, void *value)
 	return 0;
 }
 
+// Counter reset, returns 1 to remove an idle counter
+static int counter_reset_cb(void *data, const char *key, void *value)
+{
+	struct reset_info *info = data;
+	struct counter *c = value;
+	uint32_t idle = (c->actual_count) ? 0 : c->idle_intervals + 1;
+	if (idle > info->max_idle) {
+		metrics_index_remove(info->m, METRIC_NAMES_COUNTER, key);
+		counter_delete_cb(NULL, key, value);
+		return 1;
+	}
+	init_counter(c);
+	c->idle_intervals = idle;
+	return 0;
+}
+
+// Timer reset, returns 1 to remove an idle timer
+static int timer_reset_cb(void *data, const char *key, void *value)
+{
+	struct reset_info *info = data;
+	struct timer_hist *t = value;
+	uint32_t idle = (t->tm.actual_count) ? 0 : t->idle_intervals + 1;
+	if (idle > info->max_idle) {
+		metrics_index_remove(info->m, METRIC_NAMES_TIMER, key);
+		timer_delete_cb(NULL, key, value);
+		return 1;
+	}
+	reset_timer(info->m->timer_eps, info->m->quantiles, info->m->num_quants, &t->tm);
+	if (t->conf)
+		histogram_counts_reset(&t->counts);
+	t->idle_intervals = idle;
+	return 0;
+}
+
+// Set reset, returns 1 to remove an idle set
+static int set_reset_cb(void *data, const char *key, void *value)
+{
+	struct reset_info *info = data;
+	set_t *s = value;
+	uint32_t idle = (s->reset) ? s->idle_intervals + 1 : 0;
+	if (idle > info->max_idle) {
+		metrics_index_remove(info->m, METRIC_NAMES_SET, key);
+		set_delete_cb(NULL, key, value);
+		return 1;
+	}
+	set_reset(s);
+	s->idle_intervals = idle;
+	return 0;
+}
+
 // Callback to invoke the user code
 static int iter_cb(void *data, const char *key, void *value)
 {
 	struct cb_info *info = data;
+	if (metrics_iter_skips(info->type, value))
+		return 0;
 	return info->cb(info->data, info->type, (char *)key, value);
 }
+
+// Returns the METRIC_NAMES_ type of a metric type, or -1
+static int metrics_names_type(enum metric_type type)
+{
+	switch (type) {
+		case metric_type_COUNTER:
+			return METRIC_NAMES_COUNTER;
+		case metric_type_TIMER:
+			return METRIC_NAMES_TIMER;
+		case metric_type_GAUGE:
+		case metric_type_GAUGE_DELTA:
+			return METRIC_NAMES_GAUGE;
+		case metric_type_SET:
+			return METRIC_NAMES_SET;
+		default:
+			return -1;
+	}
+}
+
+// Adds up the allocations of a timer
+static int timer_stats_cb(void *data, const char *key, void *value)
+{
+	struct metrics_stats *stats = data;
+	struct timer_hist *t = value;
+	stats->timer_bytes += timer_memory(&t->tm);
+	if (t->tm.engine != QUANTILE_DDSKETCH) {
+		uint64_t allocated;
+		cm_pool_usage(&t->tm.quant.cm, NULL, &allocated);
+		stats->timer_samples += allocated;
+	}
+	if (t->conf)
+		stats->histogram_bytes += histogram_counts_memory(&t->counts);
+	return 0;
+}
+
+// Adds up the allocations of a set
+static int set_stats_cb(void *data, const char *key, void *value)
+{
+	struct metrics_stats *stats = data;
+	stats->set_bytes += set_memory(value);
+	return 0;
+}
+
+// Computes the bin scale of a histogram config, if it has none
+static int histogram_prepare_cb(void *data, char *key, void *value)
+{
+	histogram_config *conf = value;
+	return (!conf->bin_scale && histogram_init(conf)) ? 1 : 0;
+}
@@ -0,0 +1,172 @@
+#include <stdlib.h>
+#include <string.h>
+#include "name_pool.h"
+
+// Initial bytes of names, and slots of the index
+#define NAME_POOL_MIN_SIZE 1024
+#define NAME_POOL_MIN_SLOTS 64
+
+/**
+ * Initializes an empty pool
+ * @arg pool The pool to initialize
+ * @return 0 on success, -1 on allocation failure.
+ */
+int name_pool_init(struct name_pool * pool)
+{
+	pool->data = malloc(NAME_POOL_MIN_SIZE);
+	pool->slots = calloc(NAME_POOL_MIN_SLOTS, sizeof(name_pool_slot));
+	if (!pool->data || !pool->slots) {
+		free(pool->data);
+		free(pool->slots);
+		return -1;
+	}
+
+	// The first byte is skipped, so no name has the NONE handle
+	pool->data[0] = 0;
+	pool->len = 1;
+	pool->size = NAME_POOL_MIN_SIZE;
+	pool->num_slots = NAME_POOL_MIN_SLOTS;
+	pool->count = 0;
+	return 0;
+}
+
+/**
+ * Destroys a pool, and all of its names
+ * @arg pool The pool to destroy
+ */
+void name_pool_destroy(struct name_pool * pool)
+{
+	free(pool->data);
+	free(pool->slots);
+	pool->data = NULL;
+	pool->slots = NULL;
+}
+
+// Grows the data to fit a number of bytes
+static int grow_data(struct name_pool * pool, size_t len)
+{
+	uint64_t need = (uint64_t)pool->len + len;
+	if (need <= pool->size)
+		return 0;
+	if (need > UINT32_MAX)
+		return -1;
+	uint64_t size = pool->size;
+	while (size < need)
+		size *= 2;
+	if (size > UINT32_MAX)
+		size = UINT32_MAX;
+	char *data = realloc(pool->data, size);
+	if (!data)
+		return -1;
+	pool->data = data;
+	pool->size = size;
+	return 0;
+}
+
+// Grows the index to fit a number of names, at most half full
+static int grow_slots(struct name_pool * pool, uint32_t count)
+{
+	uint64_t need = ((uint64_t)pool->count + count) * 2;
+	if (need <= pool->num_slots)
+		return 0;
+	uint64_t num_slots = pool->num_slots;
+	while (num_slots < need)
+		num_slots *= 2;
+	if (num_slots > UINT32_MAX)
+		return -1;
+
+	name_pool_slot *slots = calloc(num_slots, sizeof(name_pool_slot));
+	if (!slots)
+		return -1;
+	uint32_t mask = num_slots - 1;
+	for (uint32_t i = 0; i < pool->num_slots; i++) {
+		name_pool_slot *s = pool->slots + i;
+		if (s->handle == NAME_POOL_NONE)
+			continue;
+		uint32_t pos = s->hash & mask;
+		while (slots[pos].handle != NAME_POOL_NONE)
+			pos = (pos + 1) & mask;
+		slots[pos] = *s;
+	}
+	free(pool->slots);
+	pool->slots = slots;
+	pool->num_slots = num_slots;
+	return 0;
+}
+
+/**
+ * Returns the handle of a name, adding it if needed.
+ * @arg pool The pool
+ * @arg name The name, need not be null terminated. It may
+ * point into the pool itself.
+ * @arg name_len The length of the name
+ * @arg hash The hash of the name, from hashmap_hash_key
+ * @return The handle, or NAME_POOL_NONE on allocation failure.
+ */
+uint32_t name_pool_intern(struct name_pool * pool, const char *name, size_t name_len, uint64_t hash)
+{
+	uint32_t mask = pool->num_slots - 1;
+	uint32_t pos = hash & mask;
+	name_pool_slot *s;
+	for (;; pos = (pos + 1) & mask) {
+		s = pool->slots + pos;
+		if (s->handle == NAME_POOL_NONE)
+			break;
+		if (s->hash == hash && s->len == name_len && !memcmp(pool->data + s->handle, name, name_len))
+			return s->handle;
+	}
+
+	// Keep the offset of a name from the pool, which may move
+	uintptr_t addr = (uintptr_t)name;
+	uintptr_t base = (uintptr_t)pool->data;
+	int in_pool = (addr >= base && addr < base + pool->len);
+	size_t offset = addr - base;
+
+	if (name_len >= UINT32_MAX || grow_data(pool, name_len + 1))
+		return NAME_POOL_NONE;
+	if (pool->count + 1 > pool->num_slots / 2) {
+		if (grow_slots(pool, 1))
+			return NAME_POOL_NONE;
+		mask = pool->num_slots - 1;
+		pos = hash & mask;
+		while (pool->slots[pos].handle != NAME_POOL_NONE)
+			pos = (pos + 1) & mask;
+		s = pool->slots + pos;
+	}
+	if (in_pool)
+		name = pool->data + offset;
+
+	uint32_t handle = pool->len;
+	memcpy(pool->data + handle, name, name_len);
+	pool->data[handle + name_len] = 0;
+	pool->len += name_len + 1;
+
+	s->hash = hash;
+	s->handle = handle;
+	s->len = name_len;
+	pool->count++;
+	return handle;
+}
+
+/**
+ * Returns an interned name
+ * @arg pool The pool
+ * @arg handle The handle of the name
+ * @return The null terminated name, valid until
+ * the next name is interned.
+ */
+const char *name_pool_get(const struct name_pool * pool, uint32_t handle)
+{
+	return pool->data + handle;
+}
+
+/**
+ * Returns the memory allocated by a pool, for its
+ * names and the index.
+ * @arg pool The pool
+ * @return The size in bytes, without the struct itself.
+ */
+size_t name_pool_memory(const struct name_pool * pool)
+{
+	return (size_t)pool->size + (size_t)pool->num_slots * sizeof(name_pool_slot);
+}
@@ -0,0 +1,127 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "perf_counters.h"
+
+// Number of counters in the struct
+#define PERF_NUM_COUNTERS (sizeof(struct perf_counters) / sizeof(uint64_t))
+
+#ifdef STATSITE_PERF_COUNTERS
+
+// The counters of a thread, linked into the live threads
+struct perf_thread {
+	struct perf_counters counters;
+	struct perf_thread *next;
+	struct perf_thread *prev;
+};
+
+__thread struct perf_counters *perf_counters_thread = NULL;
+
+static pthread_mutex_t perf_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct perf_thread *perf_threads = NULL;	// Threads still running
+static struct perf_counters perf_exited;	// Sums of the threads that exited
+static pthread_once_t perf_once = PTHREAD_ONCE_INIT;
+static pthread_key_t perf_key;
+
+static void perf_thread_exit(void *arg);
+
+static void perf_key_init(void)
+{
+	pthread_key_create(&perf_key, perf_thread_exit);
+}
+
+/**
+ * Allocates the counters of the calling thread. They are
+ * folded into the totals when the thread exits.
+ * @return The counters, or NULL on allocation failure.
+ */
+struct perf_counters *perf_counters_register(void)
+{
+	pthread_once(&perf_once, perf_key_init);
+	struct perf_thread *t = calloc(1, sizeof(struct perf_thread));
+	if (!t)
+		return NULL;
+
+	pthread_mutex_lock(&perf_lock);
+	t->next = perf_threads;
+	if (perf_threads)
+		perf_threads->prev = t;
+	perf_threads = t;
+	pthread_mutex_unlock(&perf_lock);
+
+	pthread_setspecific(perf_key, t);
+	perf_counters_thread = &t->counters;
+	return perf_counters_thread;
+}
+
+// Folds the counters of an exiting thread into the totals
+static void perf_thread_exit(void *arg)
+{
+	struct perf_thread *t = arg;
+	uint64_t *from = (uint64_t *)&t->counters;
+	uint64_t *to = (uint64_t *)&perf_exited;
+
+	pthread_mutex_lock(&perf_lock);
+	for (size_t i = 0; i < PERF_NUM_COUNTERS; i++)
+		to[i] += from[i];
+	if (t->prev)
+		t->prev->next = t->next;
+	else
+		perf_threads = t->next;
+	if (t->next)
+		t->next->prev = t->prev;
+	pthread_mutex_unlock(&perf_lock);
+
+	perf_counters_thread = NULL;
+	free(t);
+}
+
+/**
+ * Returns a monotonic time, for the timed hooks
+ * @return The time in nanoseconds
+ */
+uint64_t perf_counters_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#endif
+
+/**
+ * Checks if the library was built with the counters
+ * @return 1 if the counters are collected, 0 if not.
+ */
+int perf_counters_enabled(void)
+{
+#ifdef STATSITE_PERF_COUNTERS
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+/**
+ * Reads the counters, summed over all the threads that have
+ * used the library, including the threads that have exited.
+ * The counters only grow, so the counters of an interval are
+ * the difference with the read of the previous flush.
+ * @arg out Output. The counters
+ */
+void perf_counters_read(struct perf_counters * out)
+{
+	memset(out, 0, sizeof(struct perf_counters));
+#ifdef STATSITE_PERF_COUNTERS
+	uint64_t *to = (uint64_t *)out;
+	pthread_mutex_lock(&perf_lock);
+	memcpy(out, &perf_exited, sizeof(struct perf_counters));
+	for (struct perf_thread *t = perf_threads; t; t = t->next) {
+		uint64_t *from = (uint64_t *)&t->counters;
+		for (size_t i = 0; i < PERF_NUM_COUNTERS; i++)
+			to[i] += __atomic_load_n(from + i, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&perf_lock);
+#endif
+}
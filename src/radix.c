@@ -3,33 +3,233 @@
 #include <string.h>
 #include "radix.h"
 
+// Allocates a node with a given layout
+static struct radix_node *alloc_node(uint8_t type)
+{
+	struct radix_node *n;
+	switch (type) {
+	case RADIX_NODE4:
+		n = calloc(1, sizeof(struct radix_node4));
+		break;
+	case RADIX_NODE16:
+		n = calloc(1, sizeof(struct radix_node16));
+		break;
+	case RADIX_NODE48:
+		n = calloc(1, sizeof(struct radix_node48));
+		break;
+	default:
+		n = calloc(1, sizeof(struct radix_node256));
+		break;
+	}
+	if (n)
+		n->type = type;
+	return n;
+}
+
 /**
  * Initializes the radix tree
  * @arg tree The tree to initialize
- * @return 0 on success
+ * @return 0 on success, 1 if the root could not be allocated
  */
 int radix_init(struct radix_tree * tree)
 {
-	memset(tree, 0, sizeof(struct radix_tree));
+	tree->root = alloc_node(RADIX_NODE4);
+	return (tree->root) ? 0 : 1;
+}
+
+// Returns the child slot of a node for an edge byte, or NULL
+static struct radix_node **find_child(struct radix_node * n, unsigned char c)
+{
+	switch (n->type) {
+	case RADIX_NODE4: {
+		struct radix_node4 *n4 = (struct radix_node4 *)n;
+		for (int i = 0; i < n->num_children; i++) {
+			if (n4->keys[i] == c)
+				return n4->children + i;
+		}
+		return NULL;
+	}
+	case RADIX_NODE16: {
+		// The keys are sorted, so we can stop early
+		struct radix_node16 *n16 = (struct radix_node16 *)n;
+		for (int i = 0; i < n->num_children && n16->keys[i] <= c; i++) {
+			if (n16->keys[i] == c)
+				return n16->children + i;
+		}
+		return NULL;
+	}
+	case RADIX_NODE48: {
+		struct radix_node48 *n48 = (struct radix_node48 *)n;
+		if (!n48->index[c])
+			return NULL;
+		return n48->children + n48->index[c] - 1;
+	}
+	default: {
+		struct radix_node256 *n256 = (struct radix_node256 *)n;
+		if (!n256->children[c])
+			return NULL;
+		return n256->children + c;
+	}
+	}
+}
+
+// Inserts an edge into sorted key and child arrays with room for it
+static void insert_sorted(unsigned char *keys, struct radix_node **children, int num,
+		unsigned char c, struct radix_node * child)
+{
+	int idx = 0;
+	while (idx < num && keys[idx] < c)
+		idx++;
+	memmove(keys + idx + 1, keys + idx, num - idx);
+	memmove(children + idx + 1, children + idx, (num - idx) * sizeof(struct radix_node *));
+	keys[idx] = c;
+	children[idx] = child;
+}
+
+// Replaces a full node with the next larger layout
+static struct radix_node *grow_node(struct radix_node * n)
+{
+	struct radix_node *bigger = alloc_node(n->type + 1);
+	if (!bigger)
+		return NULL;
+
+	// Copy the header, but keep the new layout
+	uint8_t type = bigger->type;
+	*bigger = *n;
+	bigger->type = type;
+
+	switch (n->type) {
+	case RADIX_NODE4: {
+		struct radix_node4 *src = (struct radix_node4 *)n;
+		struct radix_node16 *dst = (struct radix_node16 *)bigger;
+		memcpy(dst->keys, src->keys, n->num_children);
+		memcpy(dst->children, src->children, n->num_children * sizeof(struct radix_node *));
+		break;
+	}
+	case RADIX_NODE16: {
+		struct radix_node16 *src = (struct radix_node16 *)n;
+		struct radix_node48 *dst = (struct radix_node48 *)bigger;
+		for (int i = 0; i < n->num_children; i++) {
+			dst->index[src->keys[i]] = i + 1;
+			dst->children[i] = src->children[i];
+		}
+		break;
+	}
+	case RADIX_NODE48: {
+		struct radix_node48 *src = (struct radix_node48 *)n;
+		struct radix_node256 *dst = (struct radix_node256 *)bigger;
+		for (int c = 0; c < 256; c++) {
+			if (src->index[c])
+				dst->children[c] = src->children[src->index[c] - 1];
+		}
+		break;
+	}
+	}
+	free(n);
+	return bigger;
+}
+
+/**
+ * Adds an edge to a node, growing it if it is full.
+ * @arg ref The slot holding the node, updated if it grows
+ * @arg c The edge byte, not yet in the node
+ * @arg child The child to add
+ * @return 0 on success, -1 if the node could not grow
+ */
+static int add_child(struct radix_node **ref, unsigned char c, struct radix_node * child)
+{
+	struct radix_node *n = *ref;
+	int full;
+	switch (n->type) {
+	case RADIX_NODE4:
+		full = n->num_children == 4;
+		break;
+	case RADIX_NODE16:
+		full = n->num_children == 16;
+		break;
+	case RADIX_NODE48:
+		full = n->num_children == 48;
+		break;
+	default:
+		full = 0;
+		break;
+	}
+	if (full) {
+		n = grow_node(n);
+		if (!n)
+			return -1;
+		*ref = n;
+	}
+
+	switch (n->type) {
+	case RADIX_NODE4: {
+		struct radix_node4 *n4 = (struct radix_node4 *)n;
+		insert_sorted(n4->keys, n4->children, n->num_children, c, child);
+		break;
+	}
+	case RADIX_NODE16: {
+		struct radix_node16 *n16 = (struct radix_node16 *)n;
+		insert_sorted(n16->keys, n16->children, n->num_children, c, child);
+		break;
+	}
+	case RADIX_NODE48: {
+		// Children are never removed, so the array is packed
+		struct radix_node48 *n48 = (struct radix_node48 *)n;
+		n48->children[n->num_children] = child;
+		n48->index[c] = n->num_children + 1;
+		break;
+	}
+	default:
+		((struct radix_node256 *)n)->children[c] = child;
+		break;
+	}
+	n->num_children++;
 	return 0;
 }
 
+// Returns the child at a position of a node, in byte order.
+// May be NULL for the indexed layouts.
+static struct radix_node *child_at(struct radix_node * n, int i)
+{
+	switch (n->type) {
+	case RADIX_NODE4:
+		return ((struct radix_node4 *)n)->children[i];
+	case RADIX_NODE16:
+		return ((struct radix_node16 *)n)->children[i];
+	case RADIX_NODE48: {
+		struct radix_node48 *n48 = (struct radix_node48 *)n;
+		return (n48->index[i]) ? n48->children[n48->index[i] - 1] : NULL;
+	}
+	default:
+		return ((struct radix_node256 *)n)->children[i];
+	}
+}
+
+// Returns the number of positions to scan with child_at
+static int child_positions(struct radix_node * n)
+{
+	if (n->type == RADIX_NODE4 || n->type == RADIX_NODE16)
+		return n->num_children;
+	return 256;
+}
+
 // Recursively destroys the radix tree
 static void recursive_destroy(struct radix_node * n)
 {
 	struct radix_node *child;
-	if (n->edges[0]) {
-		struct radix_leaf *leaf = n->edges[0];
-		free(leaf->key);
-		free(leaf);
+	if (n->leaf) {
+		if (n->leaf->owns_key)
+			free(n->leaf->key);
+		free(n->leaf);
 	}
-	for (int i = 1; i < 256; i++) {
-		child = (struct radix_node *) n->edges[i];
+	int positions = child_positions(n);
+	for (int i = 0; i < positions; i++) {
+		child = child_at(n, i);
 		if (!child)
 			continue;
 		recursive_destroy(child);
-		free(child);
 	}
+	free(n);
 }
 
 /**
@@ -39,39 +239,65 @@ static void recursive_destroy(struct radix_node * n)
  */
 int radix_destroy(struct radix_tree * tree)
 {
-	recursive_destroy(&tree->root);
+	if (tree->root)
+		recursive_destroy(tree->root);
+	tree->root = NULL;
 	return 0;
 }
 
-// Computes the longest prefix of two null terminated strings
-static int longest_prefix(char *k1, char *k2, int max)
+// Computes the longest prefix of a key and a node key
+static int longest_prefix(const char *k1, size_t k1_len, const char *k2, int k2_len)
 {
+	int max = (k1_len < k2_len) ? k1_len : k2_len;
 	int i;
 	for (i = 0; i < max; i++) {
-		if (!k1[i] || !k2[i] || k1[i] != k2[i])
+		if (k1[i] != k2[i])
 			break;
 	}
 	return i;
 }
 
-/**
- * Inserts a value into the tree
- * @arg t The tree to insert into
- * @arg key The key of the value
- * @arg value Initially points to the value to insert, replaced
- * by the value that was updated if any
- * @return 0 if the value was inserted, 1 if the value was updated.
- */
-int radix_insert(struct radix_tree * t, char *key, void **value)
+// Allocates a leaf, with a copy of the key unless it is borrowed
+static struct radix_leaf *alloc_leaf(const char *key, size_t key_len, void *value, int copy)
+{
+	struct radix_leaf *leaf = malloc(sizeof(struct radix_leaf));
+	if (!leaf)
+		return NULL;
+	leaf->key = (char *)key;
+	leaf->owns_key = copy && key;
+	if (leaf->owns_key) {
+		leaf->key = strndup(key, key_len);
+		if (!leaf->key) {
+			free(leaf);
+			return NULL;
+		}
+	}
+	leaf->value = value;
+	return leaf;
+}
+
+// Frees a leaf that was never added to the tree
+static void free_leaf(struct radix_leaf * leaf)
 {
-	struct radix_node *child, *parent = NULL, *n = &t->root;
+	if (leaf && leaf->owns_key)
+		free(leaf->key);
+	free(leaf);
+}
+
+// Inserts a value, allocating everything before the tree
+// is changed, so a failure leaves the tree as it was
+static int insert_leaf(struct radix_tree * t, const char *key, size_t key_len, void **value, int copy)
+{
+	struct radix_node **ref = &t->root, **child_ref;
+	struct radix_node *child, *n = t->root;
 	struct radix_leaf *leaf;
-	char *search = key;
+	const char *search = key;
+	const char *end = key + key_len;
 	int common_prefix;
 	do {
 		// Check if we've exhausted the key
-		if (!search || *search == 0) {
-			leaf = n->edges[0];
+		if (search == end) {
+			leaf = n->leaf;
 			if (leaf) {
 				// Return the old value
 				void *old = leaf->value;
@@ -79,71 +305,133 @@ int radix_insert(struct radix_tree * t, char *key, void **value)
 				*value = old;
 				return 1;
 			} else {
-				// Add a new node
-				leaf = malloc(sizeof(struct radix_leaf));
-				n->edges[0] = leaf;
-				leaf->key = key ? strdup(key) : NULL;
-				leaf->value = *value;
-				return 0;
+				// Add a new leaf
+				n->leaf = alloc_leaf(key, key_len, *value, copy);
+				return (n->leaf) ? 0 : -1;
 			}
 		}
 		// Get the edge
-		parent = n;
-		n = n->edges[(int)*search];
-		if (!n) {
-			child = parent->edges[(int)*search] = calloc(1, sizeof(struct radix_node));
-			leaf = child->edges[0] = malloc(sizeof(struct radix_leaf));
-			leaf->key = strdup(key);
-			leaf->value = *value;
-
-			// The key of the node is some
+		child_ref = find_child(n, *search);
+		if (!child_ref) {
+			child = alloc_node(RADIX_NODE4);
+			leaf = alloc_leaf(key, key_len, *value, copy);
+			if (!child || !leaf) {
+				free(child);
+				free_leaf(leaf);
+				return -1;
+			}
+
+			// The key of the node is the rest of the key
+			child->leaf = leaf;
 			child->key = leaf->key + (search - key);
-			child->key_len = strlen(search);
+			child->key_len = end - search;
+			if (add_child(ref, *search, child)) {
+				free(child);
+				free_leaf(leaf);
+				return -1;
+			}
 			return 0;
 		}
 		// Determine longest prefix of the search key on match
-		common_prefix = longest_prefix(search, n->key, n->key_len);
-		if (common_prefix == n->key_len) {
-			search += n->key_len;
+		child = *child_ref;
+		common_prefix = longest_prefix(search, end - search, child->key, child->key_len);
+		if (common_prefix == child->key_len) {
+			search += child->key_len;
+			ref = child_ref;
+			n = child;
 
 			// If we share a sub-set, we need to split the nodes
 		} else {
-			// Split the node with the shared prefix
-			child = calloc(1, sizeof(struct radix_node));
-			parent->edges[(int)*search] = child;
-			child->key = n->key;
-			child->key_len = common_prefix;
+			// Allocate the split node, the new leaf and the node
+			// for the rest of the new key, if it is not a subset
+			struct radix_node *split = alloc_node(RADIX_NODE4);
+			struct radix_node *rest = NULL;
+			leaf = alloc_leaf(key, key_len, *value, copy);
+			search += common_prefix;
+			if (search != end)
+				rest = alloc_node(RADIX_NODE4);
+			if (!split || !leaf || (search != end && !rest)) {
+				free(split);
+				free(rest);
+				free_leaf(leaf);
+				return -1;
+			}
 
-			// Restore pointer to the existing node
-			n->key += common_prefix;
-			n->key_len -= common_prefix;
-			child->edges[(int)*(n->key)] = n;
+			// Split the node with the shared prefix. The split node
+			// has room for both edges, so adding them can not fail.
+			split->key = child->key;
+			split->key_len = common_prefix;
+			*child_ref = split;
 
-			// Create a new leaf
-			leaf = malloc(sizeof(struct radix_leaf));
-			leaf->key = strdup(key);
-			leaf->value = *value;
+			// Restore pointer to the existing node
+			child->key += common_prefix;
+			child->key_len -= common_prefix;
+			add_child(child_ref, *(child->key), child);
 
 			// If the new key is a subset, add to to this node
-			search += common_prefix;
-			if (*search == 0) {
-				child->edges[0] = leaf;
+			if (!rest) {
+				split->leaf = leaf;
 				return 0;
 			}
 			// Create a new node for the new key
-			n = calloc(1, sizeof(struct radix_node));
-			child->edges[(int)*search] = n;
-			n->edges[0] = leaf;
-
-			// The key of the node is some
-			n->key = leaf->key + (search - key);
-			n->key_len = strlen(search);
+			rest->leaf = leaf;
+			rest->key = leaf->key + (search - key);
+			rest->key_len = end - search;
+			add_child(child_ref, *search, rest);
 			return 0;
 		}
 	} while (1);
 	return 0;
 }
 
+/**
+ * Inserts a value into the tree
+ * @arg t The tree to insert into
+ * @arg key The key of the value
+ * @arg value Initially points to the value to insert, replaced
+ * by the value that was updated if any
+ * @return 0 if the value was inserted, 1 if the value was updated,
+ * -1 on allocation failure.
+ */
+int radix_insert(struct radix_tree * t, char *key, void **value)
+{
+	return insert_leaf(t, key, key ? strlen(key) : 0, value, 1);
+}
+
+/**
+ * Inserts a value into the tree, for keys that
+ * are not null terminated.
+ * @arg t The tree to insert into
+ * @arg key The key of the value, must not contain null bytes
+ * @arg key_len The length of the key
+ * @arg value Initially points to the value to insert, replaced
+ * by the value that was updated if any
+ * @return 0 if the value was inserted, 1 if the value was updated,
+ * -1 on allocation failure.
+ */
+int radix_insert_n(struct radix_tree * t, const char *key, size_t key_len, void **value)
+{
+	return insert_leaf(t, key, key_len, value, 1);
+}
+
+/**
+ * Inserts a value into the tree without copying the key.
+ * The tree points to the key, which must stay valid and
+ * unchanged until the tree is destroyed. Updating a value
+ * keeps the key it was inserted with.
+ * @arg t The tree to insert into
+ * @arg key The key of the value, must not contain null bytes
+ * @arg key_len The length of the key
+ * @arg value Initially points to the value to insert, replaced
+ * by the value that was updated if any
+ * @return 0 if the value was inserted, 1 if the value was updated,
+ * -1 on allocation failure.
+ */
+int radix_insert_ref_n(struct radix_tree * t, const char *key, size_t key_len, void **value)
+{
+	return insert_leaf(t, key, key_len, value, 0);
+}
+
 /**
  * Finds a value in the tree
  * @arg t The tree to search
@@ -153,25 +441,40 @@ int radix_insert(struct radix_tree * t, char *key, void **value)
  */
 int radix_search(struct radix_tree * t, char *key, void **value)
 {
-	struct radix_node *n = &t->root;
-	char *search = key;
+	return radix_search_n(t, key, key ? strlen(key) : 0, value);
+}
+
+/**
+ * Finds a value in the tree, for keys that
+ * are not null terminated.
+ * @arg t The tree to search
+ * @arg key The key to search
+ * @arg key_len The length of the key
+ * @arg value The value of the key
+ * @return 0 if found
+ */
+int radix_search_n(struct radix_tree * t, const char *key, size_t key_len, void **value)
+{
+	struct radix_node **ref, *n = t->root;
+	const char *search = key;
+	const char *end = key + key_len;
 	do {
 		// Check if we've exhausted the key
-		if (!search || *search == 0) {
-			struct radix_leaf *l = n->edges[0];
-			if (l) {
-				*value = l->value;
+		if (search == end) {
+			if (n->leaf) {
+				*value = n->leaf->value;
 				return 0;
 			}
 			break;
 		}
 		// Get the edge
-		n = n->edges[(int)*search];
-		if (!n)
+		ref = find_child(n, *search);
+		if (!ref)
 			break;
+		n = *ref;
 
 		// Consume the search key on match
-		if (!strncmp(search, n->key, n->key_len))
+		if (n->key_len <= end - search && !memcmp(search, n->key, n->key_len))
 			search += n->key_len;
 		else
 			break;
@@ -188,25 +491,41 @@ int radix_search(struct radix_tree * t, char *key, void **value)
  */
 int radix_longest_prefix(struct radix_tree * t, char *key, void **value)
 {
-	struct radix_node *n = &t->root;
+	return radix_longest_prefix_n(t, key, key ? strlen(key) : 0, value);
+}
+
+/**
+ * Finds the longest matching prefix of a key
+ * that is not null terminated.
+ * @arg t The tree to search
+ * @arg key The key to search
+ * @arg key_len The length of the key
+ * @arg value The value of the key with the longest prefix
+ * @return 0 if found
+ */
+int radix_longest_prefix_n(struct radix_tree * t, const char *key, size_t key_len, void **value)
+{
+	struct radix_node **ref, *n = t->root;
 	struct radix_leaf *last_match = NULL;
-	char *search = key;
+	const char *search = key;
+	const char *end = key + key_len;
 	do {
 		// Store the last match
-		if (n->edges[0])
-			last_match = n->edges[0];
+		if (n->leaf)
+			last_match = n->leaf;
 
 		// Check if we've exhausted the key
-		if (!search || *search == 0)
+		if (search == end || *search == 0)
 			break;
 
 		// Get the edge
-		n = n->edges[(int)*search];
-		if (!n)
+		ref = find_child(n, *search);
+		if (!ref)
 			break;
+		n = *ref;
 
 		// Consume the search key on match
-		if (!strncmp(search, n->key, n->key_len))
+		if (n->key_len <= end - search && !memcmp(search, n->key, n->key_len))
 			search += n->key_len;
 		else
 			break;
@@ -232,13 +551,13 @@ static int recursive_iter(struct radix_node * n, void *data, int (*iter_func) (v
 		void *value))
 {
 	int ret = 0;
-	if (n->edges[0]) {
-		struct radix_leaf *leaf = n->edges[0];
-		ret = iter_func(data, leaf->key, leaf->value);
+	if (n->leaf) {
+		ret = iter_func(data, n->leaf->key, n->leaf->value);
 	}
 	struct radix_node *child;
-	for (int i = 1; !ret && i < 256; i++) {
-		child = (struct radix_node *) n->edges[i];
+	int positions = child_positions(n);
+	for (int i = 0; !ret && i < positions; i++) {
+		child = child_at(n, i);
 		if (!child)
 			continue;
 		ret = recursive_iter(child, data, iter_func);
@@ -247,13 +566,15 @@ static int recursive_iter(struct radix_node * n, void *data, int (*iter_func) (v
 }
 
 /**
- * Iterates through all the nodes in the radix tree
+ * Iterates through all the nodes in the radix tree,
+ * in the byte order of the keys
  * @arg t The tree to iter through
+ * @arg data Opaque handle passed through to callback
  * @arg iter_func A callback function to iterate through. Returns
  * non-zero to stop iteration.
  * @return 0 on sucess. 1 if the iteration was stopped.
  */
 int radix_foreach(struct radix_tree * t, void *data, int (*iter_func) (void *data, char *key, void *value))
 {
-	return recursive_iter(&t->root, data, iter_func);
+	return recursive_iter(t->root, data, iter_func);
 }
@@ -3,6 +3,8 @@
 #include <string.h>
 #include <strings.h>
 #include "set.h"
+#include "hash.h"
+#include "perf_counters.h"
 
 /*
  * The set code has been updated to mimic the behaviour in collectd/statsd.
@@ -12,8 +14,8 @@
  * arrives, the old value is discarded and the set "restarts"
  */
 
-// Link the external murmur hash in
-extern void MurmurHash3_x64_128(const void *key, const int len, const uint32_t seed, void *out);
+/* Static declarations */
+static int exact_add(exact_set * s, uint64_t hash, uint64_t max_size);
 
 /**
  * Initializes a new set
@@ -23,8 +25,25 @@ extern void MurmurHash3_x64_128(const void *key, const int len, const uint32_t s
  */
 int set_init(unsigned char precision, set_t * s, uint64_t set_max_exact)
 {
+	return set_init_layout(precision, HLL_LAYOUT_PACKED, s, set_max_exact);
+}
+
+/**
+ * Initializes a new set, with a given HLL register layout
+ * @arg precision The precision to use when converting to an HLL
+ * @arg layout The register layout to use when converting to an HLL
+ * @arg s The set to initialize
+ * @return 0 on success.
+ */
+int set_init_layout(unsigned char precision, hll_layout layout, set_t * s, uint64_t set_max_exact)
+{
+	// The contents depend on the hash from here on
+	hash_lock();
+
 	// Initialize as an exact set
 	s->type = EXACT;
+	s->layout = layout;
+	s->idle_intervals = 0;
 	if (set_max_exact == 0) {
 		s->exact_size = SET_MAX_EXACT;
 	} else {
@@ -32,8 +51,12 @@ int set_init(unsigned char precision, set_t * s, uint64_t set_max_exact)
 	}
 	s->store.s.precision = precision;
 	s->store.s.count = 0;
+	s->store.s.has_zero = false;
 	s->reset = false;
-	s->store.s.hashes = (uint64_t *) malloc(sizeof(uint64_t) * s->exact_size);
+
+	// Start small, the table grows as needed
+	s->store.s.size = EXACT_MIN_SIZE;
+	s->store.s.hashes = (uint64_t *) calloc(EXACT_MIN_SIZE, sizeof(uint64_t));
 	if (!s->store.s.hashes)
 		return 1;
 	return 0;
@@ -48,6 +71,7 @@ int set_destroy(set_t * s)
 	switch (s->type) {
 	case EXACT:
 		free(s->store.s.hashes);
+		s->store.s.hashes = NULL;
 		break;
 
 	case APPROX:
@@ -65,14 +89,20 @@ static void convert_exact_to_approx(set_t * s)
 	// Store the hashes, as HLL initialization
 	// will step on the pointer
 	uint64_t *hashes = s->store.s.hashes;
+	uint32_t size = s->store.s.size;
+	bool has_zero = s->store.s.has_zero;
 
 	// Initialize the HLL
+	PERF_ADD(set_promotions, 1);
 	s->type = APPROX;
-	hll_init(s->store.s.precision, &s->store.h);
+	hll_init_layout(s->store.s.precision, s->layout, &s->store.h);
 
 	// Add each hash to the HLL
-	for (int i = 0; i < s->exact_size; i++) {
-		hll_add_hash(&s->store.h, hashes[i]);
+	if (has_zero)
+		hll_add_hash(&s->store.h, 0);
+	for (uint32_t i = 0; i < size; i++) {
+		if (hashes[i])
+			hll_add_hash(&s->store.h, hashes[i]);
 	}
 
 	// Free the array of hashes
@@ -86,37 +116,82 @@ static void convert_exact_to_approx(set_t * s)
  */
 void set_add(set_t * s, char *key)
 {
-	uint32_t i;
-	uint64_t out[2];
+	set_add_n(s, key, strlen(key));
+}
+
+/**
+ * Adds a new key to the set, for keys that
+ * are not null terminated.
+ * @arg s The set to add to
+ * @arg key The key to add
+ * @arg key_len The length of the key
+ */
+void set_add_n(set_t * s, const char *key, size_t key_len)
+{
+	set_add_hash(s, hash_bytes(key, key_len));
+}
+
+/**
+ * Adds a pre-computed key hash to the set.
+ * @arg s The set to add to
+ * @arg hash The 64bit hash of the key
+ */
+void set_add_hash(set_t * s, uint64_t hash)
+{
 	if (s->reset) {
-		set_init(s->store.s.precision, s, s->exact_size);
+		set_init_layout(s->store.s.precision, s->layout, s, s->exact_size);
 	}
-	MurmurHash3_x64_128(key, strlen(key), 0, &out);
 	switch (s->type) {
 	case EXACT:
-		// Check if this element is already added
-		for (i = 0; i < s->store.s.count; i++) {
-			if (out[1] == s->store.s.hashes[i])
-				return;
-		}
-
-		// Check if we can fit this in the array
-		if (i < s->exact_size) {
-			s->store.s.hashes[i] = out[1];
-			s->store.s.count++;
+		// Check if the element is added, or already there
+		if (!exact_add(&s->store.s, hash, s->exact_size))
 			return;
-		}
+
 		// Otherwise, force conversion to HLL
 		// and purposely fall through to add the
 		// element to the HLL
 		convert_exact_to_approx(s);
 
 	case APPROX:
-		hll_add_hash(&s->store.h, out[1]);
+		hll_add_hash(&s->store.h, hash);
 		break;
 	}
 }
 
+/**
+ * Merges one set into another.
+ * @arg dst The set to merge into
+ * @arg src The set to merge from. Not modified.
+ * @return 0 on success, -1 if the HLL precisions differ.
+ */
+int set_merge(set_t * dst, const set_t * src)
+{
+	// A reset set has released its values
+	if (src->reset)
+		return 0;
+
+	switch (src->type) {
+	case EXACT:
+		if (src->store.s.has_zero)
+			set_add_hash(dst, 0);
+		for (uint32_t i = 0; i < src->store.s.size; i++) {
+			if (src->store.s.hashes[i])
+				set_add_hash(dst, src->store.s.hashes[i]);
+		}
+		return 0;
+
+	case APPROX:
+		if (dst->reset) {
+			set_init_layout(dst->store.s.precision, dst->layout, dst, dst->exact_size);
+		}
+		if (dst->type == EXACT) {
+			convert_exact_to_approx(dst);
+		}
+		return hll_merge(&dst->store.h, &src->store.h);
+	}
+	return 0;
+}
+
 /**
  * Returns the size of the set. May be approximate.
  * @arg s The set to query
@@ -170,3 +245,83 @@ void set_reset_to_zero(set_t *s) {
 	set_destroy(s);
 	s->reset = true;
 }
+
+/* Inserts a hash into a table, which must have a free slot */
+static void exact_insert(uint64_t *table, uint32_t size, uint64_t hash)
+{
+	uint32_t mask = size - 1;
+	uint32_t idx = hash & mask;
+	while (table[idx])
+		idx = (idx + 1) & mask;
+	table[idx] = hash;
+}
+
+/**
+ * Adds a hash to an exact set, growing the table
+ * to keep it at most half full.
+ * @arg s The exact set
+ * @arg hash The hash to add
+ * @arg max_size The most hashes the set may hold
+ * @return 0 if the hash was added or already present,
+ * 1 if the set is full or the table could not grow.
+ */
+static int exact_add(exact_set * s, uint64_t hash, uint64_t max_size)
+{
+	// The zero hash can not be stored in the table
+	if (!hash) {
+		if (s->has_zero)
+			return 0;
+		if (s->count >= max_size)
+			return 1;
+		s->has_zero = true;
+		s->count++;
+		return 0;
+	}
+
+	// Check if this element is already added
+	uint32_t mask = s->size - 1;
+	uint32_t idx = hash & mask;
+	while (s->hashes[idx]) {
+		if (s->hashes[idx] == hash)
+			return 0;
+		idx = (idx + 1) & mask;
+	}
+	if (s->count >= max_size)
+		return 1;
+
+	// Grow the table if it would be over half full
+	if ((uint64_t)(s->count + 1) * 2 > s->size) {
+		uint32_t size = s->size * 2;
+		uint64_t *table = calloc(size, sizeof(uint64_t));
+		if (!table)
+			return 1;
+		for (uint32_t i = 0; i < s->size; i++) {
+			if (s->hashes[i])
+				exact_insert(table, size, s->hashes[i]);
+		}
+		free(s->hashes);
+		s->hashes = table;
+		s->size = size;
+		exact_insert(table, size, hash);
+	} else {
+		s->hashes[idx] = hash;
+	}
+	s->count++;
+	return 0;
+}
+
+/**
+ * Returns the memory allocated by a set, for the hash
+ * table of an exact set or the registers of an HLL.
+ * @arg s The set
+ * @return The size in bytes, without the struct itself.
+ */
+size_t set_memory(const set_t *s)
+{
+	// A reset set has released its values
+	if (s->reset)
+		return 0;
+	if (s->type == EXACT)
+		return (size_t)s->store.s.size * sizeof(uint64_t);
+	return hll_memory(&s->store.h);
+}
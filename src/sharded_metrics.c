@@ -0,0 +1,120 @@
+#include <stdlib.h>
+#include "sharded_metrics.h"
+
+/**
+ * Initializes the sharded metrics. Each shard is initialized
+ * with init_metrics using the same arguments.
+ * @arg num_shards The number of shards, must be positive
+ * @return 0 on success.
+ */
+int init_sharded_metrics(uint32_t num_shards, double timer_eps, double *quantiles, uint32_t num_quants,
+		struct radix_tree * histograms, unsigned char set_precision,
+		uint64_t set_max_exact, struct sharded_metrics * sm)
+{
+	if (!num_shards)
+		return -1;
+
+	sm->shards = calloc(num_shards, sizeof(struct metrics));
+	if (!sm->shards)
+		return -1;
+
+	int res;
+	for (uint32_t i = 0; i < num_shards; i++) {
+		res = init_metrics(timer_eps, quantiles, num_quants, histograms,
+				set_precision, set_max_exact, sm->shards + i);
+		if (res) {
+			// Unwind the shards we managed to setup
+			sm->num_shards = i;
+			destroy_sharded_metrics(sm);
+			return res;
+		}
+	}
+	sm->num_shards = num_shards;
+	return 0;
+}
+
+/**
+ * Destroys the sharded metrics, and all the shards.
+ * @return 0 on success.
+ */
+int destroy_sharded_metrics(struct sharded_metrics * sm)
+{
+	for (uint32_t i = 0; i < sm->num_shards; i++) {
+		destroy_metrics(sm->shards + i);
+	}
+	free(sm->shards);
+	sm->shards = NULL;
+	sm->num_shards = 0;
+	return 0;
+}
+
+/**
+ * Returns the index of the shard owning a name.
+ * The hashmaps index their tables with the low bits
+ * of the hash, so we use the high bits here to avoid
+ * every shard only filling a fraction of its slots.
+ * @arg hash The hash of the name, from hashmap_hash_key
+ * @return The shard index
+ */
+uint32_t sharded_metrics_shard_index(struct sharded_metrics * sm, uint64_t hash)
+{
+	return ((hash >> 32) * sm->num_shards) >> 32;
+}
+
+/**
+ * Returns the shard owning a name.
+ * @arg hash The hash of the name, from hashmap_hash_key
+ * @return The owning shard
+ */
+struct metrics *sharded_metrics_shard(struct sharded_metrics * sm, uint64_t hash)
+{
+	return sm->shards + sharded_metrics_shard_index(sm, hash);
+}
+
+/**
+ * Adds a new sampled value to the owning shard.
+ * @return 0 on success.
+ */
+int sharded_metrics_add_sample_n(struct sharded_metrics * sm, enum metric_type type, const char *name,
+		size_t name_len, uint64_t hash, double val, double sample_rate)
+{
+	return metrics_add_sample_n(sharded_metrics_shard(sm, hash), type, name, name_len, hash, val,
+			sample_rate);
+}
+
+/**
+ * Adds a value to a named set of the owning shard.
+ * @return 0 on success.
+ */
+int sharded_metrics_set_update_n(struct sharded_metrics * sm, const char *name, size_t name_len,
+		uint64_t hash, const char *value, size_t value_len)
+{
+	return metrics_set_update_n(sharded_metrics_shard(sm, hash), name, name_len, hash, value,
+			value_len);
+}
+
+/**
+ * Iterates through all the metrics of all the shards,
+ * in the same type order as metrics_iter.
+ * @return 0 on success, or the return of the callback
+ */
+int sharded_metrics_iter(struct sharded_metrics * sm, void *data, metric_callback cb)
+{
+	int should_break = 0;
+
+	// Handle the K/V pairs first
+	for (uint32_t i = 0; i < sm->num_shards && !should_break; i++) {
+		should_break = metrics_iter_kv(sm->shards + i, data, cb);
+	}
+	if (should_break)
+		return should_break;
+
+	// Send each type across all the shards, before moving on
+	enum metric_type types[] = { metric_type_COUNTER, metric_type_TIMER, metric_type_GAUGE, metric_type_SET };
+	for (int t = 0; t < sizeof(types) / sizeof(types[0]) && !should_break; t++) {
+		for (uint32_t i = 0; i < sm->num_shards && !should_break; i++) {
+			should_break = metrics_iter_type(sm->shards + i, types[t], data, cb);
+		}
+	}
+	return should_break;
+}
@@ -0,0 +1,738 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+#include "hash.h"
+
+#define SNAPSHOT_MAGIC "STSN"
+// The shortest header, the magic and version. Version 2
+// adds a byte for the hash.
+#define SNAPSHOT_V1_HEADER_SIZE 8
+
+// Initial size of the output buffer
+#define SNAPSHOT_MIN_SIZE 4096
+
+// How the value of a set is encoded
+#define SNAPSHOT_SET_RESET 0		// Only the last count
+#define SNAPSHOT_SET_EXACT 1		// The hashes
+#define SNAPSHOT_SET_SPARSE 2		// The sparse HLL entries
+#define SNAPSHOT_SET_DENSE 3		// A byte per HLL register
+
+// A growable output buffer
+struct snapshot_writer {
+	char *buf;
+	size_t len;
+	size_t size;
+	int failed;				// Set once an allocation fails
+};
+
+// A bounded input buffer
+struct snapshot_reader {
+	const unsigned char *pos;
+	const unsigned char *end;
+	int failed;				// Set once a read is out of bounds
+	hash_function hash;		// Hash function of the set hashes
+};
+
+static int snapshot_cb(void *data, enum metric_type type, char *name, void *value);
+static int restore_record(struct metrics * m, enum metric_type type, const char *name, uint32_t name_len,
+		struct snapshot_reader * r);
+
+/*
+ * Output buffer
+ */
+
+static void put_bytes(struct snapshot_writer * w, const void *bytes, size_t len)
+{
+	if (w->failed)
+		return;
+	if (w->len + len > w->size) {
+		size_t size = (w->size) ? w->size : SNAPSHOT_MIN_SIZE;
+		while (size < w->len + len)
+			size *= 2;
+		char *buf = realloc(w->buf, size);
+		if (!buf) {
+			w->failed = 1;
+			return;
+		}
+		w->buf = buf;
+		w->size = size;
+	}
+	memcpy(w->buf + w->len, bytes, len);
+	w->len += len;
+}
+
+static void encode_u64(unsigned char *out, uint64_t val, int width)
+{
+	for (int i = 0; i < width; i++)
+		out[i] = val >> (8 * i);
+}
+
+static void put_u8(struct snapshot_writer * w, uint8_t val)
+{
+	put_bytes(w, &val, 1);
+}
+
+static void put_u32(struct snapshot_writer * w, uint32_t val)
+{
+	unsigned char out[4];
+	encode_u64(out, val, 4);
+	put_bytes(w, out, 4);
+}
+
+static void put_u64(struct snapshot_writer * w, uint64_t val)
+{
+	unsigned char out[8];
+	encode_u64(out, val, 8);
+	put_bytes(w, out, 8);
+}
+
+static void put_double(struct snapshot_writer * w, double val)
+{
+	uint64_t bits;
+	memcpy(&bits, &val, sizeof(bits));
+	put_u64(w, bits);
+}
+
+/*
+ * Input buffer
+ */
+
+static const unsigned char *get_bytes(struct snapshot_reader * r, size_t len)
+{
+	if (r->failed || (size_t)(r->end - r->pos) < len) {
+		r->failed = 1;
+		return NULL;
+	}
+	const unsigned char *bytes = r->pos;
+	r->pos += len;
+	return bytes;
+}
+
+static uint64_t decode_u64(const unsigned char *in, int width)
+{
+	uint64_t val = 0;
+	for (int i = 0; i < width; i++)
+		val |= (uint64_t)in[i] << (8 * i);
+	return val;
+}
+
+static uint8_t get_u8(struct snapshot_reader * r)
+{
+	const unsigned char *in = get_bytes(r, 1);
+	return (in) ? in[0] : 0;
+}
+
+static uint32_t get_u32(struct snapshot_reader * r)
+{
+	const unsigned char *in = get_bytes(r, 4);
+	return (in) ? decode_u64(in, 4) : 0;
+}
+
+static uint64_t get_u64(struct snapshot_reader * r)
+{
+	const unsigned char *in = get_bytes(r, 8);
+	return (in) ? decode_u64(in, 8) : 0;
+}
+
+static double get_double(struct snapshot_reader * r)
+{
+	uint64_t bits = get_u64(r);
+	double val;
+	memcpy(&val, &bits, sizeof(val));
+	return val;
+}
+
+// Checks that count entries of a size could be left to read
+static int can_read(struct snapshot_reader * r, uint64_t count, size_t size)
+{
+	if (r->failed || count > (uint64_t)(r->end - r->pos) / size) {
+		r->failed = 1;
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * Encodes the metrics into a snapshot. Timers are finalized.
+ * @arg m The metrics to encode
+ * @arg buf Output. The snapshot, to be freed by the caller
+ * @arg len Output. The length of the snapshot
+ * @return 0 on success, -1 on failure.
+ */
+int metrics_snapshot(struct metrics * m, char **buf, size_t *len)
+{
+	struct snapshot_writer w = { NULL, 0, 0, 0 };
+	put_bytes(&w, SNAPSHOT_MAGIC, 4);
+	put_u32(&w, SNAPSHOT_VERSION);
+	put_u8(&w, hash_selected());
+	metrics_iter(m, &w, snapshot_cb);
+	if (w.failed) {
+		free(w.buf);
+		return -1;
+	}
+	*buf = w.buf;
+	*len = w.len;
+	return 0;
+}
+
+// Encodes a timer
+static void put_timer(struct snapshot_writer * w, struct timer_hist * t)
+{
+	timer *tm = &t->tm;
+	put_u8(w, tm->engine);
+	put_u64(w, tm->actual_count);
+	put_u64(w, tm->count);
+	put_double(w, tm->sum);
+	put_double(w, tm->squared_sum);
+
+	if (tm->engine == QUANTILE_DDSKETCH) {
+		ddsketch *dd = &tm->quant.dd;
+		put_double(w, dd->alpha);
+		put_u64(w, dd->zero_count);
+		put_double(w, dd->min);
+		put_double(w, dd->max);
+
+		// The nonzero bins of each store
+		ddsketch_store *stores[] = { &dd->positive, &dd->negative };
+		for (int s = 0; s < 2; s++) {
+			ddsketch_store *store = stores[s];
+			uint32_t used = 0;
+			for (int32_t i = store->min_index; store->count && i <= store->max_index; i++) {
+				if (store->bins[i - store->offset])
+					used++;
+			}
+			put_u32(w, used);
+			for (int32_t i = store->min_index; store->count && i <= store->max_index; i++) {
+				uint64_t count = store->bins[i - store->offset];
+				if (!count)
+					continue;
+				put_u32(w, (uint32_t)i);
+				put_u64(w, count);
+			}
+		}
+	} else {
+		// The summary, after the buffers are flushed
+		finalize_timer(tm);
+		uint32_t count = tm->quant.cm.num_samples;
+		double *values = malloc(count * sizeof(double) + 1);
+		uint64_t *widths = malloc(count * sizeof(uint64_t) + 1);
+		uint64_t *deltas = malloc(count * sizeof(uint64_t) + 1);
+		if (!values || !widths || !deltas) {
+			w->failed = 1;
+		} else {
+			cm_get_samples(&tm->quant.cm, values, widths, deltas);
+			put_u64(w, tm->quant.cm.num_values);
+			put_u32(w, count);
+			for (uint32_t i = 0; i < count; i++) {
+				put_double(w, values[i]);
+				put_u64(w, widths[i]);
+				put_u64(w, deltas[i]);
+			}
+		}
+		free(values);
+		free(widths);
+		free(deltas);
+	}
+
+	// The nonzero histogram bins
+	if (!t->conf) {
+		put_u32(w, 0);
+		return;
+	}
+	uint32_t used = 0;
+	for (int i = 0; i < t->conf->num_bins; i++) {
+		if (histogram_count(&t->counts, i))
+			used++;
+	}
+	put_u32(w, t->conf->num_bins);
+	put_u32(w, used);
+	for (int i = 0; i < t->conf->num_bins; i++) {
+		uint64_t count = histogram_count(&t->counts, i);
+		if (!count)
+			continue;
+		put_u32(w, i);
+		put_u64(w, count);
+	}
+}
+
+// Encodes a set
+static void put_set(struct snapshot_writer * w, set_t * s)
+{
+	if (s->reset) {
+		put_u8(w, SNAPSHOT_SET_RESET);
+		put_u64(w, s->store.s.count);
+		return;
+	}
+
+	if (s->type == EXACT) {
+		exact_set *e = &s->store.s;
+		put_u8(w, SNAPSHOT_SET_EXACT);
+		put_u32(w, e->count);
+		if (e->has_zero)
+			put_u64(w, 0);
+		for (uint32_t i = 0; i < e->size; i++) {
+			if (e->hashes[i])
+				put_u64(w, e->hashes[i]);
+		}
+		return;
+	}
+
+	hll_t *h = &s->store.h;
+	const uint32_t *entries;
+	uint32_t count = hll_sparse_entries(h, &entries);
+	if (entries) {
+		put_u8(w, SNAPSHOT_SET_SPARSE);
+		put_u8(w, h->precision);
+		put_u32(w, count);
+		for (uint32_t i = 0; i < count; i++)
+			put_u32(w, entries[i]);
+		return;
+	}
+
+	uint32_t num_reg = 1 << h->precision;
+	uint8_t *regs = malloc(num_reg);
+	if (!regs) {
+		w->failed = 1;
+		return;
+	}
+	hll_get_registers(h, regs);
+	put_u8(w, SNAPSHOT_SET_DENSE);
+	put_u8(w, h->precision);
+	put_bytes(w, regs, num_reg);
+	free(regs);
+}
+
+// Encodes one metric as a record
+static int snapshot_cb(void *data, enum metric_type type, char *name, void *value)
+{
+	struct snapshot_writer *w = data;
+	uint32_t name_len = strlen(name);
+	put_u8(w, type);
+	put_u32(w, name_len);
+	put_bytes(w, name, name_len);
+
+	// Leave room for the payload length
+	size_t len_offset = w->len;
+	put_u64(w, 0);
+
+	switch (type) {
+	case metric_type_KEY_VAL:
+		put_double(w, *(double *)value);
+		break;
+
+	case metric_type_COUNTER: {
+		struct counter *c = value;
+		put_u64(w, c->actual_count);
+		put_u64(w, c->count);
+		put_double(w, c->sum);
+		put_double(w, c->squared_sum);
+		put_double(w, c->min);
+		put_double(w, c->max);
+		break;
+	}
+
+	case metric_type_TIMER:
+		put_timer(w, value);
+		break;
+
+	case metric_type_SET:
+		put_set(w, value);
+		break;
+
+	case metric_type_GAUGE: {
+		struct gauge *g = value;
+		put_u8(w, g->updated);
+		put_double(w, g->value);
+		put_double(w, g->prev_value);
+		put_u64(w, g->user);
+		put_u64(w, g->user_flags);
+		put_u64(w, g->timestamp_ms);
+		break;
+	}
+
+	default:
+		break;
+	}
+
+	// Patch in the payload length
+	if (w->failed)
+		return 1;
+	encode_u64((unsigned char *)w->buf + len_offset, w->len - len_offset - 8, 8);
+	return 0;
+}
+
+/**
+ * Merges a snapshot into the metrics. New metrics are created
+ * with the settings of the metrics, not of the snapshot.
+ * @arg m The metrics to restore into
+ * @arg buf The snapshot
+ * @arg len The length of the snapshot
+ * @return 0 on success, -1 if the snapshot is not valid or
+ * a record could not be merged.
+ */
+int metrics_restore(struct metrics * m, const char *buf, size_t len)
+{
+	struct snapshot_reader r = { (const unsigned char *)buf, (const unsigned char *)buf + len, 0, HASH_MURMUR3 };
+	const unsigned char *magic = get_bytes(&r, 4);
+	if (!magic || memcmp(magic, SNAPSHOT_MAGIC, 4))
+		return -1;
+	uint32_t version = get_u32(&r);
+	if (version == SNAPSHOT_VERSION)
+		r.hash = get_u8(&r);
+	else if (version != 1)
+		return -1;
+	if (r.failed)
+		return -1;
+
+	int rc = 0;
+	while (r.pos < r.end) {
+		enum metric_type type = get_u8(&r);
+		uint32_t name_len = get_u32(&r);
+		const char *name = (const char *)get_bytes(&r, name_len);
+		uint64_t payload_len = get_u64(&r);
+		if (r.failed || !can_read(&r, payload_len, 1))
+			return -1;
+
+		// Names are null terminated by the hashmaps
+		if (memchr(name, 0, name_len))
+			return -1;
+
+		// Decode the payload on its own, so unknown
+		// types and trailing fields are skipped
+		struct snapshot_reader payload = { r.pos, r.pos + payload_len, 0, r.hash };
+		r.pos += payload_len;
+		int res = restore_record(m, type, name, name_len, &payload);
+		if (payload.failed)
+			return -1;
+		if (res)
+			rc = -1;
+	}
+	return rc;
+}
+
+// Merges a timer record into a timer
+static int restore_timer(struct metrics * m, struct timer_hist * t, struct snapshot_reader * r)
+{
+	timer *tm = &t->tm;
+	quantile_engine engine = get_u8(r);
+	uint64_t actual_count = get_u64(r);
+	uint64_t count = get_u64(r);
+	double sum = get_double(r);
+	double squared_sum = get_double(r);
+	int rc = 0;
+
+	// Quantile engines can not be merged into one another. The
+	// stats are skipped too, to stay consistent with the quantiles,
+	// but the histogram is still restored.
+	int can_merge = (engine == tm->engine);
+	if (engine == QUANTILE_DDSKETCH) {
+		double alpha = get_double(r);
+		uint64_t zero_count = get_u64(r);
+		double min = get_double(r);
+		double max = get_double(r);
+		ddsketch *dd = &tm->quant.dd;
+		if (can_merge && alpha != dd->alpha)
+			can_merge = 0;
+		uint64_t prev_count = (can_merge) ? dd->count : 0;
+		for (int s = 0; s < 2; s++) {
+			uint32_t used = get_u32(r);
+			if (!can_read(r, used, 12))
+				return -1;
+			for (uint32_t i = 0; i < used; i++) {
+				int32_t index = (int32_t)get_u32(r);
+				uint64_t bin_count = get_u64(r);
+				if (can_merge && ddsketch_add_bin(dd, s, index, bin_count))
+					rc = -1;
+			}
+		}
+		if (can_merge) {
+			dd->zero_count += zero_count;
+			dd->count += zero_count;
+			if (!prev_count || min < dd->min)
+				dd->min = min;
+			if (!prev_count || max > dd->max)
+				dd->max = max;
+		}
+
+	} else if (engine == QUANTILE_CM) {
+		uint64_t num_values = get_u64(r);
+		uint32_t num_samples = get_u32(r);
+		if (!can_read(r, num_samples, 24))
+			return -1;
+		double *values = malloc(num_samples * sizeof(double) + 1);
+		uint64_t *widths = malloc(num_samples * sizeof(uint64_t) + 1);
+		uint64_t *deltas = malloc(num_samples * sizeof(uint64_t) + 1);
+		if (values && widths && deltas) {
+			for (uint32_t i = 0; i < num_samples; i++) {
+				values[i] = get_double(r);
+				widths[i] = get_u64(r);
+				deltas[i] = get_u64(r);
+
+				// The summary must be sorted
+				if (i && !(values[i - 1] <= values[i]))
+					r->failed = 1;
+			}
+			if (!r->failed && can_merge) {
+				if (cm_merge_samples(&tm->quant.cm, values, widths, deltas, num_samples, num_values))
+					rc = -1;
+				tm->finalized = 1;
+			}
+		} else {
+			rc = -1;
+		}
+		free(values);
+		free(widths);
+		free(deltas);
+	} else {
+		return -1;
+	}
+	if (r->failed)
+		return -1;
+
+	if (can_merge) {
+		tm->actual_count += actual_count;
+		tm->count += count;
+		tm->sum += sum;
+		tm->squared_sum += squared_sum;
+	} else {
+		rc = -1;
+	}
+
+	// Histogram counts, if the configs have the same bins
+	uint32_t num_bins = get_u32(r);
+	if (!num_bins)
+		return rc;
+	uint32_t used = get_u32(r);
+	if (!can_read(r, used, 12))
+		return -1;
+	int match = t->conf && (uint32_t)t->conf->num_bins == num_bins;
+	if (!match)
+		rc = -1;
+	for (uint32_t i = 0; i < used; i++) {
+		uint32_t bin = get_u32(r);
+		uint64_t bin_count = get_u64(r);
+		if (bin >= num_bins) {
+			r->failed = 1;
+			break;
+		}
+		if (match && histogram_counts_add(&t->counts, bin, bin_count))
+			rc = -1;
+	}
+	return rc;
+}
+
+// Merges a set record into a set
+static int restore_set(struct metrics * m, set_t * s, struct snapshot_reader * r)
+{
+	uint8_t kind = get_u8(r);
+	switch (kind) {
+	case SNAPSHOT_SET_RESET: {
+		// Only an empty set takes the last count
+		uint64_t count = get_u64(r);
+		if (s->reset || (s->type == EXACT && !s->store.s.count)) {
+			set_reset(s);
+			s->store.s.count = count;
+		}
+		return 0;
+	}
+
+	case SNAPSHOT_SET_EXACT: {
+		uint32_t count = get_u32(r);
+		if (!can_read(r, count, 8))
+			return -1;
+		if (r->hash != hash_selected())
+			return -1;
+		for (uint32_t i = 0; i < count; i++)
+			set_add_hash(s, get_u64(r));
+		return 0;
+	}
+
+	case SNAPSHOT_SET_SPARSE:
+	case SNAPSHOT_SET_DENSE: {
+		unsigned char precision = get_u8(r);
+		if (r->failed || precision < HLL_MIN_PRECISION || precision > HLL_MAX_PRECISION) {
+			r->failed = 1;
+			return -1;
+		}
+		if (r->hash != hash_selected())
+			return -1;
+
+		// Decode into an approximate set, then merge it
+		set_t approx;
+		approx.type = APPROX;
+		approx.reset = false;
+		approx.layout = s->layout;
+		approx.exact_size = s->exact_size;
+		approx.idle_intervals = 0;
+		if (hll_init_layout(precision, s->layout, &approx.store.h))
+			return -1;
+
+		int res = 0;
+		if (kind == SNAPSHOT_SET_SPARSE) {
+			uint32_t count = get_u32(r);
+			uint32_t *entries = NULL;
+			if (can_read(r, count, 4))
+				entries = malloc(count * sizeof(uint32_t) + 1);
+			if (entries) {
+				for (uint32_t i = 0; i < count; i++)
+					entries[i] = get_u32(r);
+				if (hll_merge_sparse(&approx.store.h, entries, count))
+					r->failed = 1;
+			}
+			free(entries);
+		} else {
+			const uint8_t *regs = get_bytes(r, 1 << precision);
+			if (regs && hll_merge_registers(&approx.store.h, regs))
+				r->failed = 1;
+		}
+		if (!r->failed)
+			res = set_merge(s, &approx);
+		set_destroy(&approx);
+		return (r->failed) ? -1 : res;
+	}
+
+	default:
+		r->failed = 1;
+		return -1;
+	}
+}
+
+// Merges one record into the metrics
+static int restore_record(struct metrics * m, enum metric_type type, const char *name, uint32_t name_len,
+		struct snapshot_reader * r)
+{
+	uint64_t hash = hashmap_hash_key(name, name_len);
+	switch (type) {
+	case metric_type_KEY_VAL: {
+		double val = get_double(r);
+		if (r->failed)
+			return -1;
+		return metrics_add_sample_n(m, type, name, name_len, hash, val, 1.0);
+	}
+
+	case metric_type_COUNTER: {
+		struct counter c;
+		init_counter(&c);
+		c.actual_count = get_u64(r);
+		c.count = get_u64(r);
+		c.sum = get_double(r);
+		c.squared_sum = get_double(r);
+		c.min = get_double(r);
+		c.max = get_double(r);
+		if (r->failed)
+			return -1;
+		struct counter *dst = metrics_get_counter(m, name, name_len, hash);
+		return (dst) ? counter_merge(dst, &c) : -1;
+	}
+
+	case metric_type_TIMER: {
+		struct timer_hist *t = metrics_get_timer(m, name, name_len, hash);
+		return (t) ? restore_timer(m, t, r) : -1;
+	}
+
+	case metric_type_SET: {
+		set_t *s = metrics_get_set(m, name, name_len, hash);
+		return (s) ? restore_set(m, s, r) : -1;
+	}
+
+	case metric_type_GAUGE:
+	case metric_type_GAUGE_DELTA: {
+		struct gauge g;
+		g.updated = get_u8(r);
+		g.value = get_double(r);
+		g.prev_value = get_double(r);
+		g.user = get_u64(r);
+		g.user_flags = get_u64(r);
+		g.timestamp_ms = get_u64(r);
+		if (r->failed)
+			return -1;
+		struct gauge *dst = metrics_get_gauge(m, name, name_len, hash);
+		if (!dst)
+			return -1;
+		*dst = g;
+		return 0;
+	}
+
+	default:
+		// Skip the types added by later writers
+		return 0;
+	}
+}
+
+/**
+ * Writes a snapshot of the metrics to a file. The snapshot is
+ * written to a temporary file first, and renamed into place.
+ * @arg m The metrics to encode
+ * @arg path The path of the file
+ * @return 0 on success, -1 on failure.
+ */
+int metrics_snapshot_file(struct metrics * m, const char *path)
+{
+	char *buf;
+	size_t len;
+	if (metrics_snapshot(m, &buf, &len))
+		return -1;
+
+	// Write next to the target, so the rename is atomic
+	size_t path_len = strlen(path);
+	char *tmp_path = malloc(path_len + 5);
+	if (!tmp_path) {
+		free(buf);
+		return -1;
+	}
+	memcpy(tmp_path, path, path_len);
+	memcpy(tmp_path + path_len, ".tmp", 5);
+
+	int res = -1;
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd >= 0) {
+		size_t written = 0;
+		ssize_t n = 0;
+		while (written < len && (n = write(fd, buf + written, len - written)) > 0)
+			written += n;
+		if (written == len && !fsync(fd))
+			res = 0;
+		if (close(fd))
+			res = -1;
+		if (!res && rename(tmp_path, path))
+			res = -1;
+		if (res)
+			unlink(tmp_path);
+	}
+	free(tmp_path);
+	free(buf);
+	return res;
+}
+
+/**
+ * Merges a snapshot file into the metrics. The file
+ * is mapped into memory, rather than read.
+ * @arg m The metrics to restore into
+ * @arg path The path of the file
+ * @return 0 on success, -1 on failure, as for metrics_restore.
+ */
+int metrics_restore_file(struct metrics * m, const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size < SNAPSHOT_V1_HEADER_SIZE) {
+		close(fd);
+		return -1;
+	}
+	void *buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (buf == MAP_FAILED)
+		return -1;
+
+	int res = metrics_restore(m, buf, st.st_size);
+	munmap(buf, st.st_size);
+	return res;
+}
@@ -1,9 +1,7 @@
 #include <math.h>
+#include <string.h>
 #include "timer.h"
 
-/* Static declarations */
-static void finalize_timer(timer * timer);
-
 /**
  * Initializes the timer struct
  * @arg eps The maximum error for the quantiles
@@ -13,14 +11,52 @@ static void finalize_timer(timer * timer);
  * @return 0 on success.
  */
 int init_timer(double eps, double *quantiles, uint32_t num_quants, timer * timer)
+{
+	return init_timer_mode(eps, quantiles, num_quants, CM_BUFFER_HEAP, timer);
+}
+
+/**
+ * Initializes the timer struct, with a given quantile buffering mode
+ * @arg eps The maximum error for the quantiles
+ * @arg quantiles A sorted array of double quantile values, must be on (0, 1)
+ * @arg num_quants The number of entries in the quantiles array
+ * @arg mode The buffering mode for the cm_quantile
+ * @arg timeer The timer struct to initialize
+ * @return 0 on success.
+ */
+int init_timer_mode(double eps, double *quantiles, uint32_t num_quants, cm_buffer_mode mode, timer * timer)
+{
+	return init_timer_engine(eps, quantiles, num_quants, QUANTILE_CM, mode, timer);
+}
+
+/**
+ * Initializes the timer struct, with a given quantile engine.
+ * For QUANTILE_DDSKETCH, eps is used as the relative accuracy.
+ * @arg eps The maximum error for the quantiles
+ * @arg quantiles A sorted array of double quantile values, must be on (0, 1)
+ * @arg num_quants The number of entries in the quantiles array
+ * @arg engine The quantile engine, QUANTILE_DEFAULT is QUANTILE_CM
+ * @arg mode The buffering mode for the cm_quantile
+ * @arg timeer The timer struct to initialize
+ * @return 0 on success.
+ */
+int init_timer_engine(double eps, double *quantiles, uint32_t num_quants, quantile_engine engine,
+		cm_buffer_mode mode, timer * timer)
 {
 	timer->actual_count = 0;
 	timer->count = 0;
 	timer->sum = 0;
 	timer->squared_sum = 0;
 	timer->finalized = 1;
-	int res = init_cm_quantile(eps, quantiles, num_quants, &timer->cm);
-	return res;
+
+	// Keep the buffering mode around for resets
+	timer->buffer_mode = mode;
+	if (engine == QUANTILE_DDSKETCH) {
+		timer->engine = QUANTILE_DDSKETCH;
+		return init_ddsketch(eps, 0, &timer->quant.dd);
+	}
+	timer->engine = QUANTILE_CM;
+	return init_cm_quantile_mode(eps, quantiles, num_quants, mode, &timer->quant.cm);
 }
 
 /**
@@ -30,7 +66,9 @@ int init_timer(double eps, double *quantiles, uint32_t num_quants, timer * timer
  */
 int destroy_timer(timer * timer)
 {
-	return destroy_cm_quantile(&timer->cm);
+	if (timer->engine == QUANTILE_DDSKETCH)
+		return destroy_ddsketch(&timer->quant.dd);
+	return destroy_cm_quantile(&timer->quant.cm);
 }
 
 /**
@@ -41,12 +79,23 @@ int destroy_timer(timer * timer)
  */
 int timer_add_sample(timer * timer, double sample, double sample_rate)
 {
+	// The sketch rejects samples that are not finite, and either
+	// engine can fail to allocate. Those samples must not be
+	// counted in the stats either.
+	int res;
+	if (timer->engine == QUANTILE_DDSKETCH) {
+		res = ddsketch_add_sample(&timer->quant.dd, sample);
+	} else {
+		timer->finalized = 0;
+		res = cm_add_sample(&timer->quant.cm, sample);
+	}
+	if (res)
+		return res;
 	timer->actual_count += 1;
 	timer->count += (1 / sample_rate);
 	timer->sum += sample;
 	timer->squared_sum += pow(sample, 2);
-	timer->finalized = 0;
-	return cm_add_sample(&timer->cm, sample);
+	return 0;
 }
 
 /**
@@ -57,8 +106,10 @@ int timer_add_sample(timer * timer, double sample, double sample_rate)
  */
 double timer_query(timer * timer, double quantile)
 {
+	if (timer->engine == QUANTILE_DDSKETCH)
+		return ddsketch_query(&timer->quant.dd, quantile);
 	finalize_timer(timer);
-	return cm_query(&timer->cm, quantile);
+	return cm_query(&timer->quant.cm, quantile);
 }
 
 /**
@@ -78,10 +129,10 @@ uint64_t timer_count(timer * timer)
  */
 double timer_min(timer * timer)
 {
+	if (timer->engine == QUANTILE_DDSKETCH)
+		return timer->quant.dd.min;
 	finalize_timer(timer);
-	if (!timer->cm.samples)
-		return 0;
-	return timer->cm.samples->value;
+	return cm_min(&timer->quant.cm);
 }
 
 /**
@@ -135,21 +186,62 @@ double timer_squared_sum(timer * timer)
  */
 double timer_max(timer * timer)
 {
+	if (timer->engine == QUANTILE_DDSKETCH)
+		return timer->quant.dd.max;
 	finalize_timer(timer);
-	if (!timer->cm.end)
+	return cm_max(&timer->quant.cm);
+}
+
+/**
+ * Merges the samples of one timer into another
+ * @arg dst The timer to merge into
+ * @arg src The timer to merge from. Finalized, but
+ * otherwise not modified.
+ * @return 0 on success, -1 if the engines differ or the
+ * quantiles could not be merged. The stats of dst are
+ * then unchanged.
+ */
+int timer_merge(timer * dst, timer * src)
+{
+	if (dst->engine != src->engine)
+		return -1;
+	if (dst->engine == QUANTILE_DDSKETCH) {
+		if (ddsketch_merge(&dst->quant.dd, &src->quant.dd))
+			return -1;
+		dst->actual_count += src->actual_count;
+		dst->count += src->count;
+		dst->sum += src->sum;
+		dst->squared_sum += src->squared_sum;
 		return 0;
-	return timer->cm.end->value;
+	}
+
+	// Merging flushes both quantile buffers. The stats are
+	// only added once the summary has the samples.
+	int res = cm_merge(&dst->quant.cm, &src->quant.cm);
+	dst->finalized = 1;
+	src->finalized = 1;
+	if (res)
+		return res;
+	dst->actual_count += src->actual_count;
+	dst->count += src->count;
+	dst->sum += src->sum;
+	dst->squared_sum += src->squared_sum;
+	return 0;
 }
 
-// Finalizes the timer for queries
-static void finalize_timer(timer * timer)
+/**
+ * Finalizes the timer for queries, flushing the
+ * quantile buffers. Queries do this as needed.
+ * @arg timer The timer to finalize
+ */
+void finalize_timer(timer * timer)
 {
 	if (timer->finalized)
 		return;
 
 	// Force the quantile to flush internal
 	// buffers so that queries are accurate.
-	cm_flush(&timer->cm);
+	cm_flush(&timer->quant.cm);
 
 	timer->finalized = 1;
 }
@@ -160,6 +252,37 @@ void reset_timer(double eps, double *quantiles, uint32_t num_quants, timer *time
 		return;
 	}
 
-	destroy_timer(timer);
-	init_timer(eps, quantiles, num_quants, timer);
+	// Reuse the allocations if the settings have not changed
+	if (timer->engine == QUANTILE_DDSKETCH && timer->quant.dd.alpha == eps) {
+		ddsketch_reset(&timer->quant.dd);
+	} else if (timer->engine == QUANTILE_CM && timer->quant.cm.eps == eps &&
+			timer->quant.cm.num_quantiles == num_quants &&
+			!memcmp(timer->quant.cm.quantiles, quantiles, num_quants * sizeof(double))) {
+		cm_reset(&timer->quant.cm);
+	} else {
+		// Keep the engine and buffering mode across resets
+		quantile_engine engine = timer->engine;
+		cm_buffer_mode mode = timer->buffer_mode;
+		destroy_timer(timer);
+		init_timer_engine(eps, quantiles, num_quants, engine, mode, timer);
+		return;
+	}
+
+	timer->actual_count = 0;
+	timer->count = 0;
+	timer->sum = 0;
+	timer->squared_sum = 0;
+	timer->finalized = 1;
+}
+
+/**
+ * Returns the memory allocated by the quantile engine of a timer.
+ * @arg timer The timer
+ * @return The size in bytes, without the struct itself.
+ */
+size_t timer_memory(timer * timer)
+{
+	if (timer->engine == QUANTILE_DDSKETCH)
+		return ddsketch_memory(&timer->quant.dd);
+	return cm_memory(&timer->quant.cm);
 }
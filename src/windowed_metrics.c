@@ -0,0 +1,414 @@
+#include <stdlib.h>
+#include <string.h>
+#include "windowed_metrics.h"
+
+// The slot of a window being subtracted from its totals
+struct expire_info {
+	struct windowed_metrics *wm;
+	uint32_t window;
+};
+
+static uint32_t window_slot(struct windowed_metrics * wm, uint32_t i);
+static int expire_cb(void *data, const char *key, void *value);
+static int totals_delete_cb(void *data, const char *key, void *value);
+static int merge_counter_cb(void *data, const char *key, void *value);
+static int merge_timer_cb(void *data, const char *key, void *value);
+static int merge_set_cb(void *data, const char *key, void *value);
+static int same_bins(const histogram_config * a, const histogram_config * b);
+
+/**
+ * Initializes the windowed metrics. Each slot is initialized
+ * with init_metrics using the same arguments.
+ * @arg windows The lengths of the windows, in intervals. Must be
+ * positive and ascending, and is copied.
+ * @arg num_windows The number of windows, must be positive
+ * @return 0 on success, -1 on invalid windows or allocation failure.
+ */
+int init_windowed_metrics(const uint32_t *windows, uint32_t num_windows, double timer_eps,
+		double *quantiles, uint32_t num_quants, struct radix_tree * histograms,
+		unsigned char set_precision, uint64_t set_max_exact, struct windowed_metrics * wm)
+{
+	if (!num_windows || !windows[0])
+		return -1;
+	for (uint32_t i = 1; i < num_windows; i++) {
+		if (windows[i] <= windows[i - 1])
+			return -1;
+	}
+
+	wm->num_slots = 0;
+	wm->current = 0;
+	wm->counters = NULL;
+	wm->num_windows = num_windows;
+	wm->windows = malloc(num_windows * sizeof(uint32_t));
+	wm->slots = calloc(windows[num_windows - 1], sizeof(struct metrics));
+	if (!wm->windows || !wm->slots || hashmap_init(0, &wm->counters)) {
+		destroy_windowed_metrics(wm);
+		return -1;
+	}
+	memcpy(wm->windows, windows, num_windows * sizeof(uint32_t));
+
+	int res;
+	for (uint32_t i = 0; i < windows[num_windows - 1]; i++) {
+		res = init_metrics(timer_eps, quantiles, num_quants, histograms,
+				set_precision, set_max_exact, wm->slots + i);
+		if (res) {
+			// Unwind the slots we managed to setup
+			destroy_windowed_metrics(wm);
+			return res;
+		}
+		wm->num_slots = i + 1;
+	}
+	return 0;
+}
+
+/**
+ * Destroys the windowed metrics, and all the slots.
+ * @return 0 on success.
+ */
+int destroy_windowed_metrics(struct windowed_metrics * wm)
+{
+	for (uint32_t i = 0; i < wm->num_slots; i++) {
+		destroy_metrics(wm->slots + i);
+	}
+	if (wm->counters) {
+		hashmap_iter(wm->counters, totals_delete_cb, NULL);
+		hashmap_destroy(wm->counters);
+	}
+	free(wm->slots);
+	free(wm->windows);
+	wm->slots = NULL;
+	wm->windows = NULL;
+	wm->counters = NULL;
+	wm->num_slots = 0;
+	wm->num_windows = 0;
+	return 0;
+}
+
+/**
+ * Returns the slot taking the samples of this interval.
+ * @return The current slot
+ */
+struct metrics *windowed_metrics_current(struct windowed_metrics * wm)
+{
+	return wm->slots + wm->current;
+}
+
+/**
+ * Adds a new sampled value to the current slot, and to the
+ * running totals of every window for counters.
+ * @arg type The type of the metrics
+ * @arg name The name of the metric, need not be null terminated
+ * @arg name_len The length of the name
+ * @arg hash The hash of the name, from hashmap_hash_key
+ * @arg val The sample to add
+ * @return 0 on success.
+ */
+int windowed_metrics_add_sample_n(struct windowed_metrics * wm, enum metric_type type, const char *name,
+		size_t name_len, uint64_t hash, double val, double sample_rate)
+{
+	if (type != metric_type_COUNTER)
+		return metrics_add_sample_n(wm->slots + wm->current, type, name, name_len, hash, val, sample_rate);
+
+	struct metrics *slot = wm->slots + wm->current;
+	struct counter *c = metrics_get_counter(slot, name, name_len, hash);
+	if (!c)
+		return -1;
+	counter_add_sample(c, val, sample_rate);
+
+	// A name over the limit of the slot may have been folded into
+	// the overflow name. The totals must use the same name, since
+	// they are only expired for the names the slots hold.
+	uint64_t limit = slot->name_limits[METRIC_NAMES_COUNTER];
+	if (limit && slot->limit_actions[METRIC_NAMES_COUNTER] == METRICS_LIMIT_FOLD &&
+			(uint64_t)hashmap_size(slot->counters) >= limit) {
+		void *stored;
+		if (hashmap_get_n(slot->counters, name, name_len, hash, &stored) || stored != c) {
+			name = METRICS_OVERFLOW_NAME;
+			name_len = sizeof(METRICS_OVERFLOW_NAME) - 1;
+			hash = slot->overflow_hash;
+		}
+	}
+
+	// One lookup updates the totals of all the windows
+	struct counter *totals;
+	if (hashmap_get_n(wm->counters, name, name_len, hash, (void **)&totals)) {
+		totals = malloc(wm->num_windows * sizeof(struct counter));
+		if (!totals)
+			return -1;
+		for (uint32_t i = 0; i < wm->num_windows; i++)
+			init_counter(totals + i);
+		void **slot;
+		if (hashmap_get_or_insert_n(wm->counters, name, name_len, hash, &slot) < 0) {
+			free(totals);
+			return -1;
+		}
+		*slot = totals;
+	}
+	for (uint32_t i = 0; i < wm->num_windows; i++)
+		counter_add_sample(totals + i, val, sample_rate);
+	return 0;
+}
+
+/**
+ * Adds a value to a named set of the current slot.
+ * @arg name The name of the set, need not be null terminated
+ * @arg name_len The length of the name
+ * @arg hash The hash of the name, from hashmap_hash_key
+ * @arg value The value to add
+ * @arg value_len The length of the value
+ * @return 0 on success
+ */
+int windowed_metrics_set_update_n(struct windowed_metrics * wm, const char *name, size_t name_len,
+		uint64_t hash, const char *value, size_t value_len)
+{
+	return metrics_set_update_n(wm->slots + wm->current, name, name_len, hash, value, value_len);
+}
+
+/**
+ * Ends the current interval. The oldest slot of each window
+ * is subtracted from its counter totals, and the oldest slot
+ * of the ring is reset with metrics_reset to take the next
+ * interval, keeping its settings.
+ * @return 0 on success, -1 if the slot could not be reset.
+ */
+int windowed_metrics_advance(struct windowed_metrics * wm)
+{
+	// The longest window goes last, so the totals of a name
+	// can be deleted once it has no samples left
+	struct expire_info info = {wm, 0};
+	for (; info.window < wm->num_windows; info.window++) {
+		struct metrics *oldest = wm->slots + window_slot(wm, wm->windows[info.window] - 1);
+		hashmap_iter(oldest->counters, expire_cb, &info);
+	}
+
+	// The oldest slot of the ring follows the current one. It
+	// is reset in place, keeping its settings and the names
+	// that had samples, which likely come back.
+	wm->current = (wm->current + 1) % wm->num_slots;
+	return metrics_reset(wm->slots + wm->current, 0);
+}
+
+/**
+ * Reads a counter over a window. The count, sum and squared
+ * sum come from the running totals, the min and the max are
+ * merged from the slots.
+ * @arg window The index of the window in the windows array
+ * @arg out Output. The counter of the window
+ * @return 0 on success, -1 if the counter has no samples
+ * in the window.
+ */
+int windowed_metrics_counter(struct windowed_metrics * wm, uint32_t window, const char *name,
+		size_t name_len, uint64_t hash, struct counter * out)
+{
+	init_counter(out);
+	struct counter *totals;
+	if (window >= wm->num_windows || hashmap_get_n(wm->counters, name, name_len, hash, (void **)&totals))
+		return -1;
+	if (!totals[window].actual_count)
+		return -1;
+
+	struct counter *c;
+	for (uint32_t i = 0; i < wm->windows[window]; i++) {
+		struct metrics *m = wm->slots + window_slot(wm, i);
+		if (!hashmap_get_n(m->counters, name, name_len, hash, (void **)&c))
+			counter_merge(out, c);
+	}
+
+	// The merged sums are the same, up to the rounding
+	// of the subtractions, so take the totals
+	out->actual_count = totals[window].actual_count;
+	out->count = totals[window].count;
+	out->sum = totals[window].sum;
+	out->squared_sum = totals[window].squared_sum;
+	return 0;
+}
+
+/**
+ * Merges a timer over the slots of a window. The output
+ * timer is initialized here with the engine of the slots,
+ * and must be destroyed with destroy_timer on success.
+ * @arg window The index of the window in the windows array
+ * @arg out Output. The timer of the window
+ * @return 0 on success, -1 if the timer has no samples
+ * in the window or the merge failed.
+ */
+int windowed_metrics_timer(struct windowed_metrics * wm, uint32_t window, const char *name,
+		size_t name_len, uint64_t hash, timer * out)
+{
+	if (window >= wm->num_windows)
+		return -1;
+
+	int found = 0, res = 0;
+	struct timer_hist *t;
+	for (uint32_t i = 0; i < wm->windows[window]; i++) {
+		struct metrics *m = wm->slots + window_slot(wm, i);
+		if (hashmap_get_n(m->timers, name, name_len, hash, (void **)&t) || !t->tm.actual_count)
+			continue;
+		if (!found) {
+			if (init_timer_engine(m->timer_eps, m->quantiles, m->num_quants, t->tm.engine,
+						m->timer_buffer_mode, out))
+				return -1;
+			found = 1;
+		}
+		if (timer_merge(out, &t->tm))
+			res = -1;
+	}
+	if (found && res)
+		destroy_timer(out);
+	return (found) ? res : -1;
+}
+
+/**
+ * Merges a set over the slots of a window. The output
+ * set is initialized here, and must be destroyed with
+ * set_destroy on success.
+ * @arg window The index of the window in the windows array
+ * @arg out Output. The set of the window
+ * @return 0 on success, -1 if the set has no values
+ * in the window or the merge failed.
+ */
+int windowed_metrics_set(struct windowed_metrics * wm, uint32_t window, const char *name,
+		size_t name_len, uint64_t hash, set_t * out)
+{
+	if (window >= wm->num_windows)
+		return -1;
+
+	int found = 0, res = 0;
+	set_t *s;
+	for (uint32_t i = 0; i < wm->windows[window]; i++) {
+		struct metrics *m = wm->slots + window_slot(wm, i);
+		if (hashmap_get_n(m->sets, name, name_len, hash, (void **)&s) || s->reset)
+			continue;
+		if (!found) {
+			if (set_init_layout(m->set_precision, s->layout, out, m->set_max_exact))
+				return -1;
+			found = 1;
+		}
+		if (set_merge(out, s))
+			res = -1;
+	}
+	if (found && res)
+		set_destroy(out);
+	return (found) ? res : -1;
+}
+
+/**
+ * Merges all the counters, timers and sets of a window into
+ * a metrics struct, to report the window with metrics_iter.
+ * Timer histograms are merged when their configs have the same
+ * scale, bounds, bin width and number of bins.
+ * @arg window The index of the window in the windows array
+ * @arg out The metrics to merge into, initialized by the caller
+ * @return 0 on success, -1 if any metric failed to merge.
+ */
+int windowed_metrics_merge(struct windowed_metrics * wm, uint32_t window, struct metrics * out)
+{
+	if (window >= wm->num_windows)
+		return -1;
+
+	// The callbacks keep going on failures, and flag them in res
+	int res = 0;
+	void *info[2] = {out, &res};
+	for (uint32_t i = 0; i < wm->windows[window]; i++) {
+		struct metrics *m = wm->slots + window_slot(wm, i);
+		hashmap_iter(m->counters, merge_counter_cb, info);
+		hashmap_iter(m->timers, merge_timer_cb, info);
+		hashmap_iter(m->sets, merge_set_cb, info);
+	}
+	return res;
+}
+
+// Returns the index of the slot i intervals before the current one
+static uint32_t window_slot(struct windowed_metrics * wm, uint32_t i)
+{
+	return (wm->current + wm->num_slots - i) % wm->num_slots;
+}
+
+// Subtracts a counter of an expiring slot from the totals of a window
+static int expire_cb(void *data, const char *key, void *value)
+{
+	struct expire_info *info = data;
+	struct counter *c = value;
+	struct counter *totals;
+	if (hashmap_get(info->wm->counters, (char *)key, (void **)&totals))
+		return 0;
+
+	struct counter *t = totals + info->window;
+	t->actual_count -= c->actual_count;
+	t->count -= c->count;
+	t->sum -= c->sum;
+	t->squared_sum -= c->squared_sum;
+
+	// Drop the rounding of the sums once the window is empty
+	if (!t->actual_count)
+		init_counter(t);
+
+	// The longest window has all the samples of the others
+	if (info->window == info->wm->num_windows - 1 && !t->actual_count) {
+		free(totals);
+		hashmap_delete(info->wm->counters, (char *)key);
+	}
+	return 0;
+}
+
+// Frees the counter totals of a name
+static int totals_delete_cb(void *data, const char *key, void *value)
+{
+	free(value);
+	return 0;
+}
+
+// Merges a counter of a slot into the output metrics
+static int merge_counter_cb(void *data, const char *key, void *value)
+{
+	void **info = data;
+	if (!((struct counter *)value)->actual_count)
+		return 0;
+	struct counter *dst = metrics_get_counter(info[0], key, strlen(key), hashmap_hash_key(key, strlen(key)));
+	if (!dst || counter_merge(dst, value))
+		*(int *)info[1] = -1;
+	return 0;
+}
+
+// Merges a timer of a slot, and its histogram, into the output metrics
+static int merge_timer_cb(void *data, const char *key, void *value)
+{
+	void **info = data;
+	struct timer_hist *src = value;
+	if (!src->tm.actual_count)
+		return 0;
+	struct timer_hist *dst = metrics_get_timer(info[0], key, strlen(key), hashmap_hash_key(key, strlen(key)));
+	if (!dst || timer_merge(&dst->tm, &src->tm)) {
+		*(int *)info[1] = -1;
+		return 0;
+	}
+
+	if (!src->conf || !dst->conf || !same_bins(dst->conf, src->conf))
+		return 0;
+	for (int bin = 0; bin < src->conf->num_bins; bin++) {
+		uint64_t count = histogram_count(&src->counts, bin);
+		if (count && histogram_counts_add(&dst->counts, bin, count))
+			*(int *)info[1] = -1;
+	}
+	return 0;
+}
+
+// Checks if two histogram configs bin the samples the same way
+static int same_bins(const histogram_config * a, const histogram_config * b)
+{
+	return a == b || (a->scale == b->scale && a->num_bins == b->num_bins &&
+			a->min_val == b->min_val && a->max_val == b->max_val &&
+			a->bin_width == b->bin_width);
+}
+
+// Merges a set of a slot into the output metrics
+static int merge_set_cb(void *data, const char *key, void *value)
+{
+	void **info = data;
+	if (((set_t *)value)->reset)
+		return 0;
+	set_t *dst = metrics_get_set(info[0], key, strlen(key), hashmap_hash_key(key, strlen(key)));
+	if (!dst || set_merge(dst, value))
+		*(int *)info[1] = -1;
+	return 0;
+}